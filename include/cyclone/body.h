@@ -184,6 +184,23 @@ namespace cyclone {
          */
         bool canSleep;
 
+        /**
+         * Bodies with continuous collision detection enabled are
+         * swept along the path they took during the last integration
+         * step by the swept collision tests, so they can't pass
+         * through thin objects between one step and the next. It is
+         * only worth enabling for small, fast bodies such as
+         * projectiles.
+         */
+        bool ccdEnabled;
+
+        /**
+         * Holds the position of the body at the start of the last
+         * integration step. This is only kept up to date for bodies
+         * with continuous collision detection enabled.
+         */
+        Vector3 lastPosition;
+
         /**
          * Holds a transform matrix for converting body space into
          * world space and vice versa. This can be achieved by calling
@@ -247,6 +264,12 @@ namespace cyclone {
          */
         /*@{*/
 
+        /**
+         * Creates a body with continuous collision detection turned
+         * off. The rest of its data must be set before it is used.
+         */
+        RigidBody();
+
         /*@}*/
 
 
@@ -832,6 +855,33 @@ namespace cyclone {
          */
         void setCanSleep(const bool canSleep=true);
 
+        /**
+         * Returns true if the body has continuous collision detection
+         * enabled.
+         */
+        bool getCcdEnabled() const
+        {
+            return ccdEnabled;
+        }
+
+        /**
+         * Sets whether the body has continuous collision detection
+         * enabled. Bodies should have it disabled unless they move
+         * far enough in a single step to pass through other objects.
+         *
+         * @param ccdEnabled Whether the body should be swept.
+         */
+        void setCcdEnabled(const bool ccdEnabled=true);
+
+        /**
+         * Gets the position of the body at the start of the last
+         * integration step. If the body doesn't have continuous
+         * collision detection enabled, this is not kept up to date.
+         *
+         * @return The position of the body before the last step.
+         */
+        Vector3 getLastPosition() const;
+
         /*@}*/
 
 
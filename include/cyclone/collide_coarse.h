@@ -25,6 +25,11 @@
 
 namespace cyclone {
 
+    // Forward declarations of the primitives bounding volumes can be
+    // built around.
+    class CollisionBox;
+    class CollisionSphere;
+
     /**
      * Represents a bounding sphere that can be tested for overlap.
      */
@@ -61,6 +66,18 @@ namespace cyclone {
          */
         real getGrowth(const BoundingSphere &other) const;
 
+        /**
+         * Checks if this bounding sphere completely encloses the other
+         * given bounding sphere.
+         */
+        bool contains(const BoundingSphere &other) const;
+
+        /**
+         * Grows the bounding sphere by the given margin in every
+         * direction.
+         */
+        void expand(real margin);
+
         /**
          * Returns the volume of this bounding volume. This is used
          * to calculate how to recurse into the bounding volume tree.
@@ -72,6 +89,82 @@ namespace cyclone {
         }
     };
 
+    /**
+     * Represents an axis-aligned bounding box that can be tested for
+     * overlap. Boxes bound long, thin objects much more tightly than
+     * spheres, so far fewer pairs pass the coarse test only to be
+     * rejected by the fine one.
+     */
+    struct BoundingBox
+    {
+        Vector3 minimum;
+        Vector3 maximum;
+
+    public:
+        /**
+         * Creates a new bounding box with the given corners.
+         */
+        BoundingBox(const Vector3 &minimum, const Vector3 &maximum);
+
+        /**
+         * Creates a bounding box to enclose the two given bounding
+         * boxes.
+         */
+        BoundingBox(const BoundingBox &one, const BoundingBox &two);
+
+        /**
+         * Creates the bounding box of the given collision box, as it
+         * is currently positioned. The box's internals should have
+         * been calculated.
+         */
+        explicit BoundingBox(const CollisionBox &box);
+
+        /**
+         * Creates the bounding box of the given collision sphere, as
+         * it is currently positioned. The sphere's internals should
+         * have been calculated.
+         */
+        explicit BoundingBox(const CollisionSphere &sphere);
+
+        /**
+         * Checks if the bounding box overlaps with the other given
+         * bounding box. Boxes that only touch count as overlapping.
+         */
+        bool overlaps(const BoundingBox *other) const;
+
+        /**
+         * Reports how much this bounding box would have to grow by to
+         * incorporate the given bounding box, as the growth in its
+         * size (see getSize).
+         */
+        real getGrowth(const BoundingBox &other) const;
+
+        /**
+         * Checks if this bounding box completely encloses the other
+         * given bounding box.
+         */
+        bool contains(const BoundingBox &other) const;
+
+        /**
+         * Grows the bounding box by the given margin in every
+         * direction.
+         */
+        void expand(real margin);
+
+        /**
+         * Returns the size of this bounding box, used to decide where
+         * to put and how to recurse into bounding volume trees. This
+         * is half the surface area of the box rather than its volume,
+         * since the chance of a box being hit is proportional to its
+         * area, and a flat box still has a sensible size.
+         */
+        real getSize() const
+        {
+            Vector3 extent = maximum - minimum;
+            return extent.x*extent.y + extent.y*extent.z + extent.z*extent.x;
+        }
+    };
+
     /**
      * Stores a potential contact to check later.
      */
@@ -126,7 +219,7 @@ namespace cyclone {
          */
         BVHNode(BVHNode *parent, const BoundingVolumeClass &volume,
             RigidBody* body=NULL)
-            : parent(parent), volume(volume), body(body)
+            : volume(volume), body(body), parent(parent)
         {
             children[0] = children[1] = NULL;
         }
@@ -203,7 +296,7 @@ namespace cyclone {
         const BVHNode<BoundingVolumeClass> * other
         ) const
     {
-        return volume->overlaps(other->volume);
+        return volume.overlaps(&other->volume);
     }
 
     template<class BoundingVolumeClass>
@@ -266,6 +359,8 @@ namespace cyclone {
             parent->body = sibling->body;
             parent->children[0] = sibling->children[0];
             parent->children[1] = sibling->children[1];
+            if (parent->children[0]) parent->children[0]->parent = parent;
+            if (parent->children[1]) parent->children[1]->parent = parent;
 
             // Delete the sibling (we blank its parent and
             // children to avoid processing/deleting them)
@@ -288,7 +383,7 @@ namespace cyclone {
         }
         if (children[1]) {
             children[1]->parent = NULL;
-            delete children[0];
+            delete children[1];
         }
     }
 
@@ -306,7 +401,7 @@ namespace cyclone {
             );
 
         // Recurse up the tree
-        if (parent) parent->recalculateBoundingVolume(true);
+        if (recurse && parent) parent->recalculateBoundingVolume(true);
     }
 
     template<class BoundingVolumeClass>
@@ -318,11 +413,24 @@ namespace cyclone {
         // if we're a leaf node.
         if (isLeaf() || limit == 0) return 0;
 
-        // Get the potential contacts of one of our children with
-        // the other
-        return children[0]->getPotentialContactsWith(
-            children[1], contacts, limit
+        // Get the potential contacts within each of our children.
+        unsigned count = children[0]->getPotentialContacts(
+            contacts, limit
             );
+        if (limit > count) {
+            count += children[1]->getPotentialContacts(
+                contacts+count, limit-count
+                );
+        }
+
+        // Then the potential contacts of one of our children with
+        // the other.
+        if (limit > count) {
+            count += children[0]->getPotentialContactsWith(
+                children[1], contacts+count, limit-count
+                );
+        }
+        return count;
     }
 
     template<class BoundingVolumeClass>
@@ -348,7 +456,7 @@ namespace cyclone {
         // a leaf, then we descend the other. If both are branches,
         // then we use the one with the largest size.
         if (other->isLeaf() ||
-            (!isLeaf() && volume->getSize() >= other->volume->getSize()))
+            (!isLeaf() && volume.getSize() >= other->volume.getSize()))
         {
             // Recurse into ourself
             unsigned count = children[0]->getPotentialContactsWith(
@@ -382,6 +490,1171 @@ namespace cyclone {
         }
     }
 
+    /**
+     * A bounding volume hierarchy for bodies that move, and that are
+     * added and removed as the simulation runs. It is used as a broad
+     * phase: each frame the bodies that have moved are updated, and
+     * the pairs of bodies whose volumes overlap are read out.
+     *
+     * Unlike BVHNode, the nodes are held in a single array and refer
+     * to each other by index, and the nodes of removed bodies are
+     * reused, so once the tree has grown to the size it needs it
+     * doesn't allocate memory.
+     *
+     * Each body is held in a leaf with a fattened volume: the volume
+     * it is given grown by a margin. While a body stays inside its
+     * fattened volume, updating it costs no more than a containment
+     * test. When it moves out, its leaf is removed and inserted again,
+     * and only the nodes above the leaf are refitted. On the way up,
+     * nodes are rotated: as in an AVL tree when one side has grown
+     * too tall, so inserting, removing or moving a body takes
+     * O(log n) time however the bodies are added, and otherwise to
+     * make the volumes tighter.
+     *
+     * Potential contacts are found by walking the hierarchy against
+     * itself, so pairs of distant groups of bodies are rejected with
+     * one test.
+     *
+     * New leaves are placed where they add least to the sizes of the
+     * nodes above them, after the surface area heuristic used to
+     * build ray tracing hierarchies, with getSize standing in for the
+     * area.
+     *
+     * As well as the combining constructor, overlaps and getSize
+     * used by BVHNode, the bounding volume class needs a contains
+     * method, to check it encloses another volume, and an expand
+     * method, to grow it by a margin.
+     */
+    template<class BoundingVolumeClass>
+    class DynamicBVH
+    {
+    public:
+        /**
+         * Marks a missing node, such as the parent of the root.
+         */
+        static const unsigned NO_NODE = 0xffffffff;
+
+        /**
+         * Creates a new empty hierarchy, whose leaves are grown by the
+         * given margin.
+         */
+        DynamicBVH(real margin = (real)0.1)
+            : root(NO_NODE), freeNodes(NO_NODE), bodyCount(0), margin(margin)
+        {
+        }
+
+        /**
+         * Adds the given body to the hierarchy, with the given bounding
+         * volume. Returns the index of the body's leaf, which is used
+         * to update and remove it.
+         */
+        unsigned insert(RigidBody *body, const BoundingVolumeClass &volume);
+
+        /**
+         * Removes the body with the given leaf from the hierarchy.
+         */
+        void remove(unsigned leaf);
+
+        /**
+         * Gives the body with the given leaf a new bounding volume.
+         * Returns true if the body has moved out of its fattened
+         * volume, so its leaf had to be moved in the hierarchy.
+         */
+        bool update(unsigned leaf, const BoundingVolumeClass &volume);
+
+        /**
+         * Removes all the bodies from the hierarchy.
+         */
+        void clear();
+
+        /**
+         * Returns the body held in the given leaf.
+         */
+        RigidBody *getBody(unsigned leaf) const
+        {
+            return nodes[leaf].body;
+        }
+
+        /**
+         * Returns the fattened bounding volume of the given leaf.
+         */
+        const BoundingVolumeClass &getVolume(unsigned leaf) const
+        {
+            return nodes[leaf].volume;
+        }
+
+        /**
+         * Returns the number of bodies in the hierarchy.
+         */
+        unsigned getBodyCount() const
+        {
+            return bodyCount;
+        }
+
+        /**
+         * Returns the number of levels in the hierarchy, counting the
+         * leaves.
+         */
+        unsigned getHeight() const
+        {
+            return root == NO_NODE ? 0 : nodes[root].height + 1;
+        }
+
+        /**
+         * Writes each pair of bodies whose fattened volumes overlap
+         * to the given array (up to the given limit). Returns the
+         * number of potential contacts it found.
+         *
+         * This uses storage held in the hierarchy, so it can't be
+         * called from more than one thread at once, or at the same
+         * time as query.
+         */
+        unsigned getPotentialContacts(PotentialContact* contacts,
+                                      unsigned limit);
+
+        /**
+         * Writes the leaves whose fattened volumes overlap the given
+         * volume to the given array (up to the given limit). Returns
+         * the number of leaves it found.
+         *
+         * As with getPotentialContacts, this uses storage held in the
+         * hierarchy, so only one query can be run at a time.
+         */
+        unsigned query(const BoundingVolumeClass &volume,
+                       unsigned *leaves, unsigned limit);
+
+    protected:
+        /**
+         * A node in the hierarchy. A leaf has no children, and holds
+         * a body. Nodes that aren't in use have a negative height,
+         * and are chained together through their parent index.
+         */
+        struct Node
+        {
+            BoundingVolumeClass volume;
+            RigidBody *body;
+            unsigned parent;
+            unsigned children[2];
+            int height;
+
+            Node(const BoundingVolumeClass &volume)
+                : volume(volume), body(NULL), parent(NO_NODE), height(0)
+            {
+                children[0] = children[1] = NO_NODE;
+            }
+
+            bool isLeaf() const
+            {
+                return children[0] == NO_NODE;
+            }
+        };
+
+        /** Holds the nodes, both those in use and those free. */
+        std::vector<Node> nodes;
+
+        /** Holds the top node of the hierarchy. */
+        unsigned root;
+
+        /** Holds the first node that isn't in use. */
+        unsigned freeNodes;
+
+        /** Holds the number of bodies in the hierarchy. */
+        unsigned bodyCount;
+
+        /** Holds the margin leaves are fattened by. */
+        real margin;
+
+        /**
+         * Holds the nodes still to be visited by the queries. It is
+         * kept between queries so they don't allocate memory.
+         */
+        std::vector<unsigned> stack;
+
+        /**
+         * Returns a node that isn't in use, set to the given volume.
+         */
+        unsigned allocateNode(const BoundingVolumeClass &volume);
+
+        /**
+         * Returns the given node to the free list.
+         */
+        void freeNode(unsigned index);
+
+        /**
+         * Links the given leaf into the hierarchy, where it adds
+         * least to the sizes of the nodes above it.
+         */
+        void insertLeaf(unsigned leaf);
+
+        /**
+         * Unlinks the given leaf from the hierarchy, replacing its
+         * parent with its sibling.
+         */
+        void removeLeaf(unsigned leaf);
+
+        /**
+         * Recalculates the volume and height of the given node and
+         * each node above it, balancing each as it goes.
+         */
+        void refit(unsigned index);
+
+        /**
+         * If one child of the given node is more than two levels
+         * taller than the other, rotates the taller child up to take
+         * the node's place, keeping the hierarchy's height in
+         * O(log n). Otherwise rotates the node's grandchildren to
+         * tighten its children's volumes. Returns the node now in the
+         * given node's place.
+         */
+        unsigned balance(unsigned index);
+
+        /**
+         * Swaps a child of the given node with a grandchild on the
+         * other side, if that makes the child's volume smaller.
+         */
+        void rotate(unsigned index);
+
+        /**
+         * Recalculates the volume and height of the given node from
+         * its children.
+         */
+        void recalculate(unsigned index);
+    };
+
+    template<class BoundingVolumeClass>
+    const unsigned DynamicBVH<BoundingVolumeClass>::NO_NODE;
+
+    template<class BoundingVolumeClass>
+    unsigned DynamicBVH<BoundingVolumeClass>::insert(
+        RigidBody *body, const BoundingVolumeClass &volume
+        )
+    {
+        BoundingVolumeClass fattened = volume;
+        fattened.expand(margin);
+
+        unsigned leaf = allocateNode(fattened);
+        nodes[leaf].body = body;
+        insertLeaf(leaf);
+        bodyCount++;
+        return leaf;
+    }
+
+    template<class BoundingVolumeClass>
+    void DynamicBVH<BoundingVolumeClass>::remove(unsigned leaf)
+    {
+        removeLeaf(leaf);
+        freeNode(leaf);
+        bodyCount--;
+    }
+
+    template<class BoundingVolumeClass>
+    bool DynamicBVH<BoundingVolumeClass>::update(
+        unsigned leaf, const BoundingVolumeClass &volume
+        )
+    {
+        // If the body is still inside its fattened volume, the
+        // hierarchy doesn't need to change.
+        if (nodes[leaf].volume.contains(volume)) return false;
+
+        removeLeaf(leaf);
+        nodes[leaf].volume = volume;
+        nodes[leaf].volume.expand(margin);
+        insertLeaf(leaf);
+        return true;
+    }
+
+    template<class BoundingVolumeClass>
+    void DynamicBVH<BoundingVolumeClass>::clear()
+    {
+        nodes.clear();
+        root = NO_NODE;
+        freeNodes = NO_NODE;
+        bodyCount = 0;
+    }
+
+    template<class BoundingVolumeClass>
+    unsigned DynamicBVH<BoundingVolumeClass>::getPotentialContacts(
+        PotentialContact* contacts, unsigned limit
+        )
+    {
+        if (root == NO_NODE) return 0;
+
+        // We walk the hierarchy against itself. The stack holds pairs
+        // of nodes still to be checked against each other, and a node
+        // paired with itself stands for the pairs inside it.
+        unsigned count = 0;
+        stack.clear();
+        stack.push_back(root);
+        stack.push_back(root);
+        while (!stack.empty())
+        {
+            unsigned second = stack.back();
+            stack.pop_back();
+            unsigned first = stack.back();
+            stack.pop_back();
+            const Node &one = nodes[first];
+            const Node &two = nodes[second];
+
+            if (first == second)
+            {
+                if (one.isLeaf()) continue;
+                stack.push_back(one.children[0]);
+                stack.push_back(one.children[0]);
+                stack.push_back(one.children[1]);
+                stack.push_back(one.children[1]);
+                stack.push_back(one.children[0]);
+                stack.push_back(one.children[1]);
+                continue;
+            }
+
+            if (!one.volume.overlaps(&two.volume)) continue;
+
+            // If we're both at leaf nodes, then we have a potential
+            // contact, if there is room for it.
+            if (one.isLeaf() && two.isLeaf())
+            {
+                if (count == limit) return count;
+                contacts[count].body[0] = one.body;
+                contacts[count].body[1] = two.body;
+                count++;
+            }
+
+            // Otherwise we descend into the larger node, as BVHNode
+            // does.
+            else if (two.isLeaf() ||
+                (!one.isLeaf() &&
+                 one.volume.getSize() >= two.volume.getSize()))
+            {
+                stack.push_back(one.children[0]);
+                stack.push_back(second);
+                stack.push_back(one.children[1]);
+                stack.push_back(second);
+            }
+            else
+            {
+                stack.push_back(first);
+                stack.push_back(two.children[0]);
+                stack.push_back(first);
+                stack.push_back(two.children[1]);
+            }
+        }
+        return count;
+    }
+
+    template<class BoundingVolumeClass>
+    unsigned DynamicBVH<BoundingVolumeClass>::query(
+        const BoundingVolumeClass &volume, unsigned *leaves, unsigned limit
+        )
+    {
+        if (root == NO_NODE) return 0;
+
+        unsigned count = 0;
+        stack.clear();
+        stack.push_back(root);
+        while (!stack.empty() && count < limit)
+        {
+            unsigned index = stack.back();
+            stack.pop_back();
+
+            const Node &node = nodes[index];
+            if (!node.volume.overlaps(&volume)) continue;
+
+            if (node.isLeaf())
+            {
+                leaves[count++] = index;
+            }
+            else
+            {
+                stack.push_back(node.children[0]);
+                stack.push_back(node.children[1]);
+            }
+        }
+        return count;
+    }
+
+    template<class BoundingVolumeClass>
+    unsigned DynamicBVH<BoundingVolumeClass>::allocateNode(
+        const BoundingVolumeClass &volume
+        )
+    {
+        // Grow the array if there are no free nodes. This may move
+        // the nodes, so we don't hold references to them across it.
+        if (freeNodes == NO_NODE)
+        {
+            nodes.push_back(Node(volume));
+            return (unsigned)nodes.size() - 1;
+        }
+
+        unsigned index = freeNodes;
+        freeNodes = nodes[index].parent;
+        nodes[index] = Node(volume);
+        return index;
+    }
+
+    template<class BoundingVolumeClass>
+    void DynamicBVH<BoundingVolumeClass>::freeNode(unsigned index)
+    {
+        nodes[index].body = NULL;
+        nodes[index].height = -1;
+        nodes[index].parent = freeNodes;
+        freeNodes = index;
+    }
+
+    template<class BoundingVolumeClass>
+    void DynamicBVH<BoundingVolumeClass>::insertLeaf(unsigned leaf)
+    {
+        if (root == NO_NODE)
+        {
+            root = leaf;
+            nodes[leaf].parent = NO_NODE;
+            return;
+        }
+
+        // Find the best sibling for the new leaf. Pairing the leaf
+        // with a node costs the size of the new parent, plus the
+        // growth of every node above it. We go down while one of the
+        // children would be cheaper to pair with than the node.
+        const BoundingVolumeClass &volume = nodes[leaf].volume;
+        unsigned sibling = root;
+        while (!nodes[sibling].isLeaf())
+        {
+            const Node &node = nodes[sibling];
+            real combined = BoundingVolumeClass(node.volume, volume).getSize();
+            real cost = 2 * combined;
+            real inherited = 2 * (combined - node.volume.getSize());
+
+            real childCost[2];
+            for (unsigned i = 0; i < 2; i++)
+            {
+                const Node &child = nodes[node.children[i]];
+                childCost[i] = inherited +
+                    BoundingVolumeClass(child.volume, volume).getSize();
+                if (!child.isLeaf()) childCost[i] -= child.volume.getSize();
+            }
+
+            if (cost < childCost[0] && cost < childCost[1]) break;
+            sibling = node.children[childCost[0] < childCost[1] ? 0 : 1];
+        }
+
+        // Make a new parent for the leaf and its sibling.
+        unsigned parent = allocateNode(BoundingVolumeClass(
+            nodes[sibling].volume, nodes[leaf].volume
+            ));
+        unsigned oldParent = nodes[sibling].parent;
+        nodes[parent].parent = oldParent;
+        nodes[parent].height = nodes[sibling].height + 1;
+        nodes[parent].children[0] = sibling;
+        nodes[parent].children[1] = leaf;
+        nodes[sibling].parent = parent;
+        nodes[leaf].parent = parent;
+
+        if (oldParent == NO_NODE)
+        {
+            root = parent;
+            return;
+        }
+
+        if (nodes[oldParent].children[0] == sibling)
+        {
+            nodes[oldParent].children[0] = parent;
+        }
+        else
+        {
+            nodes[oldParent].children[1] = parent;
+        }
+        refit(oldParent);
+    }
+
+    template<class BoundingVolumeClass>
+    void DynamicBVH<BoundingVolumeClass>::removeLeaf(unsigned leaf)
+    {
+        if (leaf == root)
+        {
+            root = NO_NODE;
+            return;
+        }
+
+        // The sibling takes the place of the parent.
+        unsigned parent = nodes[leaf].parent;
+        unsigned grandparent = nodes[parent].parent;
+        unsigned sibling = nodes[parent].children[0] == leaf ?
+            nodes[parent].children[1] : nodes[parent].children[0];
+        freeNode(parent);
+        nodes[sibling].parent = grandparent;
+
+        if (grandparent == NO_NODE)
+        {
+            root = sibling;
+            return;
+        }
+
+        if (nodes[grandparent].children[0] == parent)
+        {
+            nodes[grandparent].children[0] = sibling;
+        }
+        else
+        {
+            nodes[grandparent].children[1] = sibling;
+        }
+        refit(grandparent);
+    }
+
+    template<class BoundingVolumeClass>
+    void DynamicBVH<BoundingVolumeClass>::refit(unsigned index)
+    {
+        while (index != NO_NODE)
+        {
+            index = balance(index);
+            recalculate(index);
+            index = nodes[index].parent;
+        }
+    }
+
+    template<class BoundingVolumeClass>
+    void DynamicBVH<BoundingVolumeClass>::recalculate(unsigned index)
+    {
+        Node &node = nodes[index];
+        const Node &one = nodes[node.children[0]];
+        const Node &two = nodes[node.children[1]];
+        node.volume = BoundingVolumeClass(one.volume, two.volume);
+        node.height = 1 + (one.height > two.height ? one.height : two.height);
+    }
+
+    template<class BoundingVolumeClass>
+    unsigned DynamicBVH<BoundingVolumeClass>::balance(unsigned index)
+    {
+        Node &node = nodes[index];
+        if (node.isLeaf()) return index;
+
+        // If neither child is much taller than the other, we only
+        // rotate to make the volumes tighter.
+        int difference = nodes[node.children[1]].height -
+            nodes[node.children[0]].height;
+        if (difference >= -2 && difference <= 2)
+        {
+            rotate(index);
+            return index;
+        }
+        unsigned tall = difference > 0 ? 1 : 0;
+
+        // The taller child takes the node's place, and the node takes
+        // the shorter of its grandchildren, keeping the taller.
+        unsigned up = node.children[tall];
+        Node &upper = nodes[up];
+        unsigned keep = upper.children[0], give = upper.children[1];
+        if (nodes[keep].height < nodes[give].height)
+        {
+            keep = upper.children[1];
+            give = upper.children[0];
+        }
+
+        upper.parent = node.parent;
+        if (upper.parent == NO_NODE) root = up;
+        else if (nodes[upper.parent].children[0] == index)
+        {
+            nodes[upper.parent].children[0] = up;
+        }
+        else
+        {
+            nodes[upper.parent].children[1] = up;
+        }
+
+        upper.children[0] = index;
+        upper.children[1] = keep;
+        node.parent = up;
+        node.children[tall] = give;
+        nodes[give].parent = index;
+
+        recalculate(index);
+        recalculate(up);
+        return up;
+    }
+
+    template<class BoundingVolumeClass>
+    void DynamicBVH<BoundingVolumeClass>::rotate(unsigned index)
+    {
+        // Try swapping each child with each of the other child's
+        // children, and keep the swap that most shrinks the child
+        // that changes.
+        const Node &node = nodes[index];
+        unsigned bestSide = 0, bestKeep = 0;
+        real bestGain = 0;
+        for (unsigned side = 0; side < 2; side++)
+        {
+            const Node &child = nodes[node.children[side]];
+            if (child.isLeaf()) continue;
+
+            const BoundingVolumeClass &other =
+                nodes[node.children[1 - side]].volume;
+            real size = child.volume.getSize();
+            for (unsigned keep = 0; keep < 2; keep++)
+            {
+                real gain = size - BoundingVolumeClass(
+                    nodes[child.children[keep]].volume, other
+                    ).getSize();
+                if (gain > bestGain)
+                {
+                    bestGain = gain;
+                    bestSide = side;
+                    bestKeep = keep;
+                }
+            }
+        }
+        if (bestGain <= 0) return;
+
+        // The grandchild that isn't kept swaps places with the
+        // other child.
+        unsigned child = nodes[index].children[bestSide];
+        unsigned up = nodes[child].children[1 - bestKeep];
+        unsigned down = nodes[index].children[1 - bestSide];
+        nodes[index].children[1 - bestSide] = up;
+        nodes[up].parent = index;
+        nodes[child].children[1 - bestKeep] = down;
+        nodes[down].parent = child;
+        recalculate(child);
+    }
+
+    /**
+     * Records that the bounding boxes of a pair of bodies have started
+     * or stopped overlapping.
+     */
+    struct PairEvent
+    {
+        /**
+         * Holds the bodies whose bounding boxes have changed.
+         */
+        RigidBody* body[2];
+
+        /**
+         * True if the boxes have started overlapping, false if they
+         * have stopped.
+         */
+        bool added;
+    };
+
+    /**
+     * A broad phase that sorts the ends of the bodies' bounding boxes
+     * along each world axis, and keeps them sorted from frame to
+     * frame (sort and sweep, also known as sweep and prune).
+     *
+     * Most bodies move only a little in a frame, and resting ones not
+     * at all, so the ends are almost in order already and are sorted
+     * again with an insertion sort, which takes time in proportion to
+     * the number of bodies plus the number of ends that pass each
+     * other. An end passing another is also the only time the overlap
+     * of two boxes can change, so rather than giving the whole list
+     * of potential contacts each frame, the broad phase records the
+     * pairs that have started or stopped overlapping. The caller keeps
+     * its own set of pairs, and a pile of resting bodies costs little
+     * more than reading their boxes.
+     *
+     * Bodies added since the last sort are sorted separately and
+     * merged in, and their overlaps found with one sweep along an
+     * axis, so adding many bodies at once is no slower than building
+     * the arrays from scratch. Adding or removing a body still takes
+     * time in proportion to the number of bodies, so this suits
+     * scenes where bodies live for many frames.
+     */
+    class SweepAndPrune
+    {
+    public:
+        /**
+         * Marks a handle that isn't in use.
+         */
+        static const unsigned NO_HANDLE = 0xffffffff;
+
+        SweepAndPrune();
+
+        /**
+         * Adds the given body with the given bounding box. Returns the
+         * handle used to move and remove the body. Its ends are merged
+         * into place, and the bodies it overlaps recorded, by the next
+         * call to sort.
+         */
+        unsigned insert(RigidBody *body, const BoundingBox &box);
+
+        /**
+         * Removes the body with the given handle, recording an event
+         * for each body it overlapped.
+         */
+        void remove(unsigned handle);
+
+        /**
+         * Gives the body with the given handle a new bounding box. The
+         * ends aren't sorted, and no events are recorded, until sort
+         * is called.
+         */
+        void update(unsigned handle, const BoundingBox &box);
+
+        /**
+         * Sorts the ends of the boxes given since the last sort,
+         * recording an event for each pair that has started or
+         * stopped overlapping.
+         */
+        void sort();
+
+        /**
+         * Removes all the bodies, without recording any events.
+         */
+        void clear();
+
+        /**
+         * Returns the body with the given handle.
+         */
+        RigidBody *getBody(unsigned handle) const
+        {
+            return proxies[handle].body;
+        }
+
+        /**
+         * Returns the bounding box of the body with the given handle.
+         */
+        const BoundingBox &getBox(unsigned handle) const
+        {
+            return proxies[handle].box;
+        }
+
+        /**
+         * Returns the number of bodies in the broad phase.
+         */
+        unsigned getBodyCount() const
+        {
+            return bodyCount;
+        }
+
+        /**
+         * Returns the events recorded since they were last cleared, in
+         * the order they happened. A pair may start and stop
+         * overlapping within one sort.
+         */
+        const std::vector<PairEvent> &getEvents() const
+        {
+            return events;
+        }
+
+        /**
+         * Forgets the recorded events.
+         */
+        void clearEvents()
+        {
+            events.clear();
+        }
+
+    protected:
+        /**
+         * One end of a box along an axis. The proxy and whether this
+         * is its maximum are packed together, so the ends are small
+         * to sort.
+         */
+        struct Endpoint
+        {
+            real value;
+            unsigned data;
+
+            unsigned getProxy() const
+            {
+                return data >> 1;
+            }
+
+            bool isMaximum() const
+            {
+                return (data & 1) != 0;
+            }
+
+            /**
+             * Checks if this end goes before the other. Where two ends
+             * are level, minimums go before maximums, so boxes that
+             * touch count as overlapping.
+             */
+            bool operator<(const Endpoint &other) const
+            {
+                return value < other.value || (value == other.value &&
+                    !isMaximum() && other.isMaximum());
+            }
+        };
+
+        /**
+         * A body in the broad phase, with the positions of its ends
+         * in the sorted arrays, once it has been merged into them.
+         * Proxies that aren't in use have no body, and are chained
+         * together through their first minimum.
+         */
+        struct Proxy
+        {
+            BoundingBox box;
+            RigidBody *body;
+            unsigned minimum[3];
+            unsigned maximum[3];
+            bool merged;
+
+            Proxy(RigidBody *body, const BoundingBox &box)
+                : box(box), body(body), merged(false)
+            {
+            }
+        };
+
+        /** Holds the sorted ends along each axis. */
+        std::vector<Endpoint> endpoints[3];
+
+        /** Holds the proxies, both those in use and those free. */
+        std::vector<Proxy> proxies;
+
+        /** Holds the first proxy that isn't in use. */
+        unsigned freeProxies;
+
+        /** Holds the proxies added since the last sort. */
+        std::vector<unsigned> added;
+
+        /**
+         * Holds the ends being merged, and the proxies overlapping
+         * the sweep. They are kept between sorts so they don't
+         * allocate memory.
+         */
+        std::vector<Endpoint> merging;
+        std::vector<unsigned> active;
+
+        /** Holds the number of bodies in the broad phase. */
+        unsigned bodyCount;
+
+        /** Holds the events recorded since they were last cleared. */
+        std::vector<PairEvent> events;
+
+        /**
+         * Checks if the ends of the two given proxies overlap in the
+         * sorted array of the given axis.
+         */
+        bool overlapsOn(const Proxy &one, const Proxy &two,
+                        unsigned axis) const
+        {
+            return one.minimum[axis] < two.maximum[axis] &&
+                two.minimum[axis] < one.maximum[axis];
+        }
+
+        /**
+         * Sorts the ends along the given axis, recording events for
+         * the pairs whose overlap changes.
+         */
+        void sortAxis(unsigned axis);
+
+        /**
+         * Merges the ends of the proxies added since the last sort
+         * into the sorted arrays, recording an event for each pair
+         * they overlap.
+         */
+        void mergeAdded();
+
+        /**
+         * Records an event for the given pair of proxies.
+         */
+        void addEvent(unsigned one, unsigned two, bool added);
+
+        /**
+         * Records an event for each proxy whose ends overlap those of
+         * the given proxy along every axis.
+         */
+        void addOverlapEvents(unsigned handle, bool added);
+    };
+
+    /**
+     * A broad phase that puts the bodies into a grid of cubic cells,
+     * held in a hash table so the grid needn't be bounded, and tests
+     * each body only against the bodies in its own and neighbouring
+     * cells. It is rebuilt from scratch each frame, in time in
+     * proportion to the number of bodies, so it suits many bodies of
+     * about the same size that all move, such as debris or rounds of
+     * ammunition.
+     *
+     * The cells are made as large as the largest extent of any body's
+     * bounding box, and each body is put in the cell holding the
+     * minimum corner of its box. Two boxes can then only overlap if
+     * their cells are next to each other, so each body is tested
+     * against the bodies in its own cell and in half of the cells
+     * around it, and each pair is found once. A single body much
+     * larger than the rest makes every cell large, so such bodies are
+     * better handled separately.
+     *
+     * Each cell is tested on its own, so finding the potential
+     * contacts can be shared between threads by ranges of the hash
+     * table (see ParallelRunner), giving the same pairs in the same
+     * order however many threads there are. The pairs are gathered
+     * in storage held in the hash, though, so only one search can
+     * be run on a hash at a time.
+     */
+    class SpatialHash
+    {
+    public:
+        SpatialHash();
+
+        /**
+         * Adds the given body with the given bounding box. It is put
+         * in the grid by the next call to build.
+         */
+        void insert(RigidBody *body, const BoundingBox &box);
+
+        /**
+         * Removes all the bodies, ready for them to be added again.
+         */
+        void clear();
+
+        /**
+         * Chooses the size of the cells and puts the bodies added
+         * since the last clear into them.
+         */
+        void build();
+
+        /**
+         * Writes each pair of bodies whose bounding boxes overlap to
+         * the given array (up to the given limit). Returns the number
+         * of potential contacts it found. If a runner is given, the
+         * ranges of the hash table are tested with it, otherwise they
+         * are tested on the calling thread.
+         */
+        unsigned getPotentialContacts(PotentialContact* contacts,
+                                      unsigned limit,
+                                      ParallelRunner *runner = NULL);
+
+        /**
+         * Returns the size of the cells chosen by the last build.
+         */
+        real getCellSize() const
+        {
+            return cellSize;
+        }
+
+        /**
+         * Returns the number of bodies added since the last clear.
+         */
+        unsigned getBodyCount() const
+        {
+            return (unsigned)added.size();
+        }
+
+    protected:
+        /**
+         * A body in the grid, with the cell it is in.
+         */
+        struct Entry
+        {
+            BoundingBox box;
+            RigidBody *body;
+            int cell[3];
+
+            Entry(RigidBody *body, const BoundingBox &box)
+                : box(box), body(body)
+            {
+            }
+        };
+
+        /** The number of ranges the hash table is split into. */
+        static const unsigned ranges = 64;
+
+        /** Holds the bodies in the order they were added. */
+        std::vector<Entry> added;
+
+        /**
+         * Holds the bodies sorted by the hash of their cell, so the
+         * bodies in each slot of the table are together.
+         */
+        std::vector<Entry> entries;
+
+        /**
+         * Holds the index of the first entry in each slot of the
+         * table, and after them the number of entries.
+         */
+        std::vector<unsigned> slots;
+
+        /** Holds one less than the number of slots in the table. */
+        unsigned mask;
+
+        /** Holds the size of the cells. */
+        real cellSize;
+
+        /**
+         * Holds the pairs found in each range of the table, so they
+         * can be found at the same time and then put in order.
+         */
+        std::vector<PotentialContact> found[ranges];
+
+        /**
+         * Returns the slot of the table holding the given cell.
+         */
+        unsigned getSlot(int x, int y, int z) const
+        {
+            return ((unsigned)x * 73856093u ^ (unsigned)y * 19349663u ^
+                (unsigned)z * 83492791u) & mask;
+        }
+
+        /**
+         * The task that finds the pairs in a range of slots.
+         */
+        class PairSearch;
+    };
+
+    /**
+     * A bounding volume hierarchy of bodies held in flat arrays,
+     * rather than as a tree of separately allocated nodes like
+     * BVHNode. The nodes are stored in depth-first order, so a node's
+     * first child is the node after it, and only the index of its
+     * second child is kept. The bounding boxes of the nodes are in an
+     * array of their own, and the bodies and their boxes are sorted
+     * into the order of the leaves, so a query reads through memory
+     * in large runs.
+     *
+     * Queries walk the hierarchy with a small stack of their own
+     * rather than recursing, and don't change the hierarchy, so they
+     * can be run from several threads at once.
+     *
+     * The hierarchy is built from scratch by splitting the bodies at
+     * the median of their centres. When the bodies move it can be
+     * refitted, which keeps its shape and grows the boxes to suit,
+     * in time in proportion to the number of bodies. This suits
+     * bodies that keep their places relative to each other, such as
+     * static scenery or a pile, and a hierarchy that has grown loose
+     * can be built again.
+     */
+    class FlatBVH
+    {
+    public:
+        /**
+         * Adds the given body with the given bounding box, returning
+         * its index. Queries give bodies by their index. The body is
+         * included in queries from the next call to build.
+         */
+        unsigned insert(RigidBody *body, const BoundingBox &box);
+
+        /**
+         * Removes all the bodies.
+         */
+        void clear();
+
+        /**
+         * Builds the hierarchy from the bodies added so far.
+         */
+        void build();
+
+        /**
+         * Gives the body with the given index a new bounding box. The
+         * hierarchy isn't changed until refit or build is called.
+         */
+        void update(unsigned index, const BoundingBox &box);
+
+        /**
+         * Recalculates the bounding boxes of the nodes to enclose the
+         * bodies' current boxes, without changing the shape of the
+         * hierarchy.
+         */
+        void refit();
+
+        /**
+         * Returns the body with the given index.
+         */
+        RigidBody *getBody(unsigned index) const
+        {
+            return bodies[positions[index]];
+        }
+
+        /**
+         * Returns the number of bodies added since the last clear.
+         */
+        unsigned getBodyCount() const
+        {
+            return (unsigned)positions.size();
+        }
+
+        /**
+         * Returns the number of nodes in the hierarchy.
+         */
+        unsigned getNodeCount() const
+        {
+            return (unsigned)nodes.size();
+        }
+
+        /**
+         * Writes the indices of the bodies whose boxes overlap the
+         * given box to the given array (up to the given limit).
+         * Returns the number of bodies it found.
+         */
+        unsigned query(const BoundingBox &box,
+                       unsigned *found, unsigned limit) const;
+
+        /**
+         * Writes the indices of the bodies whose boxes are crossed by
+         * the given ray, within the given distance along it, to the
+         * given array (up to the given limit). The direction needn't
+         * be normalised, and the distance is in multiples of it.
+         * Nearer branches of the hierarchy are visited first, so the
+         * bodies are roughly in order of distance. Returns the number
+         * of bodies it found.
+         */
+        unsigned raycast(const Vector3 &origin, const Vector3 &direction,
+                         real maxDistance,
+                         unsigned *found, unsigned limit) const;
+
+        /**
+         * Writes each pair of bodies whose boxes overlap to the given
+         * array (up to the given limit), by walking the hierarchy
+         * against itself. Returns the number of potential contacts it
+         * found.
+         */
+        unsigned getPotentialContacts(PotentialContact* contacts,
+                                      unsigned limit) const;
+
+    protected:
+        /**
+         * A node in the hierarchy. For a leaf, first is the first of
+         * its bodies in the sorted arrays and count is their number.
+         * Other nodes have a count of zero, and first is the index of
+         * their second child.
+         */
+        struct Node
+        {
+            unsigned first;
+            unsigned count;
+        };
+
+        /** The most bodies in a leaf. */
+        static const unsigned leafSize = 4;
+
+        /**
+         * The size of the stacks used to walk the hierarchy without
+         * allocating. Splitting at the median keeps the hierarchy
+         * shallow enough for any number of bodies that fits in
+         * memory; a deeper walk spills onto the heap.
+         */
+        static const unsigned maxStackSize = 64;
+
+        /** Holds the nodes, in depth-first order. */
+        std::vector<Node> nodes;
+
+        /** Holds the bounding box of each node. */
+        std::vector<BoundingBox> bounds;
+
+        /** Holds the bodies' boxes, in the order of the leaves. */
+        std::vector<BoundingBox> boxes;
+
+        /** Holds the bodies, in the order of the leaves. */
+        std::vector<RigidBody*> bodies;
+
+        /** Holds the index of each body, in the order of the leaves. */
+        std::vector<unsigned> indices;
+
+        /** Holds where each body is in the order of the leaves. */
+        std::vector<unsigned> positions;
+
+        /**
+         * Builds the node for the given range of the sorted bodies,
+         * and the nodes below it.
+         */
+        void buildNode(unsigned start, unsigned end,
+                       std::vector<unsigned> &order,
+                       const std::vector<Vector3> &centres);
+
+        /**
+         * Sets the bounding box of the given leaf from its bodies.
+         */
+        void fitLeaf(unsigned index);
+    };
+
 } // namespace cyclone
 
 #endif // CYCLONE_COLLISION_FINE_H
\ No newline at end of file
@@ -26,6 +26,7 @@
 #define CYCLONE_COLLISION_FINE_H
 
 #include "contacts.h"
+#include "mapfile.h"
 
 namespace cyclone {
 
@@ -47,6 +48,22 @@ namespace cyclone {
         friend class IntersectionTests;
         friend class CollisionDetector;
 
+        /**
+         * Identifies each kind of primitive, so the collision detector
+         * can pick the right test for a pair of primitives without
+         * the caller knowing their types.
+         *
+         * @see CollisionDetector::collide
+         */
+        enum Type
+        {
+            SPHERE,
+            BOX,
+            CAPSULE,
+            CONVEX,
+            TYPES
+        };
+
         /**
          * The rigid body that is represented by this primitive.
          */
@@ -82,6 +99,14 @@ namespace cyclone {
             return transform;
         }
 
+        /**
+         * Returns the kind of this primitive.
+         */
+        Type getType() const
+        {
+            return type;
+        }
+
 
     protected:
         /**
@@ -90,6 +115,22 @@ namespace cyclone {
          * with the transform of the rigid body.
          */
         Matrix4 transform;
+
+        /**
+         * Holds the kind of this primitive. It is set when the
+         * primitive is created, and tells the collision detector
+         * which class the primitive is.
+         */
+        Type type;
+
+        /**
+         * Creates a primitive of the given kind. Only the classes
+         * for each kind of primitive create primitives.
+         */
+        CollisionPrimitive(Type type)
+            : type(type)
+        {
+        }
     };
 
     /**
@@ -103,6 +144,11 @@ namespace cyclone {
          * The radius of the sphere.
          */
         real radius;
+
+        CollisionSphere()
+            : CollisionPrimitive(SPHERE)
+        {
+        }
     };
 
     /**
@@ -135,6 +181,428 @@ namespace cyclone {
          * Holds the half-sizes of the box along each of its local axes.
          */
         Vector3 halfSize;
+
+        CollisionBox()
+            : CollisionPrimitive(BOX)
+        {
+        }
+    };
+
+    /**
+     * Represents a rigid body that can be treated as a capsule for
+     * collision detection: all the points within a given radius of a
+     * line segment. The segment runs along the primitive's local
+     * Y axis, from -halfHeight to +halfHeight.
+     */
+    class CollisionCapsule : public CollisionPrimitive
+    {
+    public:
+        /**
+         * The radius of the capsule.
+         */
+        real radius;
+
+        /**
+         * Half the length of the capsule's central segment, not
+         * including the rounded ends.
+         */
+        real halfHeight;
+
+        CollisionCapsule()
+            : CollisionPrimitive(CAPSULE)
+        {
+        }
+
+        /**
+         * Returns one end of the central segment, in world
+         * coordinates: the top (+Y) end if end is 0, otherwise the
+         * bottom.
+         */
+        Vector3 getEnd(unsigned end) const
+        {
+            Vector3 axis = getAxis(1) * halfHeight;
+            if (end) return getAxis(3) - axis;
+            return getAxis(3) + axis;
+        }
+    };
+
+    /**
+     * Represents a rigid body that can be treated as the convex hull
+     * of a set of points for collision detection. The points are
+     * given in the primitive's local coordinates; points that are
+     * inside the hull do no harm, but cost time.
+     *
+     * The points are held as a structure of arrays, so finding the
+     * point furthest in a given direction (the support point, which
+     * is all the convex collision tests need) reads each coordinate
+     * array straight through.
+     */
+    class CollisionConvex : public CollisionPrimitive
+    {
+    public:
+        friend class CollisionDetector;
+
+        CollisionConvex()
+            : CollisionPrimitive(CONVEX)
+        {
+        }
+
+        /**
+         * Sets the points whose hull is the primitive.
+         */
+        void setVertices(const Vector3 *vertices, unsigned numVertices);
+
+        /**
+         * Returns the number of points.
+         */
+        unsigned getVertexCount() const
+        {
+            return (unsigned)x.size();
+        }
+
+        /**
+         * Returns the given point, in local coordinates.
+         */
+        Vector3 getVertex(unsigned index) const
+        {
+            return Vector3(x[index], y[index], z[index]);
+        }
+
+        /**
+         * Returns the index of the point furthest along the given
+         * direction, in local coordinates.
+         */
+        unsigned getSupportIndex(const Vector3 &direction) const;
+
+        /**
+         * Returns the point of the hull furthest along the given
+         * direction, both in world coordinates.
+         */
+        Vector3 getSupport(const Vector3 &direction) const;
+
+    protected:
+        /** Holds the x, y and z coordinates of each point. */
+        std::vector<real> x;
+        std::vector<real> y;
+        std::vector<real> z;
+    };
+
+    /**
+     * A heightfield is a regular grid of heights, used for terrain.
+     * Like the plane, it is not a primitive: it is immovable world
+     * geometry rather than a rigid body.
+     *
+     * The grid lies in the XZ plane, starting at the origin and
+     * running along +X for each row and along +Z from row to row.
+     * Each height is measured along +Y from the origin. Each square
+     * cell between four heights is split into two triangles along
+     * its diagonal, giving a continuous surface.
+     *
+     * The heights can either be copied in, or mapped straight from a
+     * file written by save, so very large terrains load immediately
+     * and only the parts that are used are ever read from disk.
+     */
+    class CollisionHeightfield
+    {
+    public:
+        friend class CollisionDetector;
+
+        /**
+         * Holds the position of the first height in the grid.
+         */
+        Vector3 origin;
+
+        CollisionHeightfield();
+
+        /**
+         * Copies in a grid of heights, with the given number of
+         * heights in each row and number of rows, and the distance
+         * between neighbouring heights. Any mapped file is closed.
+         */
+        void setHeights(unsigned columns, unsigned rows,
+                        real cellSize, const real *heights);
+
+        /**
+         * Maps the grid (and its origin and spacing) from a file
+         * written by save. Returns false if the file can't be mapped
+         * or isn't a heightfield saved with the same precision.
+         */
+        bool load(const char *filename);
+
+        /**
+         * Writes the grid, its origin and spacing to the given file,
+         * returning false if it can't be written.
+         */
+        bool save(const char *filename) const;
+
+        /**
+         * Returns the number of heights in each row.
+         */
+        unsigned getColumns() const
+        {
+            return columns;
+        }
+
+        /**
+         * Returns the number of rows.
+         */
+        unsigned getRows() const
+        {
+            return rows;
+        }
+
+        /**
+         * Returns the distance between neighbouring heights.
+         */
+        real getCellSize() const
+        {
+            return cellSize;
+        }
+
+        /**
+         * Returns the given height, measured from the origin.
+         */
+        real getHeight(unsigned column, unsigned row) const
+        {
+            return heights[row*columns + column];
+        }
+
+        /**
+         * Finds the height (in world coordinates) and the upward
+         * normal of the surface above or below the given point.
+         * Returns false if the point is outside the grid.
+         */
+        bool getSurface(real x, real z,
+                        real *height, Vector3 *normal) const;
+
+    protected:
+        /** Holds the size of the grid. */
+        unsigned columns;
+        unsigned rows;
+
+        /** Holds the distance between heights, and its inverse. */
+        real cellSize;
+        real inverseCellSize;
+
+        /** Holds the first height, in memory or in the mapped file. */
+        const real *heights;
+
+        /** Holds the heights, when they are copied in. */
+        std::vector<real> ownHeights;
+
+        /** Holds the mapped file, when the heights are loaded. */
+        MappedFile file;
+
+        /**
+         * Finds the range of cells under the given range of world
+         * coordinates, returning false if there are none.
+         */
+        bool getCells(real minX, real minZ, real maxX, real maxZ,
+                      unsigned *firstColumn, unsigned *firstRow,
+                      unsigned *lastColumn, unsigned *lastRow) const;
+
+        /**
+         * Fills the corners of one of the triangles of a cell, in
+         * world coordinates. The first triangle is the one with the
+         * larger x.
+         */
+        void getTriangle(unsigned column, unsigned row, unsigned half,
+                         Vector3 corners[3]) const;
+
+    private:
+        /** Heightfields can't be copied. */
+        CollisionHeightfield(const CollisionHeightfield &);
+        CollisionHeightfield &operator=(const CollisionHeightfield &);
+    };
+
+    /**
+     * A triangle mesh is fixed world geometry, such as a level, made
+     * of triangles. Like the heightfield it is not a primitive.
+     *
+     * When it is built, the triangles are sorted into a bounding
+     * volume hierarchy, so only the triangles near a primitive are
+     * tested. The hierarchy is flattened into an array of nodes in
+     * depth-first order: the first child of a node is the next node
+     * in the array, and the node holds the index of its second
+     * child, so the tree is walked with a small stack and no
+     * pointers. The triangles are stored in the order of the leaves
+     * that hold them.
+     *
+     * Everything is held in plain arrays, so the built mesh can be
+     * saved to a file and mapped straight back into memory, which
+     * takes no time however large the mesh is.
+     *
+     * Triangles are one-sided: they only push primitives out of
+     * their front face, which is the side their corners go
+     * anticlockwise round.
+     */
+    class CollisionTriangleMesh
+    {
+    public:
+        friend class CollisionDetector;
+
+        CollisionTriangleMesh();
+
+        /**
+         * Builds the mesh from the given vertices and triangles, each
+         * triangle being three indices into the vertices. Any mapped
+         * file is closed.
+         */
+        void build(const Vector3 *vertices, unsigned numVertices,
+                   const unsigned *indices, unsigned numTriangles);
+
+        /**
+         * Maps a mesh built and saved earlier from the given file.
+         * Returns false if the file can't be mapped, or isn't a mesh
+         * saved with the same precision.
+         */
+        bool load(const char *filename);
+
+        /**
+         * Writes the built mesh to the given file, returning false if
+         * it can't be written.
+         */
+        bool save(const char *filename) const;
+
+        /**
+         * Returns the number of triangles.
+         */
+        unsigned getTriangleCount() const
+        {
+            return numTriangles;
+        }
+
+        /**
+         * Returns the number of vertices.
+         */
+        unsigned getVertexCount() const
+        {
+            return numVertices;
+        }
+
+        /**
+         * Fills the corners of the given triangle. Triangles are
+         * numbered in the order they are stored, not the order they
+         * were given in.
+         */
+        void getTriangle(unsigned triangle, Vector3 corners[3]) const;
+
+        /**
+         * Returns the index of the vertex at the given corner of the
+         * given triangle.
+         */
+        unsigned getVertexIndex(unsigned triangle, unsigned corner) const
+        {
+            return triangles[triangle*3 + corner];
+        }
+
+        /**
+         * Adds the index of each triangle whose bounds overlap the
+         * given box to the given list.
+         */
+        void getTriangles(const Vector3 &minimum, const Vector3 &maximum,
+                          std::vector<unsigned> &triangles) const;
+
+        /**
+         * A node in the flattened hierarchy. A leaf holds the first
+         * of its triangles and their number; any other node has no
+         * triangles, and holds the index of its second child instead.
+         */
+        struct Node
+        {
+            real minimum[3];
+            real maximum[3];
+            unsigned first;
+            unsigned count;
+        };
+
+    protected:
+        /** Holds the size of each array. */
+        unsigned numNodes;
+        unsigned numVertices;
+        unsigned numTriangles;
+
+        /**
+         * Hold the nodes, the vertices (three reals each) and the
+         * triangles (three vertex indices each), either in the arrays
+         * below or in the mapped file.
+         */
+        const Node *nodes;
+        const real *vertices;
+        const unsigned *triangles;
+
+        /** Holds the arrays, when the mesh is built in memory. */
+        std::vector<Node> ownNodes;
+        std::vector<real> ownVertices;
+        std::vector<unsigned> ownTriangles;
+
+        /** Holds the mapped file, when the mesh is loaded. */
+        MappedFile file;
+
+        /**
+         * Calls the given visitor with the index of each triangle
+         * whose bounds overlap the given box, stopping early if the
+         * visitor returns false.
+         */
+        template <class Visitor>
+        void visitTriangles(const Vector3 &minimum, const Vector3 &maximum,
+                            Visitor &visitor) const;
+
+    private:
+        /** Meshes can't be copied. */
+        CollisionTriangleMesh(const CollisionTriangleMesh &);
+        CollisionTriangleMesh &operator=(const CollisionTriangleMesh &);
+    };
+
+    /**
+     * Holds a set of spheres as a structure of arrays: one array for
+     * each coordinate of the centres, one for the radii and one for the
+     * bodies. This is the input for the batched sphere tests in
+     * CollisionDetector, which run down these arrays rather than
+     * fetching each sphere's transform, and so suit large numbers of
+     * small spheres such as debris.
+     *
+     * The arrays are kept when the set is cleared, so a set can be
+     * refilled each frame without allocating.
+     */
+    class CollisionSphereSet
+    {
+    public:
+        /** Holds the x, y and z coordinates of each centre. */
+        std::vector<real> x;
+        std::vector<real> y;
+        std::vector<real> z;
+
+        /** Holds the radius of each sphere. */
+        std::vector<real> radius;
+
+        /** Holds the rigid body each sphere belongs to. */
+        std::vector<RigidBody*> body;
+
+        /**
+         * Removes all the spheres from the set.
+         */
+        void clear();
+
+        /**
+         * Adds a sphere to the set, returning its index. The sphere's
+         * internals should have been calculated.
+         */
+        unsigned add(const CollisionSphere &sphere);
+
+        /**
+         * Adds a sphere with the given centre, radius and body to the
+         * set, returning its index.
+         */
+        unsigned add(const Vector3 &centre, real radius, RigidBody *body);
+
+        /**
+         * Returns the number of spheres in the set.
+         */
+        unsigned size() const
+        {
+            return (unsigned)radius.size();
+        }
     };
 
     /**
@@ -173,6 +641,49 @@ namespace cyclone {
         static bool boxAndHalfSpace(
             const CollisionBox &box,
             const CollisionPlane &plane);
+
+        /**
+         * Finds when a sphere moving from its current position along
+         * the given vector first touches a half-space, as a fraction
+         * of the movement between zero and one. The normal of the
+         * surface where they touch is also returned.
+         *
+         * Returns false if the sphere doesn't reach the half-space
+         * during the movement, or is already touching it at the
+         * start, which the non-swept tests should be used for.
+         */
+        static bool sweptSphereAndHalfSpace(
+            const CollisionSphere &sphere,
+            const Vector3 &motion,
+            const CollisionPlane &plane,
+            real *time,
+            Vector3 *normal);
+
+        /**
+         * Finds when two spheres moving along the given vectors first
+         * touch, in the same way as sweptSphereAndHalfSpace. The
+         * normal points from the second sphere to the first.
+         */
+        static bool sweptSphereAndSphere(
+            const CollisionSphere &one,
+            const Vector3 &motionOne,
+            const CollisionSphere &two,
+            const Vector3 &motionTwo,
+            real *time,
+            Vector3 *normal);
+
+        /**
+         * Finds when a sphere moving along the given vector first
+         * touches a box that isn't moving, in the same way as
+         * sweptSphereAndHalfSpace. The normal points from the box
+         * to the sphere.
+         */
+        static bool sweptSphereAndBox(
+            const CollisionSphere &sphere,
+            const Vector3 &motion,
+            const CollisionBox &box,
+            real *time,
+            Vector3 *normal);
     };
 
 
@@ -243,6 +754,37 @@ namespace cyclone {
             // Move the array forward
             contacts += count;
         }
+
+        /**
+         * Reduces the contacts found since the given contact to at
+         * most four for each manifold, and moves the remaining
+         * contacts up to fill the gaps, in their original order. A
+         * manifold is the contacts between the same pair of bodies
+         * with roughly the same normal, so a body touching both the
+         * floor and a wall keeps contacts with each.
+         *
+         * For each manifold, the deepest contact is kept, then the
+         * contact furthest from it, then the one making the largest
+         * triangle with those two, and finally the one that adds the
+         * most area to that triangle. This keeps the manifold as wide
+         * as possible, which is what keeps a resting body stable,
+         * while halving the work of the resolver for boxes resting on
+         * each other.
+         */
+        void reduceContacts(unsigned firstContact = 0);
+
+        /**
+         * Holds the contact indices while they are grouped into
+         * manifolds by reduceContacts. It is kept between calls so
+         * its storage can be reused.
+         */
+        std::vector<unsigned> reduceOrder;
+
+        /** Holds the manifold of each contact in reduceContacts. */
+        std::vector<unsigned> reduceManifolds;
+
+        /** Marks the contacts kept by reduceContacts. */
+        std::vector<bool> reduceKeep;
     };
 
     /**
@@ -256,6 +798,39 @@ namespace cyclone {
     class CollisionDetector
     {
     public:
+        /**
+         * A function that generates contacts between two primitives
+         * of particular kinds, in the same format as the functions
+         * below.
+         */
+        typedef unsigned (*CollideFunction)(
+            const CollisionPrimitive &one,
+            const CollisionPrimitive &two,
+            CollisionData *data
+            );
+
+        /**
+         * Generates the contacts between any two primitives, using
+         * their types to look up the right function in a table. This
+         * lets a broad phase pass on pairs of primitives of any kind
+         * without a virtual call or a switch on the types. Every
+         * pair of types has a test.
+         */
+        static unsigned collide(
+            const CollisionPrimitive &one,
+            const CollisionPrimitive &two,
+            CollisionData *data
+            );
+
+        /**
+         * Generates the contacts between any primitive and a plane
+         * representing a half-space.
+         */
+        static unsigned collide(
+            const CollisionPrimitive &primitive,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
 
         static unsigned sphereAndHalfSpace(
             const CollisionSphere &sphere,
@@ -275,6 +850,33 @@ namespace cyclone {
             CollisionData *data
             );
 
+        /**
+         * Tests pairs of spheres from the given set, writing the same
+         * contacts as calling sphereAndSphere for each pair in turn.
+         * The pairs are given as indices into the set, two for each
+         * pair. The distances are worked out a block of pairs at a
+         * time, from the set's arrays rather than each sphere's
+         * transform, and contacts are only written for the pairs that
+         * touch. Stops when the contact data is full.
+         */
+        static unsigned spheresAndSpheres(
+            const CollisionSphereSet &spheres,
+            const unsigned *pairs,
+            unsigned numPairs,
+            CollisionData *data
+            );
+
+        /**
+         * Tests every sphere in the given set against a half-space,
+         * writing the same contacts as calling sphereAndHalfSpace for
+         * each sphere in turn.
+         */
+        static unsigned spheresAndHalfSpace(
+            const CollisionSphereSet &spheres,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
         /**
          * Does a collision test on a collision box and a plane representing
          * a half-space (i.e. the normal of the plane
@@ -303,6 +905,171 @@ namespace cyclone {
             const CollisionSphere &sphere,
             CollisionData *data
             );
+
+        /**
+         * Does a collision test on a capsule and a half-space,
+         * generating a contact for each end of the capsule that is
+         * in the half-space.
+         */
+        static unsigned capsuleAndHalfSpace(
+            const CollisionCapsule &capsule,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        static unsigned capsuleAndSphere(
+            const CollisionCapsule &capsule,
+            const CollisionSphere &sphere,
+            CollisionData *data
+            );
+
+        static unsigned capsuleAndCapsule(
+            const CollisionCapsule &one,
+            const CollisionCapsule &two,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a capsule and a box, using
+         * convexAndConvex.
+         */
+        static unsigned capsuleAndBox(
+            const CollisionCapsule &capsule,
+            const CollisionBox &box,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a convex hull and a half-space,
+         * generating a contact for each point of the hull that is in
+         * the half-space.
+         */
+        static unsigned convexAndHalfSpace(
+            const CollisionConvex &convex,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a sphere and a heightfield. Only
+         * the cells under the sphere are tested, and at most one
+         * contact is generated for each direction the sphere is
+         * pushed in, so a sphere resting across several triangles
+         * gets a single contact, but one in a valley gets one from
+         * each side.
+         */
+        static unsigned sphereAndHeightfield(
+            const CollisionSphere &sphere,
+            const CollisionHeightfield &heightfield,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a box and a heightfield, generating
+         * a contact for each corner of the box below the surface and
+         * for each height in the grid that is inside the box. Only the
+         * cells under the box are looked at.
+         */
+        static unsigned boxAndHeightfield(
+            const CollisionBox &box,
+            const CollisionHeightfield &heightfield,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a sphere and a triangle mesh, in the
+         * same way as sphereAndHeightfield.
+         */
+        static unsigned sphereAndTriangleMesh(
+            const CollisionSphere &sphere,
+            const CollisionTriangleMesh &mesh,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a box and a triangle mesh,
+         * generating a contact for each corner of the box behind a
+         * triangle it is over, for each corner of a triangle that is
+         * inside the box, and for each edge of a triangle that passes
+         * right through it. Only triangles the centre of the box is
+         * in front of are tested.
+         */
+        static unsigned boxAndTriangleMesh(
+            const CollisionBox &box,
+            const CollisionTriangleMesh &mesh,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a capsule and a triangle mesh,
+         * treating each end of the capsule as a sphere, and adding a
+         * contact where the middle of the capsule lies across the
+         * edge of a triangle.
+         */
+        static unsigned capsuleAndTriangleMesh(
+            const CollisionCapsule &capsule,
+            const CollisionTriangleMesh &mesh,
+            CollisionData *data
+            );
+
+        /**
+         * Generates a single contact between any two of the spheres,
+         * boxes, capsules and convex hulls, using the GJK algorithm
+         * to find the distance between them and, if they overlap, the
+         * expanding polytope algorithm (EPA) to find the penetration.
+         *
+         * Spheres and capsules are treated as a point or segment with
+         * a radius: GJK and EPA work on the point or segment, and the
+         * radius is added afterwards. This is both faster and more
+         * accurate than treating the rounded surface as a hull, and
+         * means shallow contacts between rounded primitives never
+         * need EPA at all.
+         */
+        static unsigned convexAndConvex(
+            const CollisionPrimitive &one,
+            const CollisionPrimitive &two,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a sphere and a half-space, sweeping
+         * the sphere along the path it took during the last
+         * integration step if its body has continuous collision
+         * detection enabled. If the sphere passed into the half-space
+         * during the step, a single contact is generated where it
+         * first touched, deep enough to move the sphere back to that
+         * point. Otherwise this is the same as sphereAndHalfSpace.
+         */
+        static unsigned sweptSphereAndHalfSpace(
+            const CollisionSphere &sphere,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on two spheres, sweeping each that has
+         * continuous collision detection enabled, in the same way as
+         * sweptSphereAndHalfSpace. Otherwise this is the same as
+         * sphereAndSphere.
+         */
+        static unsigned sweptSphereAndSphere(
+            const CollisionSphere &one,
+            const CollisionSphere &two,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a box and a sphere, sweeping either
+         * that has continuous collision detection enabled, in the same
+         * way as sweptSphereAndHalfSpace. Only the box's movement is
+         * swept, not its rotation. Otherwise this is the same as
+         * boxAndSphere.
+         */
+        static unsigned boxAndSweptSphere(
+            const CollisionBox &box,
+            const CollisionSphere &sphere,
+            CollisionData *data
+            );
     };
 
 
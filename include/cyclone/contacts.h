@@ -26,6 +26,7 @@
 #ifndef CYCLONE_CONTACTS_H
 #define CYCLONE_CONTACTS_H
 
+#include <vector>
 #include "body.h"
 
 namespace cyclone {
@@ -66,6 +67,12 @@ namespace cyclone {
          */
         friend class ContactResolver;
 
+        /**
+         * The contact cache reads and writes the impulses that carry
+         * over between frames.
+         */
+        friend class ContactCache;
+
     public:
         /**
          * Holds the bodies that are involved in the contact. The
@@ -100,9 +107,20 @@ namespace cyclone {
          */
         real penetration;
 
+        /**
+         * Holds an identifier for the features of the two primitives
+         * that generated the contact (a vertex, edge or face of each),
+         * as given by the collision detector. Together with the two
+         * bodies, this lets the same contact be found again in the
+         * next frame. It is set to zero by setBodyData, so detectors
+         * that only ever generate one contact per pair can ignore it.
+         */
+        unsigned feature;
+
         /**
          * Sets the data that doesn't normally depend on the position
          * of the contact (i.e. the bodies, and their material properties).
+         * This also resets the feature identifier.
          */
         void setBodyData(RigidBody* one, RigidBody *two,
                          real friction, real restitution);
@@ -135,6 +153,58 @@ namespace cyclone {
          */
         Vector3 relativeContactPosition[2];
 
+        /**
+         * Holds the inverse inertia tensor of each body in world
+         * coordinates. This is set when the calculateInternals
+         * function is run, so it needn't be fetched from the bodies
+         * each time the contact is resolved. The resolver refreshes
+         * it when it moves a sleeping body, since that body's derived
+         * data is updated straight away.
+         */
+        Matrix3 inverseInertiaTensor[2];
+
+        /**
+         * Holds the change in velocity at the contact, in contact
+         * coordinates, caused by a unit impulse along each contact
+         * axis (the inverse of the contact's effective mass). This is
+         * set when the calculateInternals function is run.
+         */
+        Matrix3 velocityPerImpulse;
+
+        /**
+         * Holds the impulse, in contact coordinates, needed for a unit
+         * change in velocity along each contact axis: the inverse of
+         * velocityPerImpulse. This is only set for contacts with
+         * friction.
+         */
+        Matrix3 impulsePerVelocity;
+
+        /**
+         * Holds the relative velocity the sequential impulse solver
+         * is aiming for at the contact, in contact coordinates.
+         */
+        Vector3 targetVelocity;
+
+        /**
+         * Holds the total impulse the sequential impulse solver has
+         * applied at the contact, in contact coordinates. When warm
+         * starting, this is loaded from the contact cache before
+         * resolution, and the solver starts from it.
+         */
+        Vector3 accumulatedImpulse;
+
+        /**
+         * Holds the separating pseudo-velocity the split impulse
+         * position stage is aiming for along the contact normal.
+         */
+        real positionTarget;
+
+        /**
+         * Holds the total pseudo-impulse the split impulse position
+         * stage has applied along the contact normal.
+         */
+        real positionImpulse;
+
     protected:
         /**
          * Calculates internal data from state data. This is called before
@@ -164,12 +234,27 @@ namespace cyclone {
          */
         void calculateDesiredDeltaVelocity(real duration);
 
+        /**
+         * Finds the inverse inertia tensors and the velocity per unit
+         * impulse (and its inverse, for contacts with friction). This
+         * needs the contact basis and relative contact positions.
+         */
+        void calculateEffectiveMass();
+
         /**
          * Calculates and returns the velocity of the contact
          * point on the given body.
          */
         Vector3 calculateLocalVelocity(unsigned bodyIndex, real duration);
 
+        /**
+         * Calculates and returns the current relative velocity of the
+         * two bodies at the contact point, in contact coordinates. Unlike
+         * contactVelocity, this does not include the velocity due to the
+         * last frame's acceleration.
+         */
+        Vector3 calculateRelativeVelocity() const;
+
         /**
          * Calculates an orthonormal basis for the contact point, based on
          * the primary friction direction (for anisotropic friction) or
@@ -201,21 +286,427 @@ namespace cyclone {
 
         /**
          * Calculates the impulse needed to resolve this contact,
-         * given that the contact has no friction. A pair of inertia
-         * tensors - one for each contact object - is specified to
-         * save calculation time: the calling function has access to
-         * these anyway.
+         * given that the contact has no friction.
          */
-        Vector3 calculateFrictionlessImpulse(Matrix3 *inverseInertiaTensor);
+        Vector3 calculateFrictionlessImpulse();
 
         /**
          * Calculates the impulse needed to resolve this contact,
          * given that the contact has a non-zero coefficient of
-         * friction. A pair of inertia tensors - one for each contact
-         * object - is specified to save calculation time: the calling
-         * function has access to these anyway.
+         * friction.
+         */
+        Vector3 calculateFrictionImpulse();
+
+        /**
+         * Calculates the matrix that converts an impulse in contact
+         * coordinates into the change in relative velocity it causes,
+         * also in contact coordinates, from the stored inverse inertia
+         * tensors.
+         */
+        Matrix3 calculateVelocityPerImpulse();
+
+        /**
+         * Sets up the data the sequential impulse solver needs.
+         */
+        void prepareSequentialImpulse();
+
+        /**
+         * Applies the accumulated impulse to the bodies, so the
+         * sequential impulse solver starts from it.
+         */
+        void applyWarmStart();
+
+        /**
+         * Applies the given impulse, in contact coordinates, to both
+         * bodies in the contact.
+         */
+        void applyContactImpulse(const Vector3 &impulseContact);
+
+        /**
+         * Performs one sequential impulse step on this contact: the
+         * normal impulse is found and clamped so the accumulated
+         * impulse never pulls, then the friction impulse is found and
+         * clamped to the friction pyramid. Returns the largest change
+         * in velocity it caused.
+         */
+        real applySequentialImpulse();
+
+        /**
+         * Calculates the separating pseudo-velocity of the bodies at
+         * the contact point, along the contact normal. The arrays hold
+         * the linear and angular pseudo-velocity of each body, indexed
+         * by the given body numbers; bodies with infinite mass have no
+         * pseudo-velocity.
+         */
+        real calculatePseudoVelocity(const Vector3 *linear,
+                                     const Vector3 *angular,
+                                     const unsigned *bodyNumber) const;
+
+        /**
+         * Performs one split impulse step on this contact: the pseudo
+         * impulse along the normal is found and clamped so it never
+         * pulls, and applied to the bodies' pseudo-velocities. Returns
+         * the change in pseudo-velocity it caused.
          */
-        Vector3 calculateFrictionImpulse(Matrix3 *inverseInertiaTensor);
+        real applySplitImpulse(Vector3 *linear, Vector3 *angular,
+                               const unsigned *bodyNumber);
+    };
+
+    /**
+     * An indexed priority queue of contacts, ordered by severity
+     * (the desired change in velocity, or the penetration depth).
+     * It is a binary max-heap that also stores the heap position of
+     * each contact, so a contact whose severity changes can be moved
+     * to its new place in O(log n) time, rather than rescanning the
+     * whole contact array to find the worst contact.
+     *
+     * Contacts of equal severity are ordered by their index in the
+     * contact array, so the queue always returns the same contact
+     * that a linear scan for the maximum would have found.
+     */
+    class ContactQueue
+    {
+    protected:
+        /**
+         * Holds the contact indices in heap order: the most severe
+         * contact is at the front.
+         */
+        std::vector<unsigned> heap;
+
+        /**
+         * Holds the current position in the heap of each contact.
+         */
+        std::vector<unsigned> position;
+
+        /**
+         * Holds the severity of each contact, indexed by contact.
+         */
+        std::vector<real> severity;
+
+    public:
+        /**
+         * Clears the queue and sizes it for the given number of
+         * contacts. The severity of each contact should then be
+         * given with set, before build is called.
+         */
+        void reset(unsigned numContacts);
+
+        /**
+         * Sets the severity of the given contact, without restoring
+         * the heap order. Only use this between reset and build.
+         */
+        void set(unsigned index, real value)
+        {
+            severity[index] = value;
+        }
+
+        /**
+         * Arranges the contacts into heap order, once all their
+         * severities have been set.
+         */
+        void build();
+
+        /**
+         * Changes the severity of the given contact and moves it to
+         * its new position in the queue.
+         */
+        void update(unsigned index, real value);
+
+        /**
+         * Returns the index of the most severe contact.
+         */
+        unsigned top() const
+        {
+            return heap[0];
+        }
+
+        /**
+         * Returns the severity of the most severe contact.
+         */
+        real topSeverity() const
+        {
+            return severity[heap[0]];
+        }
+
+    protected:
+        /**
+         * Returns true if the first contact should be resolved
+         * before the second.
+         */
+        bool before(unsigned one, unsigned two) const
+        {
+            return severity[one] > severity[two] ||
+                (severity[one] == severity[two] && one < two);
+        }
+
+        /**
+         * Swaps the contacts at the two given heap positions.
+         */
+        void swap(unsigned one, unsigned two);
+
+        /**
+         * Moves the contact at the given heap position towards the
+         * front of the queue until it is in order.
+         */
+        void siftUp(unsigned slot);
+
+        /**
+         * Moves the contact at the given heap position towards the
+         * back of the queue until it is in order.
+         */
+        void siftDown(unsigned slot);
+    };
+
+    /**
+     * Keeps the impulses applied at each contact from one frame to the
+     * next, so the sequential impulse solver can start from last
+     * frame's solution (warm starting). Resting contacts then need only
+     * one or two sweeps to converge.
+     *
+     * Contacts are matched by their two bodies and their feature
+     * identifier. A contact whose normal has turned too far since the
+     * last frame starts from zero instead.
+     */
+    class ContactCache
+    {
+    protected:
+        /**
+         * Holds the impulse stored for one contact.
+         */
+        struct Entry
+        {
+            RigidBody *body[2];
+            unsigned feature;
+            Vector3 contactNormal;
+            Vector3 impulse;
+
+            /**
+             * True once the entry has been used to warm start a
+             * contact, so duplicate contacts don't share it.
+             */
+            bool used;
+        };
+
+        /**
+         * Holds the stored impulses, sorted by bodies then feature.
+         */
+        std::vector<Entry> entries;
+
+        /**
+         * Holds the fraction of last frame's impulse to start from.
+         */
+        real warmStartScale;
+
+        /**
+         * Holds the smallest cosine of the angle the contact normal can
+         * turn through between frames and still be warm started.
+         */
+        real normalTolerance;
+
+    public:
+        /**
+         * Creates an empty cache that uses the whole of last frame's
+         * impulse.
+         */
+        ContactCache();
+
+        /**
+         * Sets the fraction of last frame's impulse to start from.
+         * Values a little below one can soften the effect of contacts
+         * that are about to separate.
+         */
+        void setWarmStartScale(real warmStartScale);
+
+        /**
+         * Loads the stored impulse into each of the given contacts, or
+         * zero for contacts that weren't in the last frame.
+         */
+        void warmStart(Contact *contactArray, unsigned numContacts);
+
+        /**
+         * Replaces the stored impulses with those of the given
+         * contacts, once they have been resolved.
+         */
+        void update(const Contact *contactArray, unsigned numContacts);
+
+        /**
+         * Removes all the stored impulses.
+         */
+        void clear();
+
+    protected:
+        /**
+         * Returns true if the first entry should be sorted before the
+         * second.
+         */
+        static bool entryBefore(const Entry &one, const Entry &two);
+    };
+
+    /**
+     * Holds how well the contact resolver did with one island (or one
+     * set of contacts passed to resolveContacts).
+     */
+    struct IslandStats
+    {
+        /** The first contact of the island in the contact array. */
+        unsigned firstContact;
+
+        /** The number of contacts in the island. */
+        unsigned numContacts;
+
+        /** The number of velocity iterations (or sweeps) used. */
+        unsigned velocityIterations;
+
+        /** The number of position iterations used. */
+        unsigned positionIterations;
+
+        /**
+         * The velocity error left when resolution stopped. For the
+         * worst-first algorithm this is the largest desired change in
+         * velocity still outstanding; for sequential impulses it is the
+         * largest change made by the last sweep.
+         */
+        real velocityError;
+
+        /** The deepest penetration left when resolution stopped. */
+        real penetration;
+    };
+
+    /**
+     * Holds how well the contact resolver did with all the contacts in
+     * one call, and how long it took.
+     */
+    struct ResolutionStats
+    {
+        /** The number of islands (or sets of contacts) resolved. */
+        unsigned numIslands;
+
+        /** The total number of velocity iterations (or sweeps) used. */
+        unsigned velocityIterations;
+
+        /** The total number of position iterations used. */
+        unsigned positionIterations;
+
+        /** The largest velocity error left in any island. */
+        real velocityError;
+
+        /** The deepest penetration left in any island. */
+        real penetration;
+
+        /** The time taken, in seconds. */
+        real time;
+
+        /** True if any island was cut short by the time budget. */
+        bool outOfTime;
+    };
+
+    /**
+     * A piece of work made of many independent items, numbered from
+     * zero, which can be executed in any order or at the same time.
+     */
+    class ParallelTask
+    {
+    public:
+        /**
+         * Executes the items from begin up to, but not including, end.
+         */
+        virtual void execute(unsigned begin, unsigned end) = 0;
+
+        virtual ~ParallelTask() {}
+    };
+
+    /**
+     * This is the interface for anything that can run a parallel task,
+     * such as a pool of threads. The contact resolver uses it to
+     * resolve the contacts in each colour at the same time.
+     */
+    class ParallelRunner
+    {
+    public:
+        /**
+         * Executes all the items of the given task, returning once
+         * they are complete.
+         */
+        virtual void run(ParallelTask *task, unsigned count) = 0;
+
+        virtual ~ParallelRunner() {}
+    };
+
+    /**
+     * Holds a group of contacts that can be resolved on their own: no
+     * contact in the island shares a body with a contact outside it.
+     * The island's contacts are contiguous in the contact array.
+     */
+    struct ContactIsland
+    {
+        /** Holds the index of the island's first contact. */
+        unsigned firstContact;
+
+        /** Holds the number of contacts in the island. */
+        unsigned numContacts;
+    };
+
+    /**
+     * Splits an array of contacts into islands, using a union-find
+     * over the bodies the contacts touch. Contacts with the scenery
+     * (a NULL body) do not join islands together. Bodies with infinite
+     * mass do, because the resolver still updates their awake state
+     * and derived data, so islands that share them are not independent.
+     */
+    class IslandBuilder
+    {
+    protected:
+        /** Holds the union-find parent of each contact. */
+        std::vector<unsigned> parent;
+
+        /** Holds the island number of each contact. */
+        std::vector<unsigned> islandOf;
+
+        /** Holds each body slot and its contact, for sorting by body. */
+        std::vector< std::pair<RigidBody*, unsigned> > bodyEntries;
+
+        /** Holds the contacts while they are being reordered. */
+        std::vector<Contact> reordered;
+
+        /** Holds the islands found by the last call to buildIslands. */
+        std::vector<ContactIsland> islands;
+
+    public:
+        /**
+         * Finds the islands in the given contacts, and reorders the
+         * contact array so each island's contacts are contiguous. The
+         * contacts within an island stay in their original order, and
+         * the islands are ordered by their first contact. Returns the
+         * number of islands.
+         */
+        unsigned buildIslands(Contact *contactArray, unsigned numContacts);
+
+        /**
+         * Returns the number of islands found by the last build.
+         */
+        unsigned getNumIslands() const
+        {
+            return (unsigned)islands.size();
+        }
+
+        /**
+         * Returns the given island from the last build.
+         */
+        const ContactIsland& getIsland(unsigned index) const
+        {
+            return islands[index];
+        }
+
+    protected:
+        /**
+         * Finds the representative contact of the given contact's set.
+         */
+        unsigned findRoot(unsigned index);
+
+        /**
+         * Merges the sets holding the two given contacts.
+         */
+        void join(unsigned one, unsigned two);
     };
 
     /**
@@ -265,10 +756,110 @@ namespace cyclone {
      * In general this resolver is not suitable for stacks of bodies,
      * but is perfect for handling impact, explosive, and flat resting
      * situations.
+     *
+     * @subsection sequential Sequential Impulses
+     *
+     * For stacks and ragdolls, the velocity stage can instead use
+     * sequential impulses (projected Gauss-Seidel). This sweeps through
+     * every contact in turn, a fixed number of times, keeping a running
+     * total of the impulse at each contact. The total normal impulse is
+     * clamped so it never pulls the bodies together, and the total
+     * friction impulse is clamped to a pyramid around the normal. It
+     * needs far fewer passes over a stack than the worst-first
+     * algorithm needs iterations, because all contacts are improved
+     * together. Penetration is still resolved by the iterative
+     * satisfaction algorithm above.
+     *
+     * With warm starting, the running totals begin at the impulses a
+     * ContactCache has kept from the last frame, so resting contacts
+     * are already close to their solution before the first sweep.
+     *
+     * A single large island, such as a collapsing wall, can't be
+     * split up, but with graph colouring its contacts are put into
+     * colours, where no two contacts in a colour share a body that
+     * can move. The contacts in a colour can then be resolved in any
+     * order, or at the same time on several threads (see
+     * ParallelRunner), without changing the result. Bodies with
+     * infinite mass don't count as shared, since contacts never move
+     * them.
      */
     class ContactResolver
     {
+    public:
+        /**
+         * The algorithms that can be used to resolve velocities.
+         */
+        enum Algorithm
+        {
+            /**
+             * Repeatedly resolves the contact with the worst velocity.
+             * This is the default.
+             */
+            WORST_FIRST,
+
+            /**
+             * Sweeps through all the contacts a fixed number of times,
+             * applying sequential impulses with accumulated clamping.
+             */
+            SEQUENTIAL_IMPULSES
+        };
+
+        /**
+         * The algorithms that can be used to resolve penetration.
+         */
+        enum PositionAlgorithm
+        {
+            /**
+             * Repeatedly moves the bodies at the deepest contact
+             * apart. This is the default.
+             */
+            NONLINEAR_PROJECTION,
+
+            /**
+             * Sweeps through all the contacts, building up a
+             * pseudo-velocity for each body that separates the
+             * contacts, then moves each body once by its
+             * pseudo-velocity. The pseudo-velocity is then thrown
+             * away, so correcting penetration adds no energy.
+             */
+            SPLIT_IMPULSES
+        };
+
     protected:
+        /**
+         * Holds the algorithm used to resolve velocities.
+         */
+        Algorithm algorithm;
+
+        /**
+         * Holds the algorithm used to resolve penetration.
+         */
+        PositionAlgorithm positionAlgorithm;
+
+        /**
+         * Holds the number of sweeps through the contacts the
+         * sequential impulse algorithm makes.
+         */
+        unsigned velocitySweeps;
+
+        /**
+         * True if the sequential impulse algorithm should start from
+         * the impulses already in the contacts (see ContactCache).
+         */
+        bool warmStarting;
+
+        /**
+         * True if the sequential impulse algorithm should sweep the
+         * contacts colour by colour.
+         */
+        bool useColouring;
+
+        /**
+         * Holds the runner used to resolve each colour in parallel, or
+         * NULL to resolve them on the calling thread.
+         */
+        ParallelRunner *runner;
+
         /**
          * Holds the number of iterations to perform when resolving
          * velocity.
@@ -299,10 +890,170 @@ namespace cyclone {
          */
         real positionEpsilon;
 
+        /**
+         * True if the resolver should find the worst contact at each
+         * iteration using a severity queue, rather than scanning every
+         * contact. Both give the same results, but the queue is much
+         * faster when there are many contacts.
+         */
+        bool useSeverityQueue;
+
+        /**
+         * Holds the severity queue, when it is in use. It is kept
+         * between calls so its storage can be reused.
+         */
+        ContactQueue queue;
+
+        /**
+         * Holds the island builder used by resolveIslands.
+         */
+        IslandBuilder islandBuilder;
+
+        /**
+         * @name Body Adjacency
+         *
+         * After a contact is resolved, only the contacts that share one
+         * of its bodies need updating. These arrays map each body to
+         * the contacts it takes part in, in compressed sparse row form,
+         * so the resolver can visit just those contacts. They are
+         * rebuilt by prepareContacts for each call.
+         *
+         * Each entry identifies a contact and one of its body slots,
+         * as the contact index times two plus the slot (0 or 1).
+         */
+        /*@{*/
+        /**
+         * Holds the first entry in bodyContacts for each body, with a
+         * final element holding the total number of entries.
+         */
+        std::vector<unsigned> bodyContactStart;
+
+        /**
+         * Holds the contact entries for every body, grouped by body
+         * and in array order within each group.
+         */
+        std::vector<unsigned> bodyContacts;
+
+        /**
+         * Holds the body number of each contact entry, or noBody if
+         * the slot is empty (contacts with the scenery).
+         */
+        std::vector<unsigned> contactBody;
+
+        /**
+         * Holds the body and entry of each occupied slot while the
+         * adjacency is being sorted.
+         */
+        std::vector< std::pair<RigidBody*, unsigned> > bodyEntries;
+
+        /** Marks an empty body slot in contactBody. */
+        static const unsigned noBody = 0xffffffff;
+        /*@}*/
+
+        /**
+         * Holds the linear and angular pseudo-velocity of each body in
+         * the split impulse position stage, indexed by body number.
+         */
+        std::vector<Vector3> pseudoVelocity;
+        std::vector<Vector3> pseudoRotation;
+
+        /**
+         * @name Graph Colouring
+         *
+         * Contacts are coloured greedily in array order, each taking
+         * the lowest colour not already used at one of its movable
+         * bodies. The colours used at each body are kept as a bit
+         * mask, so there are at most maxColours colours; contacts that
+         * don't fit go into a final colour that is always resolved on
+         * the calling thread.
+         */
+        /*@{*/
+        /**
+         * Holds the colours used by each body's contacts so far.
+         */
+        std::vector<unsigned long long> bodyColours;
+
+        /**
+         * Holds the first entry in colourContacts for each colour,
+         * with a final element holding the number of contacts.
+         */
+        std::vector<unsigned> colourStart;
+
+        /**
+         * Holds the contact indices grouped by colour, and in array
+         * order within each colour.
+         */
+        std::vector<unsigned> colourContacts;
+
+        /**
+         * Holds the colour of each contact while they are grouped.
+         */
+        std::vector<unsigned> contactColour;
+
+        /**
+         * Holds the change in velocity made by each entry in
+         * colourContacts in the current sweep.
+         */
+        std::vector<real> colourChanges;
+
+        /**
+         * Holds the bodies whose awake state is still to be passed on
+         * to the bodies they touch, by body number.
+         */
+        std::vector<unsigned> wakeQueue;
+
+        /** The number of colours that can be resolved in parallel. */
+        static const unsigned maxColours = 64;
+        /*@}*/
+
+        /**
+         * The task that resolves the contacts in one colour.
+         */
+        class ColourSweep;
+
+        /**
+         * @name Telemetry and Time Budget
+         *
+         * Each call to resolve contacts records how many iterations
+         * each island took and what error was left. If a time budget
+         * is set, iterations stop once it runs out, even if the
+         * epsilons haven't been reached: up to half the budget is
+         * allowed for penetration, and the rest for velocity. Each
+         * stage always makes at least one iteration.
+         */
+        /*@{*/
+        /**
+         * Holds the time allowed for each call, in seconds, or zero
+         * for no limit.
+         */
+        real timeBudget;
+
+        /**
+         * Holds the time the current call started, and the times by
+         * which the position and velocity stages must stop, in seconds
+         * on a monotonic clock.
+         */
+        double startTime;
+        double positionDeadline;
+        double velocityDeadline;
+
+        /**
+         * Holds the totals for the current (or last) call.
+         */
+        ResolutionStats stats;
+
+        /**
+         * Holds the results for each island in the current (or last)
+         * call, in contact array order.
+         */
+        std::vector<IslandStats> islandStats;
+        /*@}*/
+
     public:
         /**
          * Stores the number of velocity iterations used in the
-         * last call to resolve contacts.
+         * last call to resolve contacts. For sequential impulses this
+         * is the number of sweeps.
          */
         unsigned velocityIterationsUsed;
 
@@ -364,6 +1115,123 @@ namespace cyclone {
         void setEpsilon(real velocityEpsilon,
                         real positionEpsilon);
 
+        /**
+         * Sets whether the resolver uses a severity queue to find the
+         * worst contact at each iteration. This does not change the
+         * results, but turns each iteration's search from a scan of
+         * every contact into a heap update. It is worth using when
+         * resolving hundreds of contacts or more.
+         */
+        void setSeverityQueue(bool useSeverityQueue);
+
+        /**
+         * Sets the algorithm used to resolve velocities.
+         */
+        void setAlgorithm(Algorithm algorithm);
+
+        /**
+         * Returns the algorithm used to resolve velocities.
+         */
+        Algorithm getAlgorithm() const
+        {
+            return algorithm;
+        }
+
+        /**
+         * Sets the algorithm used to resolve penetration. Split
+         * impulses make as many sweeps as the sequential impulse
+         * algorithm (see setSweeps), stopping early once no sweep
+         * would move a contact by more than the position epsilon.
+         */
+        void setPositionAlgorithm(PositionAlgorithm positionAlgorithm);
+
+        /**
+         * Returns the algorithm used to resolve penetration.
+         */
+        PositionAlgorithm getPositionAlgorithm() const
+        {
+            return positionAlgorithm;
+        }
+
+        /**
+         * Sets the number of sweeps through the contacts made by the
+         * sequential impulse algorithm. Each sweep visits every contact
+         * once. The sweeps stop early if one makes no change larger than
+         * the velocity epsilon. The default is ten.
+         */
+        void setSweeps(unsigned velocitySweeps);
+
+        /**
+         * Sets whether the sequential impulse algorithm starts from the
+         * impulses held in the contacts, rather than from zero. The
+         * impulses should have been loaded by a ContactCache; otherwise
+         * they are undefined.
+         */
+        void setWarmStarting(bool warmStarting);
+
+        /**
+         * Sets whether the sequential impulse algorithm sweeps the
+         * contacts colour by colour, rather than in array order. The
+         * result then doesn't depend on whether a parallel runner is
+         * used.
+         */
+        void setGraphColouring(bool useColouring);
+
+        /**
+         * Returns true if the sequential impulse algorithm sweeps the
+         * contacts colour by colour.
+         */
+        bool getGraphColouring() const;
+
+        /**
+         * Sets the runner used to resolve the contacts in each colour
+         * in parallel, or NULL (the default) to resolve them on the
+         * calling thread. This only has an effect with graph
+         * colouring.
+         */
+        void setParallelRunner(ParallelRunner *runner);
+
+        /**
+         * Sets the time, in seconds, that each call to resolve contacts
+         * may take, or zero (the default) for no limit. This bounds the
+         * time taken when a large pile needs many iterations, at the
+         * cost of leaving some error behind.
+         */
+        void setTimeBudget(real timeBudget);
+
+        /**
+         * Returns the totals for the last call to resolve contacts.
+         */
+        const ResolutionStats& getStats() const;
+
+        /**
+         * Returns the results for each island in the last call to
+         * resolve contacts, in contact array order.
+         */
+        const std::vector<IslandStats>& getIslandStats() const;
+
+        /**
+         * Starts a call to resolve contacts: clears the stats and
+         * starts the time budget. resolveContacts and resolveIslands do
+         * this themselves; it need only be called before resolving
+         * islands one by one with resolveIsland.
+         */
+        void beginResolution();
+
+        /**
+         * Finishes a call to resolve contacts, recording the time it
+         * took. As for beginResolution, this is only needed when using
+         * resolveIsland directly.
+         */
+        void endResolution();
+
+        /**
+         * Adds the island results gathered by another resolver to this
+         * one's. This is used when the islands of one call have been
+         * resolved by copies of this resolver.
+         */
+        void addStats(const ContactResolver &other);
+
         /**
          * Resolves a set of contacts for both penetration and velocity.
          *
@@ -394,28 +1262,112 @@ namespace cyclone {
             unsigned numContacts,
             real duration);
 
+        /**
+         * Resolves a set of contacts for both penetration and velocity,
+         * one island at a time.
+         *
+         * The contacts are first split into islands that share no
+         * bodies (see IslandBuilder), and the contact array is
+         * reordered so each island is contiguous. Each island is then
+         * resolved on its own, with a share of the iteration budget in
+         * proportion to its number of contacts. Iterations an island
+         * doesn't need are not passed on to other islands, so a pile
+         * that is hard to resolve can't starve the others.
+         *
+         * The iterations used by all the islands are summed into
+         * velocityIterationsUsed and positionIterationsUsed.
+         */
+        void resolveIslands(Contact *contactArray,
+            unsigned numContacts,
+            real duration);
+
+        /**
+         * Resolves a single island from a contact array that has been
+         * split by an IslandBuilder. The island is given its share of
+         * the iteration budget, based on the total number of contacts
+         * in the array.
+         */
+        void resolveIsland(Contact *contactArray,
+            const ContactIsland &island,
+            unsigned numContacts,
+            real duration);
+
     protected:
+        /**
+         * Resolves the given run of contacts from the contact array,
+         * recording how well it did in the stats.
+         */
+        void resolveSet(Contact *contactArray,
+            unsigned firstContact,
+            unsigned numContacts,
+            real duration);
+
+        /**
+         * Returns true if there is a time budget and the given
+         * deadline has passed, noting it in the stats.
+         */
+        bool overBudget(double deadline);
+
         /**
          * Sets up contacts ready for processing. This makes sure their
          * internal data is configured correctly and the correct set of bodies
-         * is made alive.
+         * is made alive. It also builds the body adjacency.
          */
         void prepareContacts(Contact *contactArray, unsigned numContacts,
             real duration);
 
+        /**
+         * Builds the body adjacency arrays for the given contacts.
+         */
+        void buildBodyAdjacency(Contact *contactArray, unsigned numContacts);
+
         /**
          * Resolves the velocity issues with the given array of constraints,
-         * using the given number of iterations.
+         * using the given number of iterations. Returns the largest
+         * desired change in velocity left.
+         */
+        real adjustVelocities(Contact *contactArray,
+            unsigned numContacts,
+            real duration);
+
+        /**
+         * Resolves the velocity issues with the given array of
+         * constraints, using sequential impulses. Returns the largest
+         * change in velocity made by the last sweep.
+         */
+        real sweepVelocities(Contact *contactArray,
+            unsigned numContacts);
+
+        /**
+         * Resolves the positional issues with the given array of
+         * constraints, using split impulses. Returns the deepest
+         * penetration left.
          */
-        void adjustVelocities(Contact *contactArray,
+        real splitPositions(Contact *contactArray,
             unsigned numContacts,
             real duration);
 
+        /**
+         * Splits the given contacts into colours, returning the number
+         * of colours, including the final colour if it is needed.
+         */
+        unsigned colourContactGraph(Contact *contactArray,
+            unsigned numContacts);
+
+        /**
+         * Makes one sweep through the given contacts, colour by
+         * colour, returning the largest change in velocity made. The
+         * sweep applies split impulses if positions is true, or
+         * sequential impulses otherwise.
+         */
+        real sweepColours(Contact *contactArray, bool positions);
+
         /**
          * Resolves the positional issues with the given array of constraints,
-         * using the given number of iterations.
+         * using the given number of iterations. Returns the deepest
+         * penetration left.
          */
-        void adjustPositions(Contact *contacts,
+        real adjustPositions(Contact *contacts,
             unsigned numContacts,
             real duration);
     };
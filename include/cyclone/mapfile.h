@@ -0,0 +1,98 @@
+/*
+ * Interface file for read-only memory mapped files.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains a wrapper for mapping a file into memory, so
+ * large blocks of collision data can be used straight from disk
+ * without being read and copied first.
+ */
+#ifndef CYCLONE_MAPFILE_H
+#define CYCLONE_MAPFILE_H
+
+#include <cstddef>
+
+namespace cyclone {
+
+    /**
+     * Maps the whole of a file into memory, read-only. The operating
+     * system loads the pages of the file as they are first touched,
+     * so opening even a very large file is quick.
+     */
+    class MappedFile
+    {
+    public:
+        MappedFile();
+
+        ~MappedFile();
+
+        /**
+         * Maps the given file, closing any file already mapped.
+         * Returns false if the file can't be opened or mapped.
+         */
+        bool open(const char *filename);
+
+        /**
+         * Unmaps the file, if there is one.
+         */
+        void close();
+
+        /**
+         * Swaps the mapped files of this and the given object. The
+         * addresses of the mappings don't change.
+         */
+        void swap(MappedFile &other);
+
+        /**
+         * Returns true if a file is mapped.
+         */
+        bool isOpen() const
+        {
+            return data != NULL;
+        }
+
+        /**
+         * Returns the start of the mapped file.
+         */
+        const void *getData() const
+        {
+            return data;
+        }
+
+        /**
+         * Returns the size of the mapped file in bytes.
+         */
+        size_t getSize() const
+        {
+            return size;
+        }
+
+    private:
+        /** Holds the start of the mapping. */
+        const void *data;
+
+        /** Holds the size of the mapping. */
+        size_t size;
+
+        /** Holds the file and mapping handles, on Windows only. */
+        void *file;
+        void *mapping;
+
+        /** Mappings can't be copied. */
+        MappedFile(const MappedFile &);
+        MappedFile &operator=(const MappedFile &);
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_MAPFILE_H
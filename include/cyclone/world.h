@@ -23,6 +23,13 @@
 #include "contacts.h"
 
 namespace cyclone {
+
+    /*
+     * Forward declaration of the pool of threads that resolves contact
+     * islands in parallel. It is defined in world.cpp.
+     */
+    class IslandWorkers;
+
     /**
      * The world represents an independent simulation of physics.  It
      * keeps track of a set of rigid bodies, and provides the means to
@@ -56,6 +63,24 @@ namespace cyclone {
          */
         ContactResolver resolver;
 
+        /**
+         * Holds the number of iterations given to the resolver for
+         * each contact, when the iterations are calculated.
+         */
+        unsigned iterationsPerContact;
+
+        /**
+         * Holds the impulses of last frame's contacts, used to warm
+         * start the resolver.
+         */
+        ContactCache contactCache;
+
+        /**
+         * True if the world should warm start the resolver from the
+         * contact cache.
+         */
+        bool warmStarting;
+
         /**
          * Holds one contact generators in a linked list.
          */
@@ -82,6 +107,13 @@ namespace cyclone {
          */
         unsigned maxContacts;
 
+        /**
+         * Holds the worker threads used to resolve contact islands in
+         * parallel, or NULL if contacts are resolved on the calling
+         * thread.
+         */
+        IslandWorkers *workers;
+
     public:
         /**
          * Creates a new simulator that can handle up to the given
@@ -93,6 +125,19 @@ namespace cyclone {
         World(unsigned maxContacts, unsigned iterations=0);
         ~World();
 
+        /**
+         * Registers the given rigid body with the world, so it is
+         * updated by startFrame and runPhysics. Bodies are processed in
+         * the order they were added.
+         */
+        void addBody(RigidBody *body);
+
+        /**
+         * Registers the given contact generator with the world.
+         * Generators are called in the order they were added.
+         */
+        void addContactGenerator(ContactGenerator *gen);
+
         /**
          * Calls each of the registered contact generators to report
          * their contacts. Returns the number of generated contacts.
@@ -112,6 +157,80 @@ namespace cyclone {
          */
         void startFrame();
 
+        /**
+         * Sets the number of threads used to resolve contacts. Contacts
+         * are split into islands that share no bodies, and the islands
+         * are shared out between the threads, largest first. Threads
+         * that run out of islands take them from the others.
+         *
+         * Each island is resolved exactly as it would be on a single
+         * thread, so the results do not depend on the number of threads.
+         *
+         * One thread (the default) resolves everything on the thread
+         * calling runPhysics. The calling thread is always one of the
+         * threads used. Zero uses one thread per hardware core.
+         */
+        void setWorkerThreads(unsigned threads);
+
+        /**
+         * Sets the algorithm this world's contact resolver uses to
+         * resolve velocities.
+         *
+         * @see ContactResolver::Algorithm
+         */
+        void setResolverAlgorithm(ContactResolver::Algorithm algorithm);
+
+        /**
+         * Sets the algorithm this world's contact resolver uses to
+         * resolve interpenetration.
+         *
+         * @see ContactResolver::PositionAlgorithm
+         */
+        void setResolverPositionAlgorithm(
+            ContactResolver::PositionAlgorithm positionAlgorithm);
+
+        /**
+         * Sets whether contacts that persist from one frame to the next
+         * start from the impulse they had in the last frame. This only
+         * affects the sequential impulse algorithm, and relies on the
+         * contact generators calling Contact::setBodyData and filling
+         * in Contact::feature for pairs with several contacts.
+         */
+        void setWarmStarting(bool warmStarting);
+
+        /**
+         * Sets whether the sequential impulse and split impulse
+         * algorithms resolve the contacts colour by colour (see
+         * ContactResolver). With more than one worker thread, the
+         * contacts in each colour of a large island are then shared
+         * between the threads. The
+         * results do not depend on the number of threads either way.
+         */
+        void setGraphColouring(bool useColouring);
+
+        /**
+         * Sets the number of iterations given to the contact resolver
+         * for each contact, if the world was created with zero
+         * iterations. The default is four.
+         */
+        void setIterationsPerContact(unsigned iterationsPerContact);
+
+        /**
+         * Sets the time, in seconds, that resolving the contacts may
+         * take each frame, or zero (the default) for no limit. Piles
+         * that need many iterations are then left slightly unresolved,
+         * rather than holding up the frame.
+         *
+         * @see ContactResolver::setTimeBudget
+         */
+        void setTimeBudget(real timeBudget);
+
+        /**
+         * Returns the contact resolver, which holds the stats for the
+         * last frame's contacts.
+         */
+        const ContactResolver& getResolver() const;
+
     };
 
 } // namespace cyclone
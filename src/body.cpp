@@ -137,6 +137,12 @@ static inline void _calculateTransformMatrix(Matrix4 &transformMatrix,
  * FUNCTIONS DECLARED IN HEADER:
  * --------------------------------------------------------------------------
  */
+RigidBody::RigidBody()
+{
+    ccdEnabled = false;
+    lastPosition = position;
+}
+
 void RigidBody::calculateDerivedData()
 {
     orientation.normalise();
@@ -154,6 +160,9 @@ void RigidBody::calculateDerivedData()
 
 void RigidBody::integrate(real duration)
 {
+    // Keep the start of the step, so the body can be swept along it.
+    if (ccdEnabled) lastPosition = position;
+
     if (!isAwake) return;
 
     // Calculate linear acceleration from force inputs.
@@ -319,6 +328,7 @@ real RigidBody::getAngularDamping() const
 void RigidBody::setPosition(const Vector3 &position)
 {
     RigidBody::position = position;
+    lastPosition = position;
 }
 
 void RigidBody::setPosition(const real x, const real y, const real z)
@@ -326,6 +336,7 @@ void RigidBody::setPosition(const real x, const real y, const real z)
     position.x = x;
     position.y = y;
     position.z = z;
+    lastPosition = position;
 }
 
 void RigidBody::getPosition(Vector3 *position) const
@@ -521,6 +532,19 @@ void RigidBody::setCanSleep(const bool canSleep)
     if (!canSleep && !isAwake) setAwake();
 }
 
+void RigidBody::setCcdEnabled(const bool ccdEnabled)
+{
+    RigidBody::ccdEnabled = ccdEnabled;
+
+    // A body that has just been enabled hasn't moved yet.
+    lastPosition = position;
+}
+
+Vector3 RigidBody::getLastPosition() const
+{
+    return lastPosition;
+}
+
 
 void RigidBody::getLastFrameAcceleration(Vector3 *acceleration) const
 {
@@ -12,6 +12,15 @@
 
 
 #include <cyclone/collide_coarse.h>
+#include <cyclone/collide_fine.h>
+#include <algorithm>
+
+// Use SSE to test bounding boxes where it is available.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define COARSE_SSE 1
+
+    #include <emmintrin.h>
+#endif
 
 using namespace cyclone;
 
@@ -75,4 +84,960 @@ real BoundingSphere::getGrowth(const BoundingSphere &other) const
     // We return a value proportional to the change in surface
     // area of the sphere.
     return newSphere.radius*newSphere.radius - radius*radius;
-}
\ No newline at end of file
+}
+
+bool BoundingSphere::contains(const BoundingSphere &other) const
+{
+    real reach = radius - other.radius;
+    if (reach < 0) return false;
+    return (other.centre - centre).squareMagnitude() <= reach*reach;
+}
+
+void BoundingSphere::expand(real margin)
+{
+    radius += margin;
+}
+
+BoundingBox::BoundingBox(const Vector3 &minimum, const Vector3 &maximum)
+{
+    BoundingBox::minimum = minimum;
+    BoundingBox::maximum = maximum;
+}
+
+BoundingBox::BoundingBox(const BoundingBox &one, const BoundingBox &two)
+{
+    minimum.x = one.minimum.x < two.minimum.x ? one.minimum.x : two.minimum.x;
+    minimum.y = one.minimum.y < two.minimum.y ? one.minimum.y : two.minimum.y;
+    minimum.z = one.minimum.z < two.minimum.z ? one.minimum.z : two.minimum.z;
+    maximum.x = one.maximum.x > two.maximum.x ? one.maximum.x : two.maximum.x;
+    maximum.y = one.maximum.y > two.maximum.y ? one.maximum.y : two.maximum.y;
+    maximum.z = one.maximum.z > two.maximum.z ? one.maximum.z : two.maximum.z;
+}
+
+BoundingBox::BoundingBox(const CollisionBox &box)
+{
+    // Each axis of the box reaches out along the world axes by the
+    // size of its projection onto them.
+    Vector3 extent;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 axis = box.getAxis(i) * box.halfSize[i];
+        extent.x += real_abs(axis.x);
+        extent.y += real_abs(axis.y);
+        extent.z += real_abs(axis.z);
+    }
+
+    Vector3 centre = box.getAxis(3);
+    minimum = centre - extent;
+    maximum = centre + extent;
+}
+
+BoundingBox::BoundingBox(const CollisionSphere &sphere)
+{
+    Vector3 extent(sphere.radius, sphere.radius, sphere.radius);
+    Vector3 centre = sphere.getAxis(3);
+    minimum = centre - extent;
+    maximum = centre + extent;
+}
+
+bool BoundingBox::overlaps(const BoundingBox *other) const
+{
+#if defined(COARSE_SSE) && defined(SINGLE_PRECISION)
+    // Compare all three axes at once, ignoring the vectors' padding.
+    __m128 below = _mm_cmple_ps(
+        _mm_loadu_ps(&minimum.x), _mm_loadu_ps(&other->maximum.x));
+    __m128 above = _mm_cmple_ps(
+        _mm_loadu_ps(&other->minimum.x), _mm_loadu_ps(&maximum.x));
+    return (_mm_movemask_ps(_mm_and_ps(below, above)) & 7) == 7;
+#elif defined(COARSE_SSE)
+    // Compare x and y together, then z.
+    __m128d below = _mm_cmple_pd(
+        _mm_loadu_pd(&minimum.x), _mm_loadu_pd(&other->maximum.x));
+    __m128d above = _mm_cmple_pd(
+        _mm_loadu_pd(&other->minimum.x), _mm_loadu_pd(&maximum.x));
+    __m128d belowZ = _mm_cmple_sd(
+        _mm_load_sd(&minimum.z), _mm_load_sd(&other->maximum.z));
+    __m128d aboveZ = _mm_cmple_sd(
+        _mm_load_sd(&other->minimum.z), _mm_load_sd(&maximum.z));
+    return _mm_movemask_pd(_mm_and_pd(below, above)) == 3 &&
+        (_mm_movemask_pd(_mm_and_pd(belowZ, aboveZ)) & 1);
+#else
+    // Without branches, so the compiler can test the axes together.
+    return (minimum.x <= other->maximum.x) & (other->minimum.x <= maximum.x) &
+        (minimum.y <= other->maximum.y) & (other->minimum.y <= maximum.y) &
+        (minimum.z <= other->maximum.z) & (other->minimum.z <= maximum.z);
+#endif
+}
+
+real BoundingBox::getGrowth(const BoundingBox &other) const
+{
+    BoundingBox newBox(*this, other);
+    return newBox.getSize() - getSize();
+}
+
+bool BoundingBox::contains(const BoundingBox &other) const
+{
+    return minimum.x <= other.minimum.x && other.maximum.x <= maximum.x &&
+        minimum.y <= other.minimum.y && other.maximum.y <= maximum.y &&
+        minimum.z <= other.minimum.z && other.maximum.z <= maximum.z;
+}
+
+void BoundingBox::expand(real margin)
+{
+    Vector3 extent(margin, margin, margin);
+    minimum -= extent;
+    maximum += extent;
+}
+
+const unsigned SweepAndPrune::NO_HANDLE;
+
+SweepAndPrune::SweepAndPrune()
+    : freeProxies(NO_HANDLE), bodyCount(0)
+{
+}
+
+unsigned SweepAndPrune::insert(RigidBody *body, const BoundingBox &box)
+{
+    unsigned handle;
+    if (freeProxies != NO_HANDLE)
+    {
+        handle = freeProxies;
+        freeProxies = proxies[handle].minimum[0];
+        proxies[handle] = Proxy(body, box);
+    }
+    else
+    {
+        handle = (unsigned)proxies.size();
+        proxies.push_back(Proxy(body, box));
+    }
+
+    added.push_back(handle);
+    bodyCount++;
+    return handle;
+}
+
+void SweepAndPrune::remove(unsigned handle)
+{
+    Proxy &proxy = proxies[handle];
+    if (!proxy.merged)
+    {
+        // The proxy has no ends or events yet.
+        added.erase(std::find(added.begin(), added.end(), handle));
+    }
+    else
+    {
+        addOverlapEvents(handle, false);
+
+        // Close up the gaps the ends leave, moving the ends after
+        // them down.
+        for (unsigned axis = 0; axis < 3; axis++)
+        {
+            std::vector<Endpoint> &axisEnds = endpoints[axis];
+            unsigned to = proxy.minimum[axis];
+            for (unsigned from = to + 1; from < axisEnds.size(); from++)
+            {
+                if (from == proxy.maximum[axis]) continue;
+
+                Endpoint end = axisEnds[from];
+                Proxy &owner = proxies[end.getProxy()];
+                if (end.isMaximum()) owner.maximum[axis] = to;
+                else owner.minimum[axis] = to;
+                axisEnds[to++] = end;
+            }
+            axisEnds.resize(to);
+        }
+    }
+
+    proxy.body = NULL;
+    proxy.minimum[0] = freeProxies;
+    freeProxies = handle;
+    bodyCount--;
+}
+
+void SweepAndPrune::update(unsigned handle, const BoundingBox &box)
+{
+    proxies[handle].box = box;
+}
+
+void SweepAndPrune::sort()
+{
+    // Copy the new boxes into the ends first, so all the boxes are
+    // where they now are before any pairs are compared.
+    for (unsigned handle = 0; handle < proxies.size(); handle++)
+    {
+        const Proxy &proxy = proxies[handle];
+        if (!proxy.body || !proxy.merged) continue;
+
+        for (unsigned axis = 0; axis < 3; axis++)
+        {
+            endpoints[axis][proxy.minimum[axis]].value =
+                proxy.box.minimum[axis];
+            endpoints[axis][proxy.maximum[axis]].value =
+                proxy.box.maximum[axis];
+        }
+    }
+
+    for (unsigned axis = 0; axis < 3; axis++)
+    {
+        sortAxis(axis);
+    }
+
+    if (!added.empty()) mergeAdded();
+}
+
+void SweepAndPrune::clear()
+{
+    for (unsigned axis = 0; axis < 3; axis++) endpoints[axis].clear();
+    proxies.clear();
+    added.clear();
+    freeProxies = NO_HANDLE;
+    bodyCount = 0;
+}
+
+void SweepAndPrune::sortAxis(unsigned axis)
+{
+    std::vector<Endpoint> &axisEnds = endpoints[axis];
+    unsigned other1 = (axis + 1) % 3, other2 = (axis + 2) % 3;
+
+    for (unsigned i = 1; i < axisEnds.size(); i++)
+    {
+        Endpoint end = axisEnds[i];
+        unsigned handle = end.getProxy();
+        Proxy &moving = proxies[handle];
+
+        // Ends that are already in place, which is almost all of
+        // them, cost this one comparison.
+        unsigned j = i;
+        while (j > 0)
+        {
+            const Endpoint before = axisEnds[j-1];
+            if (!(end < before)) break;
+
+            // A minimum moving back past a maximum starts an overlap
+            // along this axis, and a maximum moving back past a
+            // minimum ends one. Either way the pair's overlap changes
+            // only if they overlap along the other axes.
+            unsigned other = before.getProxy();
+            Proxy &passed = proxies[other];
+            if (end.isMaximum() != before.isMaximum() &&
+                overlapsOn(moving, passed, other1) &&
+                overlapsOn(moving, passed, other2))
+            {
+                addEvent(handle, other, !end.isMaximum());
+            }
+
+            if (before.isMaximum()) passed.maximum[axis] = j;
+            else passed.minimum[axis] = j;
+            axisEnds[j] = before;
+            j--;
+        }
+
+        if (j != i)
+        {
+            if (end.isMaximum()) moving.maximum[axis] = j;
+            else moving.minimum[axis] = j;
+            axisEnds[j] = end;
+        }
+    }
+}
+
+void SweepAndPrune::mergeAdded()
+{
+    for (unsigned axis = 0; axis < 3; axis++)
+    {
+        // Sort the new ends on their own.
+        merging.clear();
+        for (unsigned i = 0; i < added.size(); i++)
+        {
+            const Proxy &proxy = proxies[added[i]];
+            Endpoint end;
+            end.value = proxy.box.minimum[axis];
+            end.data = added[i] << 1;
+            merging.push_back(end);
+            end.value = proxy.box.maximum[axis];
+            end.data = (added[i] << 1) | 1;
+            merging.push_back(end);
+        }
+        std::sort(merging.begin(), merging.end());
+
+        // Merge them in from the back, so only the ends after the
+        // first new one move.
+        std::vector<Endpoint> &axisEnds = endpoints[axis];
+        unsigned from = (unsigned)axisEnds.size();
+        unsigned remaining = (unsigned)merging.size();
+        unsigned to = from + remaining;
+        axisEnds.resize(to);
+        while (remaining > 0)
+        {
+            Endpoint end;
+            if (from > 0 && merging[remaining-1] < axisEnds[from-1])
+            {
+                end = axisEnds[--from];
+            }
+            else
+            {
+                end = merging[--remaining];
+            }
+
+            Proxy &owner = proxies[end.getProxy()];
+            if (end.isMaximum()) owner.maximum[axis] = --to;
+            else owner.minimum[axis] = --to;
+            axisEnds[to] = end;
+        }
+    }
+
+    // Sweep along the first axis, keeping the proxies that overlap
+    // the sweep, and test each pair with a new proxy along the other
+    // axes as it starts.
+    const std::vector<Endpoint> &axisEnds = endpoints[0];
+    active.clear();
+    for (unsigned i = 0; i < axisEnds.size(); i++)
+    {
+        const Endpoint &end = axisEnds[i];
+        unsigned handle = end.getProxy();
+        const Proxy &proxy = proxies[handle];
+
+        if (end.isMaximum())
+        {
+            unsigned index = (unsigned)(
+                std::find(active.begin(), active.end(), handle) -
+                active.begin());
+            active[index] = active.back();
+            active.pop_back();
+            continue;
+        }
+
+        for (unsigned j = 0; j < active.size(); j++)
+        {
+            const Proxy &other = proxies[active[j]];
+            if (proxy.merged && other.merged) continue;
+
+            if (overlapsOn(proxy, other, 1) &&
+                overlapsOn(proxy, other, 2))
+            {
+                addEvent(handle, active[j], true);
+            }
+        }
+        active.push_back(handle);
+    }
+
+    for (unsigned i = 0; i < added.size(); i++)
+    {
+        proxies[added[i]].merged = true;
+    }
+    added.clear();
+}
+
+void SweepAndPrune::addEvent(unsigned one, unsigned two, bool added)
+{
+    PairEvent event;
+    event.body[0] = proxies[one].body;
+    event.body[1] = proxies[two].body;
+    event.added = added;
+    events.push_back(event);
+}
+
+void SweepAndPrune::addOverlapEvents(unsigned handle, bool added)
+{
+    const Proxy &proxy = proxies[handle];
+
+    // Every proxy that overlaps along the first axis has its
+    // minimum before the proxy's maximum.
+    const std::vector<Endpoint> &axisEnds = endpoints[0];
+    for (unsigned i = 0; i < proxy.maximum[0]; i++)
+    {
+        const Endpoint &end = axisEnds[i];
+        unsigned other = end.getProxy();
+        if (end.isMaximum() || other == handle) continue;
+
+        const Proxy &otherProxy = proxies[other];
+        if (overlapsOn(proxy, otherProxy, 0) &&
+            overlapsOn(proxy, otherProxy, 1) &&
+            overlapsOn(proxy, otherProxy, 2))
+        {
+            addEvent(handle, other, added);
+        }
+    }
+}
+
+const unsigned SpatialHash::ranges;
+
+SpatialHash::SpatialHash()
+    : mask(0), cellSize(1)
+{
+}
+
+void SpatialHash::insert(RigidBody *body, const BoundingBox &box)
+{
+    added.push_back(Entry(body, box));
+}
+
+void SpatialHash::clear()
+{
+    added.clear();
+    entries.clear();
+    slots.clear();
+}
+
+void SpatialHash::build()
+{
+    // The cells must be at least as large as every box.
+    cellSize = 0;
+    for (unsigned i = 0; i < added.size(); i++)
+    {
+        Vector3 extent = added[i].box.maximum - added[i].box.minimum;
+        if (extent.x > cellSize) cellSize = extent.x;
+        if (extent.y > cellSize) cellSize = extent.y;
+        if (extent.z > cellSize) cellSize = extent.z;
+    }
+    if (cellSize <= 0) cellSize = 1;
+
+    // Use at least twice as many slots as bodies, so few cells share
+    // a slot.
+    unsigned size = ranges;
+    while (size < added.size() * 2) size <<= 1;
+    mask = size - 1;
+
+    // Sort the bodies by slot: count the bodies in each slot, find
+    // where each slot ends, and fill each slot from the end back.
+    slots.assign(size + 1, 0);
+    for (unsigned i = 0; i < added.size(); i++)
+    {
+        Entry &entry = added[i];
+        for (unsigned axis = 0; axis < 3; axis++)
+        {
+            entry.cell[axis] =
+                (int)real_floor(entry.box.minimum[axis] / cellSize);
+        }
+        slots[getSlot(entry.cell[0], entry.cell[1], entry.cell[2])]++;
+    }
+    for (unsigned slot = 1; slot <= size; slot++)
+    {
+        slots[slot] += slots[slot-1];
+    }
+
+    entries = added;
+    for (unsigned i = (unsigned)added.size(); i > 0; i--)
+    {
+        const Entry &entry = added[i-1];
+        unsigned slot = getSlot(entry.cell[0], entry.cell[1], entry.cell[2]);
+        entries[--slots[slot]] = entry;
+    }
+}
+
+/*
+ * The cells whose bodies are tested against a body: its own cell and
+ * the half of its neighbours that come after it, so each pair of
+ * cells is visited once.
+ */
+static const int neighbours[14][3] = {
+    {0,0,0}, {0,0,1}, {0,1,-1}, {0,1,0}, {0,1,1},
+    {1,-1,-1}, {1,-1,0}, {1,-1,1}, {1,0,-1}, {1,0,0},
+    {1,0,1}, {1,1,-1}, {1,1,0}, {1,1,1}
+};
+
+/*
+ * Finds the pairs in the bodies of each range of slots of a spatial
+ * hash, writing them to the range's own list.
+ */
+class SpatialHash::PairSearch : public ParallelTask
+{
+public:
+    SpatialHash *hash;
+
+    virtual void execute(unsigned begin, unsigned end)
+    {
+        unsigned size = hash->mask + 1;
+        for (unsigned range = begin; range < end; range++)
+        {
+            std::vector<PotentialContact> &found = hash->found[range];
+            found.clear();
+
+            unsigned first = hash->slots[range * size / ranges];
+            unsigned last = hash->slots[(range + 1) * size / ranges];
+            for (unsigned i = first; i < last; i++)
+            {
+                searchFrom(i, found);
+            }
+        }
+    }
+
+    /*
+     * Tests the given entry against the later bodies in its own cell
+     * and all the bodies in the cells after it.
+     */
+    void searchFrom(unsigned index, std::vector<PotentialContact> &found)
+    {
+        const Entry *entries = &hash->entries[0];
+        const unsigned *slots = &hash->slots[0];
+        const Entry &entry = entries[index];
+        for (unsigned n = 0; n < 14; n++)
+        {
+            int x = entry.cell[0] + neighbours[n][0];
+            int y = entry.cell[1] + neighbours[n][1];
+            int z = entry.cell[2] + neighbours[n][2];
+            unsigned slot = hash->getSlot(x, y, z);
+
+            // Other cells can share the slot, so check each body is
+            // in the cell being visited.
+            unsigned j = n == 0 ? index + 1 : slots[slot];
+            unsigned last = slots[slot + 1];
+            for (; j < last; j++)
+            {
+                const Entry &other = entries[j];
+                if (other.cell[0] != x || other.cell[1] != y ||
+                    other.cell[2] != z) continue;
+                if (!entry.box.overlaps(&other.box)) continue;
+
+                PotentialContact contact;
+                contact.body[0] = entry.body;
+                contact.body[1] = other.body;
+                found.push_back(contact);
+            }
+        }
+    }
+};
+
+unsigned SpatialHash::getPotentialContacts(PotentialContact* contacts,
+                                           unsigned limit,
+                                           ParallelRunner *runner)
+{
+    if (entries.empty()) return 0;
+
+    PairSearch search;
+    search.hash = this;
+    if (runner) runner->run(&search, ranges);
+    else search.execute(0, ranges);
+
+    // Gather the pairs in the order of the ranges.
+    unsigned count = 0;
+    for (unsigned range = 0; range < ranges; range++)
+    {
+        const std::vector<PotentialContact> &pairs = found[range];
+        for (unsigned i = 0; i < pairs.size() && count < limit; i++)
+        {
+            contacts[count++] = pairs[i];
+        }
+    }
+    return count;
+}
+
+const unsigned FlatBVH::leafSize;
+const unsigned FlatBVH::maxStackSize;
+
+/*
+ * Holds the node indices still to be visited by a walk of a FlatBVH.
+ * They are kept in a fixed array, and only if that fills do they
+ * spill onto the heap, so no part of the hierarchy is ever skipped.
+ */
+template <unsigned size>
+class NodeStack
+{
+public:
+    NodeStack() : count(0) {}
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    void push(unsigned index)
+    {
+        if (count < size) fixed[count++] = index;
+        else overflow.push_back(index);
+    }
+
+    unsigned pop()
+    {
+        // Anything that spilled was pushed last, so comes back first.
+        if (!overflow.empty())
+        {
+            unsigned index = overflow.back();
+            overflow.pop_back();
+            return index;
+        }
+        return fixed[--count];
+    }
+
+private:
+    unsigned fixed[size];
+    unsigned count;
+    std::vector<unsigned> overflow;
+};
+
+/*
+ * Orders bodies by the centre of their boxes along an axis, for
+ * splitting them when building a FlatBVH.
+ */
+struct BodyCentreLess
+{
+    const Vector3 *centres;
+    unsigned axis;
+
+    bool operator()(unsigned a, unsigned b) const
+    {
+        return centres[a][axis] < centres[b][axis];
+    }
+};
+
+/*
+ * Checks if the given ray crosses the given box within the given
+ * distance, using the reciprocal of each non-zero component of the
+ * direction, and finds where it enters.
+ */
+static bool rayCrossesBox(const BoundingBox &box,
+                          const Vector3 &origin,
+                          const Vector3 &direction,
+                          const Vector3 &inverse,
+                          real maxDistance,
+                          real *entry)
+{
+    real enter = 0, leave = maxDistance;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        // A ray parallel to the slab only crosses it if it starts
+        // inside.
+        if (direction[i] == 0)
+        {
+            if (origin[i] < box.minimum[i] || origin[i] > box.maximum[i])
+            {
+                return false;
+            }
+            continue;
+        }
+
+        real t1 = (box.minimum[i] - origin[i]) * inverse[i];
+        real t2 = (box.maximum[i] - origin[i]) * inverse[i];
+        if (t1 > t2)
+        {
+            real swap = t1;
+            t1 = t2;
+            t2 = swap;
+        }
+        if (t1 > enter) enter = t1;
+        if (t2 < leave) leave = t2;
+        if (enter > leave) return false;
+    }
+    *entry = enter;
+    return true;
+}
+
+unsigned FlatBVH::insert(RigidBody *body, const BoundingBox &box)
+{
+    unsigned index = (unsigned)positions.size();
+    positions.push_back((unsigned)bodies.size());
+    indices.push_back(index);
+    bodies.push_back(body);
+    boxes.push_back(box);
+    return index;
+}
+
+void FlatBVH::clear()
+{
+    nodes.clear();
+    bounds.clear();
+    boxes.clear();
+    bodies.clear();
+    indices.clear();
+    positions.clear();
+}
+
+void FlatBVH::build()
+{
+    nodes.clear();
+    bounds.clear();
+    if (boxes.empty()) return;
+
+    unsigned count = (unsigned)boxes.size();
+    std::vector<Vector3> centres(count);
+    std::vector<unsigned> order(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        centres[i] = (boxes[i].minimum + boxes[i].maximum) * ((real)0.5);
+        order[i] = i;
+    }
+    buildNode(0, count, order, centres);
+
+    // Put the bodies in the order of the leaves.
+    std::vector<BoundingBox> sortedBoxes;
+    std::vector<RigidBody*> sortedBodies;
+    std::vector<unsigned> sortedIndices;
+    sortedBoxes.reserve(count);
+    sortedBodies.reserve(count);
+    sortedIndices.reserve(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        sortedBoxes.push_back(boxes[order[i]]);
+        sortedBodies.push_back(bodies[order[i]]);
+        sortedIndices.push_back(indices[order[i]]);
+        positions[indices[order[i]]] = i;
+    }
+    boxes.swap(sortedBoxes);
+    bodies.swap(sortedBodies);
+    indices.swap(sortedIndices);
+
+    refit();
+}
+
+void FlatBVH::buildNode(unsigned start, unsigned end,
+                        std::vector<unsigned> &order,
+                        const std::vector<Vector3> &centres)
+{
+    unsigned index = (unsigned)nodes.size();
+    nodes.push_back(Node());
+    bounds.push_back(boxes[order[start]]);
+
+    if (end - start <= leafSize)
+    {
+        nodes[index].first = start;
+        nodes[index].count = end - start;
+        return;
+    }
+
+    // Split at the median along the axis the centres spread furthest.
+    Vector3 low = centres[order[start]], high = low;
+    for (unsigned i = start + 1; i < end; i++)
+    {
+        const Vector3 &centre = centres[order[i]];
+        for (unsigned j = 0; j < 3; j++)
+        {
+            if (centre[j] < low[j]) low[j] = centre[j];
+            if (centre[j] > high[j]) high[j] = centre[j];
+        }
+    }
+    BodyCentreLess less;
+    less.centres = &centres[0];
+    less.axis = 0;
+    for (unsigned j = 1; j < 3; j++)
+    {
+        if (high[j] - low[j] > high[less.axis] - low[less.axis]) less.axis = j;
+    }
+    unsigned middle = start + (end - start) / 2;
+    std::nth_element(order.begin() + start, order.begin() + middle,
+        order.begin() + end, less);
+
+    // The first child follows this node, so we only need to record
+    // where the second starts.
+    buildNode(start, middle, order, centres);
+    nodes[index].first = (unsigned)nodes.size();
+    nodes[index].count = 0;
+    buildNode(middle, end, order, centres);
+}
+
+void FlatBVH::update(unsigned index, const BoundingBox &box)
+{
+    boxes[positions[index]] = box;
+}
+
+void FlatBVH::refit()
+{
+    // Children come after their parents, so working backwards fits
+    // each node after its children.
+    for (unsigned index = (unsigned)nodes.size(); index > 0; index--)
+    {
+        const Node &node = nodes[index-1];
+        if (node.count > 0)
+        {
+            fitLeaf(index-1);
+        }
+        else
+        {
+            bounds[index-1] = BoundingBox(bounds[index], bounds[node.first]);
+        }
+    }
+}
+
+void FlatBVH::fitLeaf(unsigned index)
+{
+    const Node &node = nodes[index];
+    BoundingBox box = boxes[node.first];
+    for (unsigned i = node.first + 1; i < node.first + node.count; i++)
+    {
+        box = BoundingBox(box, boxes[i]);
+    }
+    bounds[index] = box;
+}
+
+unsigned FlatBVH::query(const BoundingBox &box,
+                        unsigned *found, unsigned limit) const
+{
+    if (nodes.empty() || limit == 0) return 0;
+
+    unsigned count = 0;
+    NodeStack<maxStackSize> stack;
+    unsigned index = 0;
+    for (;;)
+    {
+        const Node &node = nodes[index];
+        bool overlap = bounds[index].overlaps(&box);
+
+        if (overlap && node.count == 0)
+        {
+            // Go down to the first child, coming back for the second.
+            stack.push(node.first);
+            index++;
+            continue;
+        }
+
+        if (overlap)
+        {
+            for (unsigned i = node.first; i < node.first + node.count; i++)
+            {
+                if (!boxes[i].overlaps(&box)) continue;
+
+                found[count++] = indices[i];
+                if (count == limit) return count;
+            }
+        }
+
+        if (stack.empty()) return count;
+        index = stack.pop();
+    }
+}
+
+unsigned FlatBVH::raycast(const Vector3 &origin, const Vector3 &direction,
+                          real maxDistance,
+                          unsigned *found, unsigned limit) const
+{
+    if (nodes.empty() || limit == 0) return 0;
+
+    Vector3 inverse;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (direction[i] != 0) inverse[i] = ((real)1.0) / direction[i];
+    }
+
+    real entry;
+    if (!rayCrossesBox(bounds[0], origin, direction, inverse,
+                       maxDistance, &entry)) return 0;
+
+    // Only nodes the ray crosses go on the stack.
+    unsigned count = 0;
+    NodeStack<maxStackSize> stack;
+    stack.push(0);
+    while (!stack.empty())
+    {
+        unsigned index = stack.pop();
+        const Node &node = nodes[index];
+
+        if (node.count > 0)
+        {
+            for (unsigned i = node.first; i < node.first + node.count; i++)
+            {
+                if (!rayCrossesBox(boxes[i], origin, direction, inverse,
+                                   maxDistance, &entry)) continue;
+
+                found[count++] = indices[i];
+                if (count == limit) return count;
+            }
+            continue;
+        }
+
+        // Push the further child first, so the nearer is visited
+        // first.
+        unsigned closer = index + 1, further = node.first;
+        real closerEntry, furtherEntry;
+        bool crossesCloser = rayCrossesBox(bounds[closer], origin,
+            direction, inverse, maxDistance, &closerEntry);
+        bool crossesFurther = rayCrossesBox(bounds[further], origin,
+            direction, inverse, maxDistance, &furtherEntry);
+        if (crossesCloser && crossesFurther && furtherEntry < closerEntry)
+        {
+            closer = node.first;
+            further = index + 1;
+        }
+
+        if (crossesFurther) stack.push(further);
+        if (crossesCloser) stack.push(closer);
+    }
+    return count;
+}
+
+unsigned FlatBVH::getPotentialContacts(PotentialContact* contacts,
+                                       unsigned limit) const
+{
+    if (nodes.empty() || limit == 0) return 0;
+
+    // Walk pairs of nodes, starting with the root against itself. A
+    // node against itself is split into its children against
+    // themselves and each other.
+    unsigned count = 0;
+    NodeStack<maxStackSize*8> stack;
+    stack.push(0);
+    stack.push(0);
+    while (!stack.empty())
+    {
+        unsigned two = stack.pop();
+        unsigned one = stack.pop();
+        const Node &nodeOne = nodes[one];
+        const Node &nodeTwo = nodes[two];
+
+        if (one == two)
+        {
+            if (nodeOne.count > 0)
+            {
+                for (unsigned i = nodeOne.first;
+                     i < nodeOne.first + nodeOne.count; i++)
+                {
+                    for (unsigned j = i + 1;
+                         j < nodeOne.first + nodeOne.count; j++)
+                    {
+                        if (!boxes[i].overlaps(&boxes[j])) continue;
+
+                        contacts[count].body[0] = bodies[i];
+                        contacts[count].body[1] = bodies[j];
+                        if (++count == limit) return count;
+                    }
+                }
+            }
+            else
+            {
+                stack.push(one + 1);
+                stack.push(nodeOne.first);
+                stack.push(nodeOne.first);
+                stack.push(nodeOne.first);
+                stack.push(one + 1);
+                stack.push(one + 1);
+            }
+            continue;
+        }
+
+        if (!bounds[one].overlaps(&bounds[two])) continue;
+
+        if (nodeOne.count > 0 && nodeTwo.count > 0)
+        {
+            for (unsigned i = nodeOne.first;
+                 i < nodeOne.first + nodeOne.count; i++)
+            {
+                for (unsigned j = nodeTwo.first;
+                     j < nodeTwo.first + nodeTwo.count; j++)
+                {
+                    if (!boxes[i].overlaps(&boxes[j])) continue;
+
+                    contacts[count].body[0] = bodies[i];
+                    contacts[count].body[1] = bodies[j];
+                    if (++count == limit) return count;
+                }
+            }
+            continue;
+        }
+
+        // Split the larger node, unless it is a leaf.
+        if (nodeTwo.count > 0 || (nodeOne.count == 0 &&
+            bounds[one].getSize() >= bounds[two].getSize()))
+        {
+            stack.push(one + 1);
+            stack.push(two);
+            stack.push(nodeOne.first);
+            stack.push(two);
+        }
+        else
+        {
+            stack.push(one);
+            stack.push(two + 1);
+            stack.push(one);
+            stack.push(nodeTwo.first);
+        }
+    }
+    return count;
+}
@@ -0,0 +1,348 @@
+/*
+ * Implementation file for the swept (continuous) collision tests.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/collide_fine.h>
+#include <cyclone/body.h>
+
+using namespace cyclone;
+
+/*
+ * Finds when a point moving from the given offset from the centre
+ * of a sphere first reaches its surface, as a fraction of the
+ * movement. Returns false if it doesn't during the movement, or is
+ * inside already.
+ */
+static bool sweptPointAndSphere(const Vector3 &offset,
+                                const Vector3 &motion,
+                                real radius,
+                                real *time)
+{
+    real c = offset * offset - radius*radius;
+    if (c <= 0) return false;
+
+    // The point has to be heading towards the centre.
+    real b = offset * motion;
+    if (b >= 0) return false;
+
+    real a = motion * motion;
+    real discriminant = b*b - a*c;
+    if (discriminant < 0) return false;
+
+    real t = (-b - real_sqrt(discriminant)) / a;
+    if (t > 1) return false;
+    *time = t;
+    return true;
+}
+
+/*
+ * Finds when a sphere moving from the given start first touches a
+ * half-space.
+ */
+static bool sweptSphereAndPlane(const Vector3 &start,
+                                real radius,
+                                const Vector3 &motion,
+                                const CollisionPlane &plane,
+                                real *time)
+{
+    real distance = plane.direction * start - radius - plane.offset;
+    if (distance <= 0) return false;
+
+    real approach = plane.direction * motion;
+    if (approach > -distance) return false;
+
+    *time = -distance / approach;
+    return true;
+}
+
+/*
+ * Finds when a sphere moving from the given start first touches a
+ * box, with everything given in the box's coordinates. The sphere's
+ * centre touches the box when it reaches the surface of the box
+ * grown by the radius, which is made of the faces of the box pushed
+ * out, a cylinder round each edge and a sphere round each corner.
+ * Each part is tested, only counting hits in its own region, and
+ * the first is kept. The point on the box that is touched is also
+ * returned.
+ */
+static bool sweptSphereAndBoxLocal(const Vector3 &start,
+                                   real radius,
+                                   const Vector3 &motion,
+                                   const Vector3 &halfSize,
+                                   real *time,
+                                   Vector3 *normal,
+                                   Vector3 *touch)
+{
+    // Check the sphere isn't touching the box already, and that its
+    // path comes near the box at all.
+    real squareDistance = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real outside = real_abs(start[i]) - halfSize[i];
+        if (outside > 0) squareDistance += outside*outside;
+
+        real end = start[i] + motion[i];
+        real low = start[i] < end ? start[i] : end;
+        real high = start[i] < end ? end : start[i];
+        if (low > halfSize[i] + radius || high < -halfSize[i] - radius)
+        {
+            return false;
+        }
+    }
+    if (squareDistance <= radius*radius) return false;
+
+    real best = REAL_MAX;
+
+    // The faces. Only the face on each axis the sphere is moving
+    // towards can be hit.
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (motion[i] == 0) continue;
+        real side = motion[i] < 0 ? 1 : -1;
+        real t = (side * (halfSize[i] + radius) - start[i]) / motion[i];
+        if (t < 0 || t > 1 || t >= best) continue;
+
+        Vector3 point = start + motion * t;
+        unsigned j = (i + 1) % 3, k = (i + 2) % 3;
+        if (real_abs(point[j]) > halfSize[j] ||
+            real_abs(point[k]) > halfSize[k]) continue;
+
+        best = t;
+        normal->clear();
+        (*normal)[i] = side;
+        *touch = point;
+        (*touch)[i] = side * halfSize[i];
+    }
+
+    // The edges. We drop the coordinate along each edge, to test
+    // against a circle, then check the hit is along the edge.
+    for (unsigned axis = 0; axis < 3; axis++)
+    {
+        unsigned j = (axis + 1) % 3, k = (axis + 2) % 3;
+        Vector3 flatMotion = motion;
+        flatMotion[axis] = 0;
+        for (unsigned corner = 0; corner < 4; corner++)
+        {
+            Vector3 edge;
+            edge[j] = (corner & 1) ? halfSize[j] : -halfSize[j];
+            edge[k] = (corner & 2) ? halfSize[k] : -halfSize[k];
+            Vector3 offset = start - edge;
+            offset[axis] = 0;
+
+            real t;
+            if (!sweptPointAndSphere(offset, flatMotion, radius, &t) ||
+                t >= best) continue;
+            real along = start[axis] + motion[axis] * t;
+            if (real_abs(along) > halfSize[axis]) continue;
+
+            best = t;
+            *normal = offset + flatMotion * t;
+            normal->normalise();
+            *touch = edge;
+            (*touch)[axis] = along;
+        }
+    }
+
+    // The corners.
+    for (unsigned corner = 0; corner < 8; corner++)
+    {
+        Vector3 vertex(
+            (corner & 1) ? halfSize.x : -halfSize.x,
+            (corner & 2) ? halfSize.y : -halfSize.y,
+            (corner & 4) ? halfSize.z : -halfSize.z);
+        Vector3 offset = start - vertex;
+
+        real t;
+        if (!sweptPointAndSphere(offset, motion, radius, &t) ||
+            t >= best) continue;
+
+        best = t;
+        *normal = offset + motion * t;
+        normal->normalise();
+        *touch = vertex;
+    }
+
+    if (best == REAL_MAX) return false;
+    *time = best;
+    return true;
+}
+
+/*
+ * Returns how far the given body moved during its last integration
+ * step, if it has continuous collision detection enabled.
+ */
+static Vector3 getSweep(const RigidBody *body)
+{
+    if (!body || !body->getCcdEnabled()) return Vector3();
+    return body->getPosition() - body->getLastPosition();
+}
+
+bool IntersectionTests::sweptSphereAndHalfSpace(
+    const CollisionSphere &sphere,
+    const Vector3 &motion,
+    const CollisionPlane &plane,
+    real *time,
+    Vector3 *normal)
+{
+    if (!sweptSphereAndPlane(sphere.getAxis(3), sphere.radius,
+                             motion, plane, time)) return false;
+    *normal = plane.direction;
+    return true;
+}
+
+bool IntersectionTests::sweptSphereAndSphere(
+    const CollisionSphere &one,
+    const Vector3 &motionOne,
+    const CollisionSphere &two,
+    const Vector3 &motionTwo,
+    real *time,
+    Vector3 *normal)
+{
+    // Work relative to the second sphere.
+    Vector3 offset = one.getAxis(3) - two.getAxis(3);
+    Vector3 motion = motionOne - motionTwo;
+    if (!sweptPointAndSphere(offset, motion,
+                             one.radius + two.radius, time)) return false;
+
+    *normal = offset + motion * *time;
+    normal->normalise();
+    return true;
+}
+
+bool IntersectionTests::sweptSphereAndBox(
+    const CollisionSphere &sphere,
+    const Vector3 &motion,
+    const CollisionBox &box,
+    real *time,
+    Vector3 *normal)
+{
+    const Matrix4 &transform = box.getTransform();
+    Vector3 localNormal, touch;
+    if (!sweptSphereAndBoxLocal(
+            transform.transformInverse(sphere.getAxis(3)), sphere.radius,
+            transform.transformInverseDirection(motion), box.halfSize,
+            time, &localNormal, &touch)) return false;
+
+    *normal = transform.transformDirection(localNormal);
+    return true;
+}
+
+unsigned CollisionDetector::sweptSphereAndHalfSpace(
+    const CollisionSphere &sphere,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Sweep the sphere from where it was at the start of the step.
+    Vector3 motion = getSweep(sphere.body);
+    Vector3 position = sphere.getAxis(3);
+    real time;
+    if (motion.squareMagnitude() == 0 ||
+        !sweptSphereAndPlane(position - motion, sphere.radius,
+                             motion, plane, &time))
+    {
+        return sphereAndHalfSpace(sphere, plane, data);
+    }
+
+    // The contact is where the sphere first touched, and is as deep
+    // as the sphere has gone past it since.
+    Contact* contact = data->contacts;
+    contact->contactNormal = plane.direction;
+    contact->penetration =
+        sphere.radius + plane.offset - plane.direction * position;
+    contact->contactPoint = position - motion * (1 - time) -
+        plane.direction * sphere.radius;
+    contact->setBodyData(sphere.body, NULL,
+        data->friction, data->restitution);
+
+    data->addContacts(1);
+    return 1;
+}
+
+unsigned CollisionDetector::sweptSphereAndSphere(
+    const CollisionSphere &one,
+    const CollisionSphere &two,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Sweep the first sphere relative to the second.
+    Vector3 motion = getSweep(one.body) - getSweep(two.body);
+    Vector3 endOffset = one.getAxis(3) - two.getAxis(3);
+    real time;
+    if (motion.squareMagnitude() == 0 ||
+        !sweptPointAndSphere(endOffset - motion, motion,
+                             one.radius + two.radius, &time))
+    {
+        return sphereAndSphere(one, two, data);
+    }
+
+    Vector3 offset = endOffset - motion * (1 - time);
+    Vector3 normal = offset;
+    normal.normalise();
+
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->penetration = one.radius + two.radius - normal * endOffset;
+    contact->contactPoint = two.getAxis(3) - getSweep(two.body) * (1 - time) +
+        normal * two.radius;
+    contact->setBodyData(one.body, two.body,
+        data->friction, data->restitution);
+
+    data->addContacts(1);
+    return 1;
+}
+
+unsigned CollisionDetector::boxAndSweptSphere(
+    const CollisionBox &box,
+    const CollisionSphere &sphere,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Sweep the sphere relative to the box, in the box's coordinates.
+    Vector3 motion = getSweep(sphere.body) - getSweep(box.body);
+    if (motion.squareMagnitude() == 0)
+    {
+        return boxAndSphere(box, sphere, data);
+    }
+
+    const Matrix4 &transform = box.getTransform();
+    Vector3 end = transform.transformInverse(sphere.getAxis(3));
+    Vector3 localMotion = transform.transformInverseDirection(motion);
+    Vector3 localNormal, touch;
+    real time;
+    if (!sweptSphereAndBoxLocal(end - localMotion, sphere.radius,
+                                localMotion, box.halfSize,
+                                &time, &localNormal, &touch))
+    {
+        return boxAndSphere(box, sphere, data);
+    }
+
+    // The box is the first body, so the normal points into it.
+    Contact* contact = data->contacts;
+    contact->contactNormal = transform.transformDirection(localNormal);
+    contact->contactNormal.invert();
+    contact->penetration = sphere.radius - localNormal * (end - touch);
+    contact->contactPoint = transform.transform(touch);
+    contact->setBodyData(box.body, sphere.body,
+        data->friction, data->restitution);
+
+    data->addContacts(1);
+    return 1;
+}
@@ -0,0 +1,976 @@
+/*
+ * Implementation file for the convex collision primitives.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/collide_fine.h>
+#include <vector>
+
+using namespace cyclone;
+
+// The number of points CollisionConvex works on at once.
+static const unsigned convexBlock = 64;
+
+void CollisionConvex::setVertices(const Vector3 *vertices,
+                                  unsigned numVertices)
+{
+    x.resize(numVertices);
+    y.resize(numVertices);
+    z.resize(numVertices);
+    for (unsigned i = 0; i < numVertices; i++)
+    {
+        x[i] = vertices[i].x;
+        y[i] = vertices[i].y;
+        z[i] = vertices[i].z;
+    }
+}
+
+unsigned CollisionConvex::getSupportIndex(const Vector3 &direction) const
+{
+    real distance[convexBlock];
+    unsigned numVertices = getVertexCount();
+    unsigned best = 0;
+    real bestDistance = -REAL_MAX;
+
+    for (unsigned start = 0; start < numVertices; start += convexBlock)
+    {
+        unsigned count = numVertices - start;
+        if (count > convexBlock) count = convexBlock;
+
+        // Find how far along the direction each point is.
+        const real *px = &x[start];
+        const real *py = &y[start];
+        const real *pz = &z[start];
+        for (unsigned k = 0; k < count; k++)
+        {
+            distance[k] =
+                direction.x * px[k] +
+                direction.y * py[k] +
+                direction.z * pz[k];
+        }
+
+        // And keep the furthest.
+        for (unsigned k = 0; k < count; k++)
+        {
+            if (distance[k] > bestDistance)
+            {
+                bestDistance = distance[k];
+                best = start + k;
+            }
+        }
+    }
+    return best;
+}
+
+Vector3 CollisionConvex::getSupport(const Vector3 &direction) const
+{
+    Vector3 local = transform.transformInverseDirection(direction);
+    return transform.transform(getVertex(getSupportIndex(local)));
+}
+
+/*
+ * Finds the closest points between two line segments, returning
+ * the square of the distance between them.
+ */
+static real closestOnSegments(
+    const Vector3 &startOne, const Vector3 &endOne,
+    const Vector3 &startTwo, const Vector3 &endTwo,
+    Vector3 *pointOne, Vector3 *pointTwo
+    )
+{
+    Vector3 dOne = endOne - startOne;
+    Vector3 dTwo = endTwo - startTwo;
+    Vector3 offset = startOne - startTwo;
+    real smOne = dOne.squareMagnitude();
+    real smTwo = dTwo.squareMagnitude();
+    real dpTwo = dTwo * offset;
+    real s, t;
+
+    if (smOne <= real_epsilon && smTwo <= real_epsilon)
+    {
+        // Both segments are points.
+        s = t = 0;
+    }
+    else if (smOne <= real_epsilon)
+    {
+        // The first segment is a point.
+        s = 0;
+        t = dpTwo / smTwo;
+        if (t < 0) t = 0; else if (t > 1) t = 1;
+    }
+    else
+    {
+        real dpOne = dOne * offset;
+        if (smTwo <= real_epsilon)
+        {
+            // The second segment is a point.
+            t = 0;
+            s = -dpOne / smOne;
+            if (s < 0) s = 0; else if (s > 1) s = 1;
+        }
+        else
+        {
+            // Find the closest point on the first line to the
+            // second, clamped to the segment (any point will do if
+            // they are parallel), then the closest point on the
+            // second segment to that, and clamp the first again.
+            real dpOneTwo = dOne * dTwo;
+            real denom = smOne * smTwo - dpOneTwo * dpOneTwo;
+            s = 0;
+            if (denom > real_epsilon)
+            {
+                s = (dpOneTwo * dpTwo - dpOne * smTwo) / denom;
+                if (s < 0) s = 0; else if (s > 1) s = 1;
+            }
+
+            t = (dpOneTwo * s + dpTwo) / smTwo;
+            if (t < 0)
+            {
+                t = 0;
+                s = -dpOne / smOne;
+                if (s < 0) s = 0; else if (s > 1) s = 1;
+            }
+            else if (t > 1)
+            {
+                t = 1;
+                s = (dpOneTwo - dpOne) / smOne;
+                if (s < 0) s = 0; else if (s > 1) s = 1;
+            }
+        }
+    }
+
+    *pointOne = startOne + dOne * s;
+    *pointTwo = startTwo + dTwo * t;
+    return (*pointOne - *pointTwo).squareMagnitude();
+}
+
+/*
+ * Fills a contact between two rounded primitives, given the closest
+ * points of their cores and their radii, returning the number of
+ * contacts written (zero if they are too far apart). The normal
+ * points from two towards one.
+ */
+static unsigned fillRoundedContact(
+    const Vector3 &pointOne, real radiusOne, RigidBody *bodyOne,
+    const Vector3 &pointTwo, real radiusTwo, RigidBody *bodyTwo,
+    const Vector3 &fallbackNormal,
+    CollisionData *data
+    )
+{
+    Vector3 midline = pointOne - pointTwo;
+    real size = midline.magnitude();
+    if (size >= radiusOne + radiusTwo) return 0;
+
+    // If the cores touch, there is no direction between them, so
+    // use the one we're given.
+    Vector3 normal = fallbackNormal;
+    if (size > real_epsilon) normal = midline * (((real)1.0)/size);
+
+    // The contact point is midway between the two surfaces.
+    Vector3 surfaceOne = pointOne - normal * radiusOne;
+    Vector3 surfaceTwo = pointTwo + normal * radiusTwo;
+
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->contactPoint = (surfaceOne + surfaceTwo) * (real)0.5;
+    contact->penetration = radiusOne + radiusTwo - size;
+    contact->setBodyData(bodyOne, bodyTwo,
+        data->friction, data->restitution);
+
+    data->addContacts(1);
+    return 1;
+}
+
+/*
+ * Returns any unit vector at right angles to the given one.
+ */
+static Vector3 anyPerpendicular(const Vector3 &vector)
+{
+    Vector3 result = vector % Vector3(1, 0, 0);
+    if (result.squareMagnitude() < 0.01) result = vector % Vector3(0, 1, 0);
+    result.normalise();
+    return result;
+}
+
+unsigned CollisionDetector::capsuleAndHalfSpace(
+    const CollisionCapsule &capsule,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    // Treat each end of the capsule as a sphere.
+    unsigned contactsUsed = 0;
+    for (unsigned end = 0; end < 2; end++)
+    {
+        // Make sure we have contacts
+        if (data->contactsLeft <= 0) break;
+
+        Vector3 position = capsule.getEnd(end);
+        real distance =
+            plane.direction * position -
+            capsule.radius - plane.offset;
+        if (distance >= 0) continue;
+
+        Contact* contact = data->contacts;
+        contact->contactNormal = plane.direction;
+        contact->penetration = -distance;
+        contact->contactPoint =
+            position - plane.direction * (distance + capsule.radius);
+        contact->setBodyData(capsule.body, NULL,
+            data->friction, data->restitution);
+        contact->feature = end;
+
+        data->addContacts(1);
+        contactsUsed++;
+    }
+    return contactsUsed;
+}
+
+unsigned CollisionDetector::capsuleAndSphere(
+    const CollisionCapsule &capsule,
+    const CollisionSphere &sphere,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 centre = sphere.getAxis(3);
+    Vector3 pointOne, pointTwo;
+    closestOnSegments(capsule.getEnd(0), capsule.getEnd(1),
+        centre, centre, &pointOne, &pointTwo);
+
+    return fillRoundedContact(
+        pointOne, capsule.radius, capsule.body,
+        pointTwo, sphere.radius, sphere.body,
+        anyPerpendicular(capsule.getAxis(1)), data);
+}
+
+unsigned CollisionDetector::capsuleAndCapsule(
+    const CollisionCapsule &one,
+    const CollisionCapsule &two,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 pointOne, pointTwo;
+    closestOnSegments(one.getEnd(0), one.getEnd(1),
+        two.getEnd(0), two.getEnd(1), &pointOne, &pointTwo);
+
+    // If the segments cross, push them apart at right angles to both.
+    Vector3 fallback = one.getAxis(1) % two.getAxis(1);
+    if (fallback.squareMagnitude() < 0.0001)
+    {
+        fallback = anyPerpendicular(one.getAxis(1));
+    }
+    fallback.normalise();
+
+    return fillRoundedContact(
+        pointOne, one.radius, one.body,
+        pointTwo, two.radius, two.body,
+        fallback, data);
+}
+
+unsigned CollisionDetector::capsuleAndBox(
+    const CollisionCapsule &capsule,
+    const CollisionBox &box,
+    CollisionData *data
+    )
+{
+    return convexAndConvex(capsule, box, data);
+}
+
+unsigned CollisionDetector::convexAndHalfSpace(
+    const CollisionConvex &convex,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    // Work in the hull's coordinates, so the points don't need to
+    // be transformed to find their distance from the plane.
+    const Matrix4 &transform = convex.getTransform();
+    Vector3 direction = transform.transformInverseDirection(plane.direction);
+    real offset = plane.offset - plane.direction * convex.getAxis(3);
+
+    real distance[convexBlock];
+    unsigned numVertices = convex.getVertexCount();
+    unsigned contactsUsed = 0;
+
+    for (unsigned start = 0; start < numVertices; start += convexBlock)
+    {
+        // Make sure we have contacts
+        if (data->contactsLeft <= 0) break;
+
+        unsigned count = numVertices - start;
+        if (count > convexBlock) count = convexBlock;
+
+        // Find the distance of each point from the plane.
+        const real *px = &convex.x[start];
+        const real *py = &convex.y[start];
+        const real *pz = &convex.z[start];
+        for (unsigned k = 0; k < count; k++)
+        {
+            distance[k] =
+                direction.x * px[k] +
+                direction.y * py[k] +
+                direction.z * pz[k] - offset;
+        }
+
+        // Write a contact for each point in the half-space. As for
+        // boxes, the contact point is halfway between the point and
+        // the plane.
+        for (unsigned k = 0; k < count; k++)
+        {
+            if (distance[k] > 0) continue;
+            if (data->contactsLeft <= 0) break;
+
+            Vector3 vertexPos =
+                transform.transform(convex.getVertex(start + k));
+
+            Contact* contact = data->contacts;
+            contact->contactPoint =
+                vertexPos + plane.direction * (distance[k] * (real)-0.5);
+            contact->contactNormal = plane.direction;
+            contact->penetration = -distance[k];
+            contact->setBodyData(convex.body, NULL,
+                data->friction, data->restitution);
+            contact->feature = start + k;
+
+            data->addContacts(1);
+            contactsUsed++;
+        }
+    }
+    return contactsUsed;
+}
+
+/*
+ * Wraps a primitive for GJK and EPA. Spheres and capsules are
+ * reduced to their core (a point or a segment) and a radius; boxes
+ * and hulls have no radius.
+ */
+struct ConvexCore
+{
+    const CollisionPrimitive *primitive;
+    real radius;
+
+    ConvexCore(const CollisionPrimitive &primitive)
+        : primitive(&primitive), radius(0)
+    {
+        if (primitive.getType() == CollisionPrimitive::SPHERE)
+        {
+            radius = static_cast<const CollisionSphere&>(primitive).radius;
+        }
+        else if (primitive.getType() == CollisionPrimitive::CAPSULE)
+        {
+            radius = static_cast<const CollisionCapsule&>(primitive).radius;
+        }
+    }
+
+    /**
+     * Returns the point of the core furthest along the given
+     * direction, in world coordinates.
+     */
+    Vector3 support(const Vector3 &direction) const
+    {
+        Vector3 centre = primitive->getAxis(3);
+        switch (primitive->getType())
+        {
+        case CollisionPrimitive::BOX:
+            {
+                const CollisionBox &box =
+                    static_cast<const CollisionBox&>(*primitive);
+                for (unsigned i = 0; i < 3; i++)
+                {
+                    Vector3 axis = box.getAxis(i);
+                    if (axis * direction < 0) axis.invert();
+                    centre += axis * box.halfSize[i];
+                }
+                return centre;
+            }
+        case CollisionPrimitive::CAPSULE:
+            {
+                const CollisionCapsule &capsule =
+                    static_cast<const CollisionCapsule&>(*primitive);
+                return capsule.getEnd(capsule.getAxis(1) * direction < 0);
+            }
+        case CollisionPrimitive::CONVEX:
+            return static_cast<const CollisionConvex&>(*primitive)
+                .getSupport(direction);
+        default:
+            return centre;
+        }
+    }
+};
+
+/*
+ * A point on the Minkowski difference of two cores (w = a - b),
+ * along with the points of each core that made it.
+ */
+struct MinkowskiPoint
+{
+    Vector3 a, b, w;
+};
+
+/*
+ * Finds the support point of the Minkowski difference of two cores
+ * in the given direction.
+ */
+static inline MinkowskiPoint minkowskiSupport(const ConvexCore &one,
+                                              const ConvexCore &two,
+                                              const Vector3 &direction)
+{
+    MinkowskiPoint point;
+    point.a = one.support(direction);
+    point.b = two.support(direction * -1.0f);
+    point.w = point.a - point.b;
+    return point;
+}
+
+/*
+ * The simplex that GJK builds: up to four points on the Minkowski
+ * difference, with the barycentric weights of the point closest to
+ * the origin.
+ */
+struct GjkSimplex
+{
+    MinkowskiPoint point[4];
+    real weight[4];
+    unsigned count;
+
+    /**
+     * Keeps only the given points (in order), with the given weights.
+     */
+    void keep(unsigned numPoints, const unsigned *index, const real *weights)
+    {
+        MinkowskiPoint kept[4];
+        for (unsigned i = 0; i < numPoints; i++) kept[i] = point[index[i]];
+        for (unsigned i = 0; i < numPoints; i++)
+        {
+            point[i] = kept[i];
+            weight[i] = weights[i];
+        }
+        count = numPoints;
+    }
+
+    /**
+     * Returns the point described by the weights.
+     */
+    Vector3 closest() const
+    {
+        Vector3 result;
+        for (unsigned i = 0; i < count; i++)
+        {
+            result += point[i].w * weight[i];
+        }
+        return result;
+    }
+
+    /**
+     * Finds the point of the segment between the given two points
+     * that is closest to the origin, and reduces the simplex to the
+     * points needed to describe it.
+     */
+    void solveSegment(unsigned one, unsigned two)
+    {
+        Vector3 start = point[one].w;
+        Vector3 edge = point[two].w - start;
+        real t = -(start * edge);
+        real length = edge.squareMagnitude();
+        unsigned index[2] = {one, two};
+        if (t <= 0 || length <= real_epsilon)
+        {
+            real w[1] = {1};
+            keep(1, index, w);
+        }
+        else if (t >= length)
+        {
+            real w[1] = {1};
+            keep(1, index + 1, w);
+        }
+        else
+        {
+            t /= length;
+            real w[2] = {1 - t, t};
+            keep(2, index, w);
+        }
+    }
+
+    /**
+     * Does the same for the triangle of the given three points,
+     * returning the square distance of the closest point.
+     */
+    real solveTriangle(unsigned one, unsigned two, unsigned three)
+    {
+        // This finds which region of the triangle (vertex, edge or
+        // face) the origin projects into, as in Ericson's closest
+        // point on a triangle.
+        const Vector3 &a = point[one].w;
+        const Vector3 &b = point[two].w;
+        const Vector3 &c = point[three].w;
+        Vector3 ab = b - a, ac = c - a;
+        unsigned index[3] = {one, two, three};
+
+        real d1 = -(ab * a), d2 = -(ac * a);
+        if (d1 <= 0 && d2 <= 0)
+        {
+            real w[1] = {1};
+            keep(1, index, w);
+            return a.squareMagnitude();
+        }
+
+        real d3 = -(ab * b), d4 = -(ac * b);
+        if (d3 >= 0 && d4 <= d3)
+        {
+            real w[1] = {1};
+            keep(1, index + 1, w);
+            return b.squareMagnitude();
+        }
+
+        real vc = d1*d4 - d3*d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0)
+        {
+            real t = d1 / (d1 - d3);
+            real w[2] = {1 - t, t};
+            keep(2, index, w);
+            return closest().squareMagnitude();
+        }
+
+        real d5 = -(ab * c), d6 = -(ac * c);
+        if (d6 >= 0 && d5 <= d6)
+        {
+            real w[1] = {1};
+            keep(1, index + 2, w);
+            return c.squareMagnitude();
+        }
+
+        real vb = d5*d2 - d1*d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0)
+        {
+            real t = d2 / (d2 - d6);
+            unsigned edge[2] = {one, three};
+            real w[2] = {1 - t, t};
+            keep(2, edge, w);
+            return closest().squareMagnitude();
+        }
+
+        real va = d3*d6 - d5*d4;
+        if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+        {
+            real t = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+            unsigned edge[2] = {two, three};
+            real w[2] = {1 - t, t};
+            keep(2, edge, w);
+            return closest().squareMagnitude();
+        }
+
+        real denom = 1 / (va + vb + vc);
+        real v = vb * denom, u = vc * denom;
+        real w[3] = {1 - v - u, v, u};
+        keep(3, index, w);
+        return closest().squareMagnitude();
+    }
+
+    /**
+     * Finds the point of the simplex closest to the origin, and
+     * reduces the simplex to the points needed to describe it.
+     * Returns false if the origin is inside the simplex.
+     */
+    bool solve()
+    {
+        switch (count)
+        {
+        case 1:
+            weight[0] = 1;
+            return true;
+        case 2:
+            solveSegment(0, 1);
+            return true;
+        case 3:
+            solveTriangle(0, 1, 2);
+            return true;
+        }
+
+        // Check each face of the tetrahedron that has the origin
+        // on the far side from the fourth point, keeping the face
+        // with the closest point.
+        static const unsigned faces[4][4] = {
+            {0, 1, 2, 3}, {0, 2, 3, 1}, {0, 3, 1, 2}, {1, 3, 2, 0}
+        };
+        GjkSimplex best;
+        real bestDistance = REAL_MAX;
+        for (unsigned f = 0; f < 4; f++)
+        {
+            const Vector3 &a = point[faces[f][0]].w;
+            Vector3 normal =
+                (point[faces[f][1]].w - a) % (point[faces[f][2]].w - a);
+            real originSide = -(a * normal);
+            real pointSide = (point[faces[f][3]].w - a) * normal;
+            if (originSide * pointSide >= 0) continue;
+
+            GjkSimplex face = *this;
+            real distance = face.solveTriangle(
+                faces[f][0], faces[f][1], faces[f][2]);
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                best = face;
+            }
+        }
+
+        if (bestDistance == REAL_MAX) return false;
+        *this = best;
+        return true;
+    }
+};
+
+/*
+ * The result of running GJK on two cores.
+ */
+struct GjkResult
+{
+    /** True if the cores overlap (or touch). */
+    bool overlap;
+
+    /** The closest points of each core, if they don't overlap. */
+    Vector3 pointOne, pointTwo;
+
+    /** The final simplex, used to start EPA if they overlap. */
+    GjkSimplex simplex;
+};
+
+/*
+ * Runs GJK to find the closest points between two cores.
+ */
+static void gjk(const ConvexCore &one, const ConvexCore &two,
+                GjkResult *result)
+{
+    GjkSimplex &simplex = result->simplex;
+    simplex.point[0] = minkowskiSupport(one, two, Vector3(1, 0, 0));
+    simplex.weight[0] = 1;
+    simplex.count = 1;
+    Vector3 closest = simplex.point[0].w;
+    result->overlap = false;
+
+    for (unsigned iteration = 0; iteration < 64; iteration++)
+    {
+        // If the closest point is the origin, the cores touch.
+        real distance = closest.squareMagnitude();
+        if (distance <= (real)1e-12)
+        {
+            result->overlap = true;
+            break;
+        }
+
+        // Look for a point further towards the origin, stopping if
+        // there is none (or it is one we already have).
+        MinkowskiPoint next = minkowskiSupport(one, two, closest * -1.0f);
+        if (distance - closest * next.w <= distance * (real)1e-8) break;
+        bool repeated = false;
+        for (unsigned i = 0; i < simplex.count; i++)
+        {
+            if ((simplex.point[i].w - next.w).squareMagnitude() <
+                (real)1e-12) repeated = true;
+        }
+        if (repeated) break;
+
+        simplex.point[simplex.count++] = next;
+        if (!simplex.solve())
+        {
+            result->overlap = true;
+            break;
+        }
+        closest = simplex.closest();
+    }
+
+    // Find the closest points on each core from the weights.
+    result->pointOne.clear();
+    result->pointTwo.clear();
+    for (unsigned i = 0; i < simplex.count; i++)
+    {
+        result->pointOne += simplex.point[i].a * simplex.weight[i];
+        result->pointTwo += simplex.point[i].b * simplex.weight[i];
+    }
+}
+
+/*
+ * A face of the polytope built by EPA, with its outward normal and
+ * its distance from the origin.
+ */
+struct EpaFace
+{
+    unsigned index[3];
+    Vector3 normal;
+    real distance;
+};
+
+/*
+ * Makes a face of the polytope, facing away from the given point
+ * inside it. Returns false if the face has no area.
+ */
+static bool makeFace(const std::vector<MinkowskiPoint> &points,
+                     unsigned a, unsigned b, unsigned c,
+                     const Vector3 &inside, EpaFace *face)
+{
+    Vector3 normal = (points[b].w - points[a].w) % (points[c].w - points[a].w);
+    real length = normal.magnitude();
+    if (length <= real_epsilon) return false;
+    normal *= ((real)1.0) / length;
+
+    face->index[0] = a;
+    face->index[1] = b;
+    face->index[2] = c;
+    if (normal * (points[a].w - inside) < 0)
+    {
+        face->index[1] = c;
+        face->index[2] = b;
+        normal.invert();
+    }
+    face->normal = normal;
+    face->distance = normal * points[a].w;
+    return true;
+}
+
+/*
+ * Grows a GJK simplex that ended touching the origin into a
+ * tetrahedron, by adding support points in directions that leave
+ * its plane or line. Returns false if the Minkowski difference is
+ * too flat to contain one.
+ */
+static bool growSimplex(const ConvexCore &one, const ConvexCore &two,
+                        std::vector<MinkowskiPoint> &points)
+{
+    static const Vector3 directions[6] = {
+        Vector3(1,0,0), Vector3(-1,0,0), Vector3(0,1,0),
+        Vector3(0,-1,0), Vector3(0,0,1), Vector3(0,0,-1)
+    };
+
+    while (points.size() < 4)
+    {
+        // Try the normal of the triangle first, then the axes.
+        Vector3 tryFirst;
+        if (points.size() == 3)
+        {
+            tryFirst = (points[1].w - points[0].w) %
+                (points[2].w - points[0].w);
+        }
+
+        bool grown = false;
+        for (unsigned i = 0; i < 8 && !grown; i++)
+        {
+            Vector3 direction;
+            if (i < 2) direction = tryFirst * (i ? -1.0f : 1.0f);
+            else direction = directions[i - 2];
+            if (direction.squareMagnitude() <= real_epsilon) continue;
+
+            MinkowskiPoint next = minkowskiSupport(one, two, direction);
+
+            // Only keep it if it isn't in the span of what we have.
+            real gain;
+            Vector3 offset = next.w - points[0].w;
+            if (points.size() == 1)
+            {
+                gain = offset.squareMagnitude();
+            }
+            else if (points.size() == 2)
+            {
+                gain = ((points[1].w - points[0].w) % offset).squareMagnitude();
+            }
+            else
+            {
+                gain = real_abs(tryFirst * offset);
+                gain *= gain;
+            }
+            if (gain > (real)1e-10)
+            {
+                points.push_back(next);
+                grown = true;
+            }
+        }
+        if (!grown) return false;
+    }
+    return true;
+}
+
+/*
+ * Runs EPA, starting from the final GJK simplex, to find the
+ * direction and depth of least penetration of two overlapping
+ * cores. The normal points out of the Minkowski difference, so
+ * moving core one by -normal * depth separates them. Returns false
+ * if no polytope could be built.
+ */
+static bool epa(const ConvexCore &one, const ConvexCore &two,
+                const GjkSimplex &simplex,
+                Vector3 *normal, real *depth,
+                Vector3 *pointOne, Vector3 *pointTwo)
+{
+    std::vector<MinkowskiPoint> points(simplex.point,
+                                       simplex.point + simplex.count);
+    if (!growSimplex(one, two, points)) return false;
+
+    Vector3 inside = (points[0].w + points[1].w + points[2].w + points[3].w)
+        * (real)0.25;
+    std::vector<EpaFace> faces;
+    static const unsigned tetrahedron[4][3] = {
+        {0, 1, 2}, {0, 3, 1}, {0, 2, 3}, {1, 3, 2}
+    };
+    for (unsigned f = 0; f < 4; f++)
+    {
+        EpaFace face;
+        if (!makeFace(points, tetrahedron[f][0], tetrahedron[f][1],
+                      tetrahedron[f][2], inside, &face)) return false;
+        faces.push_back(face);
+    }
+
+    std::vector<unsigned> edges;
+    unsigned closest = 0;
+    for (unsigned iteration = 0; iteration < 64; iteration++)
+    {
+        // Find the face closest to the origin.
+        closest = 0;
+        for (unsigned f = 1; f < faces.size(); f++)
+        {
+            if (faces[f].distance < faces[closest].distance) closest = f;
+        }
+
+        // Stop if we can't push that face any further out.
+        EpaFace face = faces[closest];
+        MinkowskiPoint next = minkowskiSupport(one, two, face.normal);
+        if (next.w * face.normal - face.distance <= (real)1e-6) break;
+
+        // Remove every face the new point can see, keeping the edges
+        // round the hole they leave (those used by only one of them).
+        unsigned added = (unsigned)points.size();
+        points.push_back(next);
+        edges.clear();
+        for (unsigned f = 0; f < faces.size(); )
+        {
+            if (faces[f].normal * (next.w - points[faces[f].index[0]].w) <= 0)
+            {
+                f++;
+                continue;
+            }
+            for (unsigned e = 0; e < 3; e++)
+            {
+                unsigned start = faces[f].index[e];
+                unsigned end = faces[f].index[(e + 1) % 3];
+                bool shared = false;
+                for (unsigned i = 0; i < edges.size(); i += 2)
+                {
+                    if (edges[i] == end && edges[i+1] == start)
+                    {
+                        edges.erase(edges.begin() + i, edges.begin() + i + 2);
+                        shared = true;
+                        break;
+                    }
+                }
+                if (!shared)
+                {
+                    edges.push_back(start);
+                    edges.push_back(end);
+                }
+            }
+            faces[f] = faces.back();
+            faces.pop_back();
+        }
+
+        // Fill the hole with faces to the new point.
+        for (unsigned i = 0; i < edges.size(); i += 2)
+        {
+            EpaFace newFace;
+            if (makeFace(points, edges[i], edges[i+1], added,
+                         inside, &newFace))
+            {
+                faces.push_back(newFace);
+            }
+        }
+        if (faces.empty()) return false;
+        closest = 0;
+    }
+
+    // Re-find the closest face, in case we ran out of iterations.
+    for (unsigned f = 1; f < faces.size(); f++)
+    {
+        if (faces[f].distance < faces[closest].distance) closest = f;
+    }
+    const EpaFace &face = faces[closest];
+    *normal = face.normal;
+    *depth = face.distance;
+
+    // Find the weights of the origin's projection onto the face,
+    // and use them to find the matching points on each core.
+    const MinkowskiPoint &a = points[face.index[0]];
+    const MinkowskiPoint &b = points[face.index[1]];
+    const MinkowskiPoint &c = points[face.index[2]];
+    Vector3 projection = face.normal * face.distance;
+    Vector3 area = (b.w - a.w) % (c.w - a.w);
+    real areaSquared = area.squareMagnitude();
+    real u = (((b.w - projection) % (c.w - projection)) * area) / areaSquared;
+    real v = (((c.w - projection) % (a.w - projection)) * area) / areaSquared;
+    real w = 1 - u - v;
+    *pointOne = a.a * u + b.a * v + c.a * w;
+    *pointTwo = a.b * u + b.b * v + c.b * w;
+    return true;
+}
+
+unsigned CollisionDetector::convexAndConvex(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    ConvexCore coreOne(one), coreTwo(two);
+    GjkResult result;
+    gjk(coreOne, coreTwo, &result);
+
+    // If the cores are apart, only their radii can touch.
+    if (!result.overlap)
+    {
+        return fillRoundedContact(
+            result.pointOne, coreOne.radius, one.body,
+            result.pointTwo, coreTwo.radius, two.body,
+            Vector3(0, 1, 0), data);
+    }
+
+    // Otherwise find how far they have gone into each other.
+    Vector3 normal, pointOne, pointTwo;
+    real depth;
+    if (!epa(coreOne, coreTwo, result.simplex,
+             &normal, &depth, &pointOne, &pointTwo))
+    {
+        // The cores are too flat to have any depth: they only
+        // touch, so fall back on the rounded contact, if any.
+        if (coreOne.radius + coreTwo.radius <= 0) return 0;
+        return fillRoundedContact(
+            result.pointOne, coreOne.radius, one.body,
+            result.pointTwo, coreTwo.radius, two.body,
+            Vector3(0, 1, 0), data);
+    }
+
+    // The contact normal points from two to one, the opposite way
+    // to the EPA normal. The contact point is midway between the
+    // deepest points of each surface.
+    Vector3 surfaceOne = pointOne + normal * coreOne.radius;
+    Vector3 surfaceTwo = pointTwo - normal * coreTwo.radius;
+
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal * -1.0f;
+    contact->contactPoint = (surfaceOne + surfaceTwo) * (real)0.5;
+    contact->penetration = depth + coreOne.radius + coreTwo.radius;
+    contact->setBodyData(one.body, two.body,
+        data->friction, data->restitution);
+
+    data->addContacts(1);
+    return 1;
+}
@@ -16,6 +16,9 @@
 #include <assert.h>
 #include <cstdlib>
 #include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <vector>
 
 using namespace cyclone;
 
@@ -61,33 +64,164 @@ static inline real transformToAxis(
         box.halfSize.z * real_abs(axis * box.getAxis(2));
 }
 
-/**
- * This function checks if the two boxes overlap
- * along the given axis. The final parameter toCentre
- * is used to pass in the vector between the boxes centre
- * points, to avoid having to recalculate it each time.
- */
-static inline bool overlapOnAxis(
-    const CollisionBox &one,
-    const CollisionBox &two,
-    const Vector3 &axis,
-    const Vector3 &toCentre
-    )
+void CollisionSphereSet::clear()
 {
-    // Project the half-size of one onto axis
-    real oneProject = transformToAxis(one, axis);
-    real twoProject = transformToAxis(two, axis);
+    x.clear();
+    y.clear();
+    z.clear();
+    radius.clear();
+    body.clear();
+}
 
-    // Project this onto the axis
-    real distance = real_abs(toCentre * axis);
+unsigned CollisionSphereSet::add(const CollisionSphere &sphere)
+{
+    return add(sphere.getAxis(3), sphere.radius, sphere.body);
+}
 
-    // Check for overlap
-    return (distance < oneProject + twoProject);
+unsigned CollisionSphereSet::add(const Vector3 &centre,
+                                 real radius,
+                                 RigidBody *body)
+{
+    x.push_back(centre.x);
+    y.push_back(centre.y);
+    z.push_back(centre.z);
+    CollisionSphereSet::radius.push_back(radius);
+    CollisionSphereSet::body.push_back(body);
+    return size() - 1;
 }
 
-// This preprocessor definition is only used as a convenience
-// in the boxAndBox intersection  method.
-#define TEST_OVERLAP(axis) overlapOnAxis(one, two, (axis), toCentre)
+/*
+ * Holds two boxes expressed in the axes of the first, so that all
+ * fifteen separating axes can be tested from the same nine dot
+ * products between their axes, rather than building each axis and
+ * projecting both boxes onto it. The axes are tested a group at a
+ * time, so a separating face axis is found before the edge axes are
+ * worked out.
+ */
+struct BoxPairFrame
+{
+    /** The half-sizes of box one and box two. */
+    real oneSize[3];
+    real twoSize[3];
+
+    /** Holds axis i of box one dotted with axis j of box two. */
+    real rotation[3][3];
+
+    /** The absolute values of the rotation entries. */
+    real absRotation[3][3];
+
+    /** The vector between the box centres, in box one's axes. */
+    real offset[3];
+
+    BoxPairFrame(const CollisionBox &one,
+                 const CollisionBox &two,
+                 const Vector3 &toCentre)
+    {
+        for (unsigned i = 0; i < 3; i++)
+        {
+            Vector3 axis = one.getAxis(i);
+            for (unsigned j = 0; j < 3; j++)
+            {
+                rotation[i][j] = axis * two.getAxis(j);
+                absRotation[i][j] = real_abs(rotation[i][j]);
+            }
+            offset[i] = axis * toCentre;
+        }
+        oneSize[0] = one.halfSize.x;
+        oneSize[1] = one.halfSize.y;
+        oneSize[2] = one.halfSize.z;
+        twoSize[0] = two.halfSize.x;
+        twoSize[1] = two.halfSize.y;
+        twoSize[2] = two.halfSize.z;
+    }
+
+    /**
+     * Fills the overlap of the boxes along each of box one's axes
+     * (positive indicates overlap, negative separation).
+     */
+    void oneFacePenetrations(real penetration[3]) const
+    {
+        for (unsigned i = 0; i < 3; i++)
+        {
+            real twoProject =
+                twoSize[0] * absRotation[i][0] +
+                twoSize[1] * absRotation[i][1] +
+                twoSize[2] * absRotation[i][2];
+            penetration[i] = oneSize[i] + twoProject - real_abs(offset[i]);
+        }
+    }
+
+    /**
+     * Fills the overlap of the boxes along each of box two's axes.
+     */
+    void twoFacePenetrations(real penetration[3]) const
+    {
+        for (unsigned j = 0; j < 3; j++)
+        {
+            real oneProject =
+                oneSize[0] * absRotation[0][j] +
+                oneSize[1] * absRotation[1][j] +
+                oneSize[2] * absRotation[2][j];
+            real distance =
+                offset[0] * rotation[0][j] +
+                offset[1] * rotation[1][j] +
+                offset[2] * rotation[2][j];
+            penetration[j] = oneProject + twoSize[j] - real_abs(distance);
+        }
+    }
+
+    /**
+     * Fills the overlap of the boxes along the cross product of each
+     * axis of box one with each axis of box two, in the order
+     * (0,0), (0,1), ... (2,2). Almost parallel axes can't separate
+     * the boxes, so are given REAL_MAX. If normalise is false the
+     * overlaps are left scaled by the length of the cross product,
+     * which is enough to check their sign.
+     */
+    void edgePenetrations(real penetration[9], bool normalise) const
+    {
+        static const unsigned next[3] = {1, 2, 0};
+        static const unsigned last[3] = {2, 0, 1};
+        for (unsigned k = 0; k < 9; k++)
+        {
+            unsigned i = k / 3, j = k % 3;
+            unsigned i1 = next[i], i2 = last[i];
+            unsigned j1 = next[j], j2 = last[j];
+
+            real oneProject =
+                oneSize[i1] * absRotation[i2][j] +
+                oneSize[i2] * absRotation[i1][j];
+            real twoProject =
+                twoSize[j1] * absRotation[i][j2] +
+                twoSize[j2] * absRotation[i][j1];
+            real distance =
+                offset[i2] * rotation[i1][j] - offset[i1] * rotation[i2][j];
+            real overlap = oneProject + twoProject - real_abs(distance);
+
+            // The square length of the cross product of unit axes.
+            real squareLength = 1 - rotation[i][j] * rotation[i][j];
+            if (squareLength < 0.0001) overlap = REAL_MAX;
+            else if (normalise) overlap /= real_sqrt(squareLength);
+            penetration[k] = overlap;
+        }
+    }
+};
+
+/*
+ * Returns true if all the given penetrations show overlap: strictly
+ * positive, or zero too if touching is allowed.
+ */
+static inline bool allOverlap(const real *penetration, unsigned count,
+                              bool touching)
+{
+    bool overlap = true;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (touching) overlap &= penetration[i] >= 0;
+        else overlap &= penetration[i] > 0;
+    }
+    return overlap;
+}
 
 bool IntersectionTests::boxAndBox(
     const CollisionBox &one,
@@ -96,31 +230,21 @@ bool IntersectionTests::boxAndBox(
 {
     // Find the vector between the two centres
     Vector3 toCentre = two.getAxis(3) - one.getAxis(3);
+    BoxPairFrame frame(one, two, toCentre);
+    real penetration[9];
 
-    return (
-        // Check on box one's axes first
-        TEST_OVERLAP(one.getAxis(0)) &&
-        TEST_OVERLAP(one.getAxis(1)) &&
-        TEST_OVERLAP(one.getAxis(2)) &&
-
-        // And on two's
-        TEST_OVERLAP(two.getAxis(0)) &&
-        TEST_OVERLAP(two.getAxis(1)) &&
-        TEST_OVERLAP(two.getAxis(2)) &&
-
-        // Now on the cross products
-        TEST_OVERLAP(one.getAxis(0) % two.getAxis(0)) &&
-        TEST_OVERLAP(one.getAxis(0) % two.getAxis(1)) &&
-        TEST_OVERLAP(one.getAxis(0) % two.getAxis(2)) &&
-        TEST_OVERLAP(one.getAxis(1) % two.getAxis(0)) &&
-        TEST_OVERLAP(one.getAxis(1) % two.getAxis(1)) &&
-        TEST_OVERLAP(one.getAxis(1) % two.getAxis(2)) &&
-        TEST_OVERLAP(one.getAxis(2) % two.getAxis(0)) &&
-        TEST_OVERLAP(one.getAxis(2) % two.getAxis(1)) &&
-        TEST_OVERLAP(one.getAxis(2) % two.getAxis(2))
-    );
+    // Check on box one's axes first
+    frame.oneFacePenetrations(penetration);
+    if (!allOverlap(penetration, 3, false)) return false;
+
+    // And on two's
+    frame.twoFacePenetrations(penetration);
+    if (!allOverlap(penetration, 3, false)) return false;
+
+    // Now on the cross products
+    frame.edgePenetrations(penetration, false);
+    return allOverlap(penetration, 9, false);
 }
-#undef TEST_OVERLAP
 
 bool IntersectionTests::boxAndHalfSpace(
     const CollisionBox &box,
@@ -253,62 +377,137 @@ unsigned CollisionDetector::sphereAndSphere(
     return 1;
 }
 
+// The number of pairs or spheres the batched tests work on at once.
+static const unsigned sphereBlock = 64;
 
-
-
-/*
- * This function checks if the two boxes overlap
- * along the given axis, returning the ammount of overlap.
- * The final parameter toCentre
- * is used to pass in the vector between the boxes centre
- * points, to avoid having to recalculate it each time.
- */
-static inline real penetrationOnAxis(
-    const CollisionBox &one,
-    const CollisionBox &two,
-    const Vector3 &axis,
-    const Vector3 &toCentre
+unsigned CollisionDetector::spheresAndSpheres(
+    const CollisionSphereSet &spheres,
+    const unsigned *pairs,
+    unsigned numPairs,
+    CollisionData *data
     )
 {
-    // Project the half-size of one onto axis
-    real oneProject = transformToAxis(one, axis);
-    real twoProject = transformToAxis(two, axis);
+    real midlineX[sphereBlock], midlineY[sphereBlock], midlineZ[sphereBlock];
+    real reach[sphereBlock];
+    unsigned char close[sphereBlock];
+    unsigned contactsUsed = 0;
 
-    // Project this onto the axis
-    real distance = real_abs(toCentre * axis);
+    for (unsigned start = 0; start < numPairs; start += sphereBlock)
+    {
+        // Make sure we have contacts
+        if (data->contactsLeft <= 0) break;
 
-    // Return the overlap (i.e. positive indicates
-    // overlap, negative indicates separation).
-    return oneProject + twoProject - distance;
-}
+        unsigned count = numPairs - start;
+        if (count > sphereBlock) count = sphereBlock;
+        const unsigned *blockPairs = pairs + start*2;
 
+        // Fetch the vector between each pair of centres.
+        for (unsigned k = 0; k < count; k++)
+        {
+            unsigned one = blockPairs[k*2], two = blockPairs[k*2+1];
+            midlineX[k] = spheres.x[one] - spheres.x[two];
+            midlineY[k] = spheres.y[one] - spheres.y[two];
+            midlineZ[k] = spheres.z[one] - spheres.z[two];
+            reach[k] = spheres.radius[one] + spheres.radius[two];
+        }
 
-static inline bool tryAxis(
-    const CollisionBox &one,
-    const CollisionBox &two,
-    Vector3 axis,
-    const Vector3& toCentre,
-    unsigned index,
+        // Flag the pairs that may touch, comparing square lengths so
+        // there is no square root or branch. The flag is slightly
+        // generous, so the exact test below decides borderline pairs.
+        for (unsigned k = 0; k < count; k++)
+        {
+            real squareSize =
+                midlineX[k]*midlineX[k] +
+                midlineY[k]*midlineY[k] +
+                midlineZ[k]*midlineZ[k];
+            real squareReach = reach[k]*reach[k]*(real)1.0001;
+            close[k] = squareSize < squareReach;
+        }
+
+        // Write a contact for each pair that touches.
+        for (unsigned k = 0; k < count; k++)
+        {
+            if (!close[k]) continue;
+            if (data->contactsLeft <= 0) break;
+
+            Vector3 midline(midlineX[k], midlineY[k], midlineZ[k]);
+            real size = midline.magnitude();
+            if (size <= 0.0f || size >= reach[k]) continue;
+
+            unsigned one = blockPairs[k*2], two = blockPairs[k*2+1];
+            Vector3 positionOne(spheres.x[one], spheres.y[one], spheres.z[one]);
 
-    // These values may be updated
-    real& smallestPenetration,
-    unsigned &smallestCase
+            Contact* contact = data->contacts;
+            contact->contactNormal = midline * (((real)1.0)/size);
+            contact->contactPoint = positionOne + midline * (real)0.5;
+            contact->penetration = reach[k] - size;
+            contact->setBodyData(spheres.body[one], spheres.body[two],
+                data->friction, data->restitution);
+
+            data->addContacts(1);
+            contactsUsed++;
+        }
+    }
+    return contactsUsed;
+}
+
+unsigned CollisionDetector::spheresAndHalfSpace(
+    const CollisionSphereSet &spheres,
+    const CollisionPlane &plane,
+    CollisionData *data
     )
 {
-    // Make sure we have a normalized axis, and don't check almost parallel axes
-    if (axis.squareMagnitude() < 0.0001) return true;
-    axis.normalise();
+    real distance[sphereBlock];
+    unsigned numSpheres = spheres.size();
+    unsigned contactsUsed = 0;
+
+    for (unsigned start = 0; start < numSpheres; start += sphereBlock)
+    {
+        // Make sure we have contacts
+        if (data->contactsLeft <= 0) break;
+
+        unsigned count = numSpheres - start;
+        if (count > sphereBlock) count = sphereBlock;
+
+        // Find the distance of each sphere from the plane.
+        const real *x = &spheres.x[start];
+        const real *y = &spheres.y[start];
+        const real *z = &spheres.z[start];
+        const real *radius = &spheres.radius[start];
+        for (unsigned k = 0; k < count; k++)
+        {
+            distance[k] =
+                plane.direction.x * x[k] +
+                plane.direction.y * y[k] +
+                plane.direction.z * z[k] -
+                radius[k] - plane.offset;
+        }
+
+        // Write a contact for each sphere that is in the half-space.
+        for (unsigned k = 0; k < count; k++)
+        {
+            if (distance[k] >= 0) continue;
+            if (data->contactsLeft <= 0) break;
 
-    real penetration = penetrationOnAxis(one, two, axis, toCentre);
+            Vector3 position(x[k], y[k], z[k]);
+            Contact* contact = data->contacts;
+            contact->contactNormal = plane.direction;
+            contact->penetration = -distance[k];
+            contact->contactPoint =
+                position - plane.direction * (distance[k] + radius[k]);
+            contact->setBodyData(spheres.body[start + k], NULL,
+                data->friction, data->restitution);
 
-    if (penetration < 0) return false;
-    if (penetration < smallestPenetration) {
-        smallestPenetration = penetration;
-        smallestCase = index;
+            data->addContacts(1);
+            contactsUsed++;
+        }
     }
-    return true;
+    return contactsUsed;
 }
 
+
+
+
 void fillPointFaceBoxBox(
     const CollisionBox &one,
     const CollisionBox &two,
@@ -326,18 +525,22 @@ void fillPointFaceBoxBox(
     // We know which axis the collision is on (i.e. best),
     // but we need to work out which of the two faces on
     // this axis.
+    // The feature is made of the axis, the face and the vertex,
+    // each of the last two being one bit per axis.
+    unsigned feature = best << 6;
     Vector3 normal = one.getAxis(best);
     if (one.getAxis(best) * toCentre > 0)
     {
         normal = normal * -1.0f;
+        feature |= 8;
     }
 
     // Work out which vertex of box two we're colliding with.
     // Using toCentre doesn't work!
     Vector3 vertex = two.halfSize;
-    if (two.getAxis(0) * normal < 0) vertex.x = -vertex.x;
-    if (two.getAxis(1) * normal < 0) vertex.y = -vertex.y;
-    if (two.getAxis(2) * normal < 0) vertex.z = -vertex.z;
+    if (two.getAxis(0) * normal < 0) { vertex.x = -vertex.x; feature |= 1; }
+    if (two.getAxis(1) * normal < 0) { vertex.y = -vertex.y; feature |= 2; }
+    if (two.getAxis(2) * normal < 0) { vertex.z = -vertex.z; feature |= 4; }
 
     // Create the contact data
     contact->contactNormal = normal;
@@ -345,6 +548,182 @@ void fillPointFaceBoxBox(
     contact->contactPoint = two.getTransform() * vertex;
     contact->setBodyData(one.body, two.body,
         data->friction, data->restitution);
+    contact->feature = feature;
+}
+
+/*
+ * Clips a convex polygon against the plane axis * point = limit,
+ * keeping the part with axis * point <= limit, and returns the
+ * number of points written to out. Each point carries a feature
+ * number: points made by the clip take the feature of the kept end
+ * of their edge, with two bits per clipping plane saying whether the
+ * edge was leaving or entering the plane.
+ */
+static unsigned clipPolygon(
+    const Vector3 *in,
+    const unsigned *inFeature,
+    unsigned count,
+    const Vector3 &axis,
+    real limit,
+    unsigned plane,
+    Vector3 *out,
+    unsigned *outFeature
+    )
+{
+    unsigned used = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        unsigned j = (i + 1) % count;
+        real startDistance = in[i] * axis - limit;
+        real endDistance = in[j] * axis - limit;
+
+        // Keep the start point if it is inside.
+        if (startDistance <= 0)
+        {
+            out[used] = in[i];
+            outFeature[used] = inFeature[i];
+            used++;
+        }
+
+        // Add the crossing point if the edge crosses the plane.
+        if ((startDistance <= 0) != (endDistance <= 0))
+        {
+            real t = startDistance / (startDistance - endDistance);
+            out[used] = in[i] + (in[j] - in[i]) * t;
+            if (startDistance <= 0)
+            {
+                outFeature[used] = inFeature[i] | (1 << (10 + plane*2));
+            }
+            else
+            {
+                outFeature[used] = inFeature[j] | (2 << (10 + plane*2));
+            }
+            used++;
+        }
+    }
+    return used;
+}
+
+/*
+ * This function is called when a face of box one is the axis of
+ * least penetration. It clips the face of box two that points most
+ * nearly against it to the sides of box one's face, and fills a
+ * contact for each clipped point that is below box one's face,
+ * returning the number of contacts written.
+ */
+static unsigned fillFaceFaceBoxBox(
+    const CollisionBox &one,
+    const CollisionBox &two,
+    const Vector3 &toCentre,
+    CollisionData *data,
+    unsigned best,
+    real pen
+    )
+{
+    // Work out which face of box one we're colliding with, as
+    // in fillPointFaceBoxBox.
+    unsigned feature = best << 6;
+    Vector3 normal = one.getAxis(best);
+    if (normal * toCentre > 0)
+    {
+        normal = normal * -1.0f;
+        feature |= 8;
+    }
+
+    // Find the face of box two pointing most along the normal
+    // (i.e. most directly at box one).
+    unsigned incident = 0;
+    real incidentDot = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real dot = two.getAxis(i) * normal;
+        if (real_abs(dot) > real_abs(incidentDot))
+        {
+            incidentDot = dot;
+            incident = i;
+        }
+    }
+
+    // Build its corners in order around the face. The vertex
+    // features match those used by fillPointFaceBoxBox.
+    static const real corners[4][2] = {{1,1},{-1,1},{-1,-1},{1,-1}};
+    unsigned u = (incident + 1) % 3;
+    unsigned v = (incident + 2) % 3;
+    Vector3 polygon[2][8];
+    unsigned features[2][8];
+    for (unsigned i = 0; i < 4; i++)
+    {
+        Vector3 vertex;
+        unsigned vertexFeature = feature;
+        vertex[incident] = two.halfSize[incident];
+        if (incidentDot < 0)
+        {
+            vertex[incident] = -vertex[incident];
+            vertexFeature |= 1 << incident;
+        }
+        vertex[u] = two.halfSize[u] * corners[i][0];
+        if (corners[i][0] < 0) vertexFeature |= 1 << u;
+        vertex[v] = two.halfSize[v] * corners[i][1];
+        if (corners[i][1] < 0) vertexFeature |= 1 << v;
+
+        polygon[0][i] = two.getTransform() * vertex;
+        features[0][i] = vertexFeature;
+    }
+
+    // Clip it against the four sides of box one's face.
+    unsigned count = 4;
+    unsigned current = 0;
+    Vector3 centre = one.getAxis(3);
+    unsigned plane = 0;
+    for (unsigned i = 0; i < 3 && count > 0; i++)
+    {
+        if (i == best) continue;
+        Vector3 axis = one.getAxis(i);
+        real position = axis * centre;
+
+        count = clipPolygon(polygon[current], features[current], count,
+            axis, position + one.halfSize[i], plane++,
+            polygon[1-current], features[1-current]);
+        current = 1 - current;
+        if (count == 0) break;
+
+        count = clipPolygon(polygon[current], features[current], count,
+            axis * -1.0f, one.halfSize[i] - position, plane++,
+            polygon[1-current], features[1-current]);
+        current = 1 - current;
+    }
+
+    // Write a contact for each point below box one's face. The
+    // face is at this distance along the normal.
+    real faceOffset = normal * centre - one.halfSize[best];
+    Contact* contact = data->contacts;
+    unsigned contactsUsed = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (contactsUsed == (unsigned)data->contactsLeft) break;
+
+        const Vector3 &point = polygon[current][i];
+        real depth = normal * point - faceOffset;
+        if (depth < 0) continue;
+
+        contact->contactNormal = normal;
+        contact->penetration = depth > pen ? pen : depth;
+        contact->contactPoint = point;
+        contact->setBodyData(one.body, two.body,
+            data->friction, data->restitution);
+        contact->feature = features[current][i];
+        contact++;
+        contactsUsed++;
+    }
+
+    // If clipping left nothing (from rounding), fall back to
+    // the single deepest vertex.
+    if (contactsUsed == 0)
+    {
+        fillPointFaceBoxBox(one, two, toCentre, data, best, pen);
+        contactsUsed = 1;
+    }
+    return contactsUsed;
 }
 
 static inline Vector3 contactPoint(
@@ -402,10 +781,13 @@ static inline Vector3 contactPoint(
     }
 }
 
-// This preprocessor definition is only used as a convenience
-// in the boxAndBox contact generation method.
-#define CHECK_OVERLAP(axis, index) \
-    if (!tryAxis(one, two, (axis), toCentre, (index), pen, best)) return 0;
+/*
+ * An edge-edge axis is nearly a face normal if the square of the sine
+ * of the angle between them is below this. It is then only used if
+ * its penetration is below this fraction of the face penetration.
+ */
+static const real faceAxisSquareSine = (real)0.01;
+static const real edgeAxisBias = (real)0.95;
 
 unsigned CollisionDetector::boxAndBox(
     const CollisionBox &one,
@@ -413,63 +795,95 @@ unsigned CollisionDetector::boxAndBox(
     CollisionData *data
     )
 {
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
     //if (!IntersectionTests::boxAndBox(one, two)) return 0;
 
     // Find the vector between the two centres
     Vector3 toCentre = two.getAxis(3) - one.getAxis(3);
 
-    // We start assuming there is no contact
+    // Find the overlap on all fifteen axes, returning if any
+    // group gives us a separating axis.
+    BoxPairFrame frame(one, two, toCentre);
+    real penetration[15];
+    frame.oneFacePenetrations(penetration);
+    if (!allOverlap(penetration, 3, true)) return 0;
+    frame.twoFacePenetrations(penetration + 3);
+    if (!allOverlap(penetration + 3, 3, true)) return 0;
+
+    // Keep track of the axis with the smallest penetration.
     real pen = REAL_MAX;
     unsigned best = 0xffffff;
-
-    // Now we check each axes, returning if it gives us
-    // a separating axis, and keeping track of the axis with
-    // the smallest penetration otherwise.
-    CHECK_OVERLAP(one.getAxis(0), 0);
-    CHECK_OVERLAP(one.getAxis(1), 1);
-    CHECK_OVERLAP(one.getAxis(2), 2);
-
-    CHECK_OVERLAP(two.getAxis(0), 3);
-    CHECK_OVERLAP(two.getAxis(1), 4);
-    CHECK_OVERLAP(two.getAxis(2), 5);
+    for (unsigned i = 0; i < 6; i++)
+    {
+        if (penetration[i] < pen)
+        {
+            pen = penetration[i];
+            best = i;
+        }
+    }
 
     // Store the best axis-major, in case we run into almost
     // parallel edge collisions later
     unsigned bestSingleAxis = best;
+    real bestSinglePen = pen;
 
-    CHECK_OVERLAP(one.getAxis(0) % two.getAxis(0), 6);
-    CHECK_OVERLAP(one.getAxis(0) % two.getAxis(1), 7);
-    CHECK_OVERLAP(one.getAxis(0) % two.getAxis(2), 8);
-    CHECK_OVERLAP(one.getAxis(1) % two.getAxis(0), 9);
-    CHECK_OVERLAP(one.getAxis(1) % two.getAxis(1), 10);
-    CHECK_OVERLAP(one.getAxis(1) % two.getAxis(2), 11);
-    CHECK_OVERLAP(one.getAxis(2) % two.getAxis(0), 12);
-    CHECK_OVERLAP(one.getAxis(2) % two.getAxis(1), 13);
-    CHECK_OVERLAP(one.getAxis(2) % two.getAxis(2), 14);
+    frame.edgePenetrations(penetration + 6, true);
+    if (!allOverlap(penetration + 6, 9, true)) return 0;
+    for (unsigned i = 6; i < 15; i++)
+    {
+        if (penetration[i] < pen)
+        {
+            pen = penetration[i];
+            best = i;
+        }
+    }
 
     // Make sure we've got a result.
     assert(best != 0xffffff);
 
+    // An edge-edge axis that is nearly a face normal gives almost the
+    // same penetration as the face, and rounding can pick either from
+    // frame to frame. For those edges, only use the edge axis if it is
+    // clearly better, so resting boxes get the full face manifold.
+    if (best > 5)
+    {
+        Vector3 edgeAxis = one.getAxis((best - 6) / 3) %
+            two.getAxis((best - 6) % 3);
+        Vector3 faceAxis = bestSingleAxis < 3 ?
+            one.getAxis(bestSingleAxis) : two.getAxis(bestSingleAxis - 3);
+        real sine = (edgeAxis % faceAxis).squareMagnitude();
+        if (sine < edgeAxis.squareMagnitude() * faceAxisSquareSine &&
+            pen > bestSinglePen * edgeAxisBias)
+        {
+            best = bestSingleAxis;
+            pen = bestSinglePen;
+        }
+    }
+
     // We now know there's a collision, and we know which
     // of the axes gave the smallest penetration. We now
     // can deal with it in different ways depending on
     // the case.
     if (best < 3)
     {
-        // We've got a vertex of box two on a face of box one.
-        fillPointFaceBoxBox(one, two, toCentre, data, best, pen);
-        data->addContacts(1);
-        return 1;
+        // We've got box two touching a face of box one.
+        unsigned contactsUsed =
+            fillFaceFaceBoxBox(one, two, toCentre, data, best, pen);
+        data->addContacts(contactsUsed);
+        return contactsUsed;
     }
     else if (best < 6)
     {
-        // We've got a vertex of box one on a face of box two.
+        // We've got box one touching a face of box two.
         // We use the same algorithm as above, but swap around
         // one and two (and therefore also the vector between their
         // centres).
-        fillPointFaceBoxBox(two, one, toCentre*-1.0f, data, best-3, pen);
-        data->addContacts(1);
-        return 1;
+        unsigned contactsUsed =
+            fillFaceFaceBoxBox(two, one, toCentre*-1.0f, data, best-3, pen);
+        data->addContacts(contactsUsed);
+        return contactsUsed;
     }
     else
     {
@@ -491,15 +905,26 @@ unsigned CollisionDetector::boxAndBox(
         // its component in the direction of the box's collision axis is zero
         // (its a mid-point) and we determine which of the extremes in each
         // of the other axes is closest.
+        // The feature is made of the axis pair and the two edges, each
+        // edge being one bit per axis.
+        unsigned feature = (best + 6) << 6;
         Vector3 ptOnOneEdge = one.halfSize;
         Vector3 ptOnTwoEdge = two.halfSize;
         for (unsigned i = 0; i < 3; i++)
         {
             if (i == oneAxisIndex) ptOnOneEdge[i] = 0;
-            else if (one.getAxis(i) * axis > 0) ptOnOneEdge[i] = -ptOnOneEdge[i];
+            else if (one.getAxis(i) * axis > 0)
+            {
+                ptOnOneEdge[i] = -ptOnOneEdge[i];
+                feature |= 8 << i;
+            }
 
             if (i == twoAxisIndex) ptOnTwoEdge[i] = 0;
-            else if (two.getAxis(i) * axis < 0) ptOnTwoEdge[i] = -ptOnTwoEdge[i];
+            else if (two.getAxis(i) * axis < 0)
+            {
+                ptOnTwoEdge[i] = -ptOnTwoEdge[i];
+                feature |= 1 << i;
+            }
         }
 
         // Move them into world coordinates (they are already oriented
@@ -524,12 +949,12 @@ unsigned CollisionDetector::boxAndBox(
         contact->contactPoint = vertex;
         contact->setBodyData(one.body, two.body,
             data->friction, data->restitution);
+        contact->feature = feature;
         data->addContacts(1);
         return 1;
     }
     return 0;
 }
-#undef CHECK_OVERLAP
 
 
 
@@ -691,6 +1116,7 @@ unsigned CollisionDetector::boxAndHalfSpace(
             // Write the appropriate data
             contact->setBodyData(box.body, NULL,
                 data->friction, data->restitution);
+            contact->feature = i;
 
             // Move onto the next contact
             contact++;
@@ -702,3 +1128,432 @@ unsigned CollisionDetector::boxAndHalfSpace(
     data->addContacts(contactsUsed);
     return contactsUsed;
 }
+
+/*
+ * These functions adapt each of the tests above to the common
+ * CollideFunction signature, so they can go in the dispatch tables.
+ */
+static unsigned collideSphereAndSphere(const CollisionPrimitive &one,
+                                       const CollisionPrimitive &two,
+                                       CollisionData *data)
+{
+    return CollisionDetector::sphereAndSphere(
+        static_cast<const CollisionSphere&>(one),
+        static_cast<const CollisionSphere&>(two), data);
+}
+
+static unsigned collideSphereAndBox(const CollisionPrimitive &one,
+                                    const CollisionPrimitive &two,
+                                    CollisionData *data)
+{
+    return CollisionDetector::boxAndSphere(
+        static_cast<const CollisionBox&>(two),
+        static_cast<const CollisionSphere&>(one), data);
+}
+
+static unsigned collideBoxAndSphere(const CollisionPrimitive &one,
+                                    const CollisionPrimitive &two,
+                                    CollisionData *data)
+{
+    return CollisionDetector::boxAndSphere(
+        static_cast<const CollisionBox&>(one),
+        static_cast<const CollisionSphere&>(two), data);
+}
+
+static unsigned collideBoxAndBox(const CollisionPrimitive &one,
+                                 const CollisionPrimitive &two,
+                                 CollisionData *data)
+{
+    return CollisionDetector::boxAndBox(
+        static_cast<const CollisionBox&>(one),
+        static_cast<const CollisionBox&>(two), data);
+}
+
+static unsigned collideSphereAndCapsule(const CollisionPrimitive &one,
+                                        const CollisionPrimitive &two,
+                                        CollisionData *data)
+{
+    return CollisionDetector::capsuleAndSphere(
+        static_cast<const CollisionCapsule&>(two),
+        static_cast<const CollisionSphere&>(one), data);
+}
+
+static unsigned collideCapsuleAndSphere(const CollisionPrimitive &one,
+                                        const CollisionPrimitive &two,
+                                        CollisionData *data)
+{
+    return CollisionDetector::capsuleAndSphere(
+        static_cast<const CollisionCapsule&>(one),
+        static_cast<const CollisionSphere&>(two), data);
+}
+
+static unsigned collideCapsuleAndCapsule(const CollisionPrimitive &one,
+                                         const CollisionPrimitive &two,
+                                         CollisionData *data)
+{
+    return CollisionDetector::capsuleAndCapsule(
+        static_cast<const CollisionCapsule&>(one),
+        static_cast<const CollisionCapsule&>(two), data);
+}
+
+// Holds the test for each pair of primitive types, indexed by the
+// type of the first primitive and then the second. Every pair has a
+// test, so the entries are never null.
+static const CollisionDetector::CollideFunction
+    collideTable[CollisionPrimitive::TYPES][CollisionPrimitive::TYPES] =
+{
+    /* SPHERE */  { collideSphereAndSphere, collideSphereAndBox,
+                    collideSphereAndCapsule,
+                    CollisionDetector::convexAndConvex },
+    /* BOX */     { collideBoxAndSphere, collideBoxAndBox,
+                    CollisionDetector::convexAndConvex,
+                    CollisionDetector::convexAndConvex },
+    /* CAPSULE */ { collideCapsuleAndSphere,
+                    CollisionDetector::convexAndConvex,
+                    collideCapsuleAndCapsule,
+                    CollisionDetector::convexAndConvex },
+    /* CONVEX */  { CollisionDetector::convexAndConvex,
+                    CollisionDetector::convexAndConvex,
+                    CollisionDetector::convexAndConvex,
+                    CollisionDetector::convexAndConvex }
+};
+
+unsigned CollisionDetector::collide(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data
+    )
+{
+    CollideFunction function = collideTable[one.type][two.type];
+    return function(one, two, data);
+}
+
+static unsigned collideSphereAndHalfSpace(const CollisionPrimitive &sphere,
+                                          const CollisionPlane &plane,
+                                          CollisionData *data)
+{
+    return CollisionDetector::sphereAndHalfSpace(
+        static_cast<const CollisionSphere&>(sphere), plane, data);
+}
+
+static unsigned collideBoxAndHalfSpace(const CollisionPrimitive &box,
+                                       const CollisionPlane &plane,
+                                       CollisionData *data)
+{
+    return CollisionDetector::boxAndHalfSpace(
+        static_cast<const CollisionBox&>(box), plane, data);
+}
+
+static unsigned collideCapsuleAndHalfSpace(const CollisionPrimitive &capsule,
+                                           const CollisionPlane &plane,
+                                           CollisionData *data)
+{
+    return CollisionDetector::capsuleAndHalfSpace(
+        static_cast<const CollisionCapsule&>(capsule), plane, data);
+}
+
+static unsigned collideConvexAndHalfSpace(const CollisionPrimitive &convex,
+                                          const CollisionPlane &plane,
+                                          CollisionData *data)
+{
+    return CollisionDetector::convexAndHalfSpace(
+        static_cast<const CollisionConvex&>(convex), plane, data);
+}
+
+// Holds the half-space test for each primitive type.
+typedef unsigned (*CollideHalfSpaceFunction)(
+    const CollisionPrimitive &primitive,
+    const CollisionPlane &plane,
+    CollisionData *data
+    );
+static const CollideHalfSpaceFunction
+    halfSpaceTable[CollisionPrimitive::TYPES] =
+{
+    /* SPHERE */  collideSphereAndHalfSpace,
+    /* BOX */     collideBoxAndHalfSpace,
+    /* CAPSULE */ collideCapsuleAndHalfSpace,
+    /* CONVEX */  collideConvexAndHalfSpace
+};
+
+unsigned CollisionDetector::collide(
+    const CollisionPrimitive &primitive,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    CollideHalfSpaceFunction function = halfSpaceTable[primitive.type];
+    return function(primitive, plane, data);
+}
+
+/*
+ * Orders contact indices by the pair of bodies the contacts join,
+ * whichever way round they are, and then by index.
+ */
+struct ContactPairBefore
+{
+    const Contact *contacts;
+
+    static void getPair(const Contact &contact, RigidBody *pair[2])
+    {
+        std::less<RigidBody*> less;
+        bool swap = less(contact.body[1], contact.body[0]);
+        pair[0] = contact.body[swap ? 1 : 0];
+        pair[1] = contact.body[swap ? 0 : 1];
+    }
+
+    bool operator()(unsigned one, unsigned two) const
+    {
+        RigidBody *pairOne[2], *pairTwo[2];
+        getPair(contacts[one], pairOne);
+        getPair(contacts[two], pairTwo);
+
+        std::less<RigidBody*> less;
+        if (pairOne[0] != pairTwo[0]) return less(pairOne[0], pairTwo[0]);
+        if (pairOne[1] != pairTwo[1]) return less(pairOne[1], pairTwo[1]);
+        return one < two;
+    }
+
+    bool samePair(unsigned one, unsigned two) const
+    {
+        RigidBody *pairOne[2], *pairTwo[2];
+        getPair(contacts[one], pairOne);
+        getPair(contacts[two], pairTwo);
+        return pairOne[0] == pairTwo[0] && pairOne[1] == pairTwo[1];
+    }
+
+    /*
+     * Returns the contact normal as seen from the first body of the
+     * pair, so contacts between the same bodies can be compared
+     * whichever way round they were generated.
+     */
+    Vector3 getNormal(unsigned index) const
+    {
+        const Contact &contact = contacts[index];
+        std::less<RigidBody*> less;
+        if (less(contact.body[1], contact.body[0]))
+        {
+            return contact.contactNormal * -1;
+        }
+        return contact.contactNormal;
+    }
+};
+
+/*
+ * Orders contact indices by the manifold they were put in, and then
+ * by index.
+ */
+struct ContactManifoldBefore
+{
+    const unsigned *manifold;
+
+    bool operator()(unsigned one, unsigned two) const
+    {
+        if (manifold[one] != manifold[two])
+        {
+            return manifold[one] < manifold[two];
+        }
+        return one < two;
+    }
+};
+
+/*
+ * Contacts between the same bodies whose normals are further apart
+ * than this (as the cosine of the angle between them) are in
+ * different manifolds: a box in a corner touches the floor and the
+ * wall, and both need to keep their own contacts.
+ */
+static const real manifoldNormalCosine = (real)0.9;
+
+/*
+ * Returns the offset between two contact points, flattened into the
+ * plane of the given contact normal.
+ */
+static inline Vector3 offsetInPlane(const Vector3 &from,
+                                    const Vector3 &to,
+                                    const Vector3 &normal)
+{
+    Vector3 offset = to - from;
+    return offset - normal * (offset * normal);
+}
+
+/*
+ * Picks which of a group of contacts between the same pair of bodies
+ * to keep, marking them in the keep array (indexed by contact).
+ */
+static void reduceManifold(const Contact *contacts,
+                           const unsigned *group,
+                           unsigned numContacts,
+                           std::vector<bool> &keep)
+{
+    if (numContacts <= 4)
+    {
+        for (unsigned i = 0; i < numContacts; i++) keep[group[i]] = true;
+        return;
+    }
+
+    // Keep the deepest contact.
+    unsigned a = group[0];
+    for (unsigned i = 1; i < numContacts; i++)
+    {
+        if (contacts[group[i]].penetration > contacts[a].penetration)
+        {
+            a = group[i];
+        }
+    }
+    keep[a] = true;
+    const Vector3 &pointA = contacts[a].contactPoint;
+    const Vector3 &normal = contacts[a].contactNormal;
+
+    // Then the contact furthest from it, across the contact plane.
+    unsigned b = a;
+    real best = 0;
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        real distance = offsetInPlane(pointA,
+            contacts[group[i]].contactPoint, normal).squareMagnitude();
+        if (distance > best)
+        {
+            best = distance;
+            b = group[i];
+        }
+    }
+    if (b == a) return;
+    keep[b] = true;
+    Vector3 edge = offsetInPlane(pointA, contacts[b].contactPoint, normal);
+
+    // Then the contact making the largest triangle with those two.
+    unsigned c = a;
+    best = 0;
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        Vector3 area = edge %
+            offsetInPlane(pointA, contacts[group[i]].contactPoint, normal);
+        if (area.squareMagnitude() > best)
+        {
+            best = area.squareMagnitude();
+            c = group[i];
+        }
+    }
+    if (c == a) return;
+    keep[c] = true;
+
+    // Finally the contact that adds the most area to the triangle: the
+    // one furthest outside one of its edges.
+    const Vector3 *corner[3] = {
+        &pointA, &contacts[b].contactPoint, &contacts[c].contactPoint
+    };
+    real winding = (edge % (*corner[2] - pointA)) * normal;
+    if (winding < 0) winding = -1;
+    else winding = 1;
+
+    unsigned d = a;
+    best = 0;
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        const Vector3 &point = contacts[group[i]].contactPoint;
+        for (unsigned k = 0; k < 3; k++)
+        {
+            const Vector3 &start = *corner[k];
+            const Vector3 &end = *corner[(k + 1) % 3];
+            real outside =
+                -(((end - start) % (point - start)) * normal) * winding;
+            if (outside > best)
+            {
+                best = outside;
+                d = group[i];
+            }
+        }
+    }
+    if (d != a) keep[d] = true;
+}
+
+void CollisionData::reduceContacts(unsigned firstContact)
+{
+    unsigned numContacts = contactCount - firstContact;
+    if (numContacts <= 4) return;
+    Contact *first = contactArray + firstContact;
+
+    // Group the contacts by their pair of bodies.
+    reduceOrder.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++) reduceOrder[i] = i;
+    ContactPairBefore before;
+    before.contacts = first;
+    std::sort(reduceOrder.begin(), reduceOrder.end(), before);
+
+    // Split each pair's contacts into manifolds by their normals, and
+    // reduce each manifold.
+    reduceManifolds.resize(numContacts);
+    reduceKeep.assign(numContacts, false);
+    ContactManifoldBefore byManifold;
+    byManifold.manifold = &reduceManifolds[0];
+    unsigned start = 0;
+    while (start < numContacts)
+    {
+        unsigned end = start + 1;
+        while (end < numContacts &&
+            before.samePair(reduceOrder[start], reduceOrder[end]))
+        {
+            end++;
+        }
+
+        // Each contact joins the first manifold whose first contact
+        // has a normal close to its own, or starts a new one.
+        unsigned numManifolds = 0;
+        for (unsigned i = start; i < end; i++)
+        {
+            unsigned index = reduceOrder[i];
+            Vector3 normal = before.getNormal(index);
+            reduceManifolds[index] = numManifolds;
+
+            unsigned manifold = 0;
+            for (unsigned j = start; j < i && manifold < numManifolds; j++)
+            {
+                // Only the first contact in each manifold is compared.
+                unsigned other = reduceOrder[j];
+                if (reduceManifolds[other] != manifold) continue;
+                if (normal * before.getNormal(other) >= manifoldNormalCosine)
+                {
+                    reduceManifolds[index] = manifold;
+                    break;
+                }
+                manifold++;
+            }
+            if (reduceManifolds[index] == numManifolds) numManifolds++;
+        }
+        if (numManifolds > 1)
+        {
+            std::sort(&reduceOrder[start], &reduceOrder[0] + end, byManifold);
+        }
+
+        unsigned group = start;
+        while (group < end)
+        {
+            unsigned groupEnd = group + 1;
+            while (groupEnd < end &&
+                reduceManifolds[reduceOrder[groupEnd]] ==
+                reduceManifolds[reduceOrder[group]])
+            {
+                groupEnd++;
+            }
+            reduceManifold(first, &reduceOrder[group], groupEnd - group,
+                reduceKeep);
+            group = groupEnd;
+        }
+        start = end;
+    }
+
+    // Move the kept contacts up, in order.
+    unsigned kept = 0;
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        if (!reduceKeep[i]) continue;
+        if (kept != i) first[kept] = first[i];
+        kept++;
+    }
+
+    // Give back the space used by the contacts that were dropped.
+    unsigned removed = numContacts - kept;
+    contactsLeft += removed;
+    contactCount -= removed;
+    contacts -= removed;
+}
@@ -0,0 +1,1234 @@
+/*
+ * Implementation file for the terrain collision geometry.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/collide_fine.h>
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+using namespace cyclone;
+
+/*
+ * The start of a saved heightfield. It is followed by the origin
+ * and cell size, then the heights, row by row, all as reals.
+ */
+struct HeightfieldHeader
+{
+    unsigned magic;
+    unsigned version;
+    unsigned realSize;
+    unsigned columns;
+    unsigned rows;
+    unsigned reserved;
+};
+
+// Identifies a heightfield file ("CYHF").
+static const unsigned heightfieldMagic = 0x46485943;
+static const unsigned heightfieldVersion = 1;
+
+CollisionHeightfield::CollisionHeightfield()
+    : columns(0), rows(0), cellSize(1), inverseCellSize(1), heights(NULL)
+{
+}
+
+void CollisionHeightfield::setHeights(unsigned columns, unsigned rows,
+                                      real cellSize, const real *heights)
+{
+    file.close();
+    ownHeights.assign(heights, heights + columns*rows);
+
+    CollisionHeightfield::columns = columns;
+    CollisionHeightfield::rows = rows;
+    CollisionHeightfield::cellSize = cellSize;
+    inverseCellSize = ((real)1.0) / cellSize;
+    CollisionHeightfield::heights = ownHeights.empty() ? NULL : &ownHeights[0];
+}
+
+bool CollisionHeightfield::load(const char *filename)
+{
+    MappedFile loaded;
+    if (!loaded.open(filename)) return false;
+
+    // Check the file is a heightfield we can use, and is complete.
+    size_t start = sizeof(HeightfieldHeader) + 4*sizeof(real);
+    if (loaded.getSize() < start) return false;
+    const HeightfieldHeader *header =
+        (const HeightfieldHeader *)loaded.getData();
+    if (header->magic != heightfieldMagic ||
+        header->version != heightfieldVersion ||
+        header->realSize != sizeof(real) ||
+        header->columns < 2 || header->rows < 2) return false;
+    size_t count = (size_t)header->columns * header->rows;
+    if (loaded.getSize() != start + count*sizeof(real)) return false;
+
+    // Read the origin and spacing, and use the heights in place.
+    const real *values = (const real *)(header + 1);
+    origin = Vector3(values[0], values[1], values[2]);
+    cellSize = values[3];
+    inverseCellSize = ((real)1.0) / cellSize;
+    columns = header->columns;
+    rows = header->rows;
+    heights = values + 4;
+
+    // Hand the mapping over to the heightfield. The address of the
+    // mapping doesn't change when it is handed over.
+    ownHeights.clear();
+    file.close();
+    loaded.swap(file);
+    return true;
+}
+
+bool CollisionHeightfield::save(const char *filename) const
+{
+    FILE *out = fopen(filename, "wb");
+    if (!out) return false;
+
+    HeightfieldHeader header;
+    header.magic = heightfieldMagic;
+    header.version = heightfieldVersion;
+    header.realSize = sizeof(real);
+    header.columns = columns;
+    header.rows = rows;
+    header.reserved = 0;
+    real values[4] = {origin.x, origin.y, origin.z, cellSize};
+    size_t count = (size_t)columns * rows;
+
+    bool written =
+        fwrite(&header, sizeof(header), 1, out) == 1 &&
+        fwrite(values, sizeof(real), 4, out) == 4 &&
+        (count == 0 || fwrite(heights, sizeof(real), count, out) == count);
+    return fclose(out) == 0 && written;
+}
+
+bool CollisionHeightfield::getCells(real minX, real minZ,
+                                    real maxX, real maxZ,
+                                    unsigned *firstColumn,
+                                    unsigned *firstRow,
+                                    unsigned *lastColumn,
+                                    unsigned *lastRow) const
+{
+    if (columns < 2 || rows < 2) return false;
+
+    // Find the cells in grid coordinates, and check they overlap
+    // the grid at all.
+    real startX = floor((minX - origin.x) * inverseCellSize);
+    real startZ = floor((minZ - origin.z) * inverseCellSize);
+    real endX = floor((maxX - origin.x) * inverseCellSize);
+    real endZ = floor((maxZ - origin.z) * inverseCellSize);
+    if (endX < 0 || endZ < 0 ||
+        startX > columns - 2 || startZ > rows - 2) return false;
+
+    *firstColumn = startX < 0 ? 0 : (unsigned)startX;
+    *firstRow = startZ < 0 ? 0 : (unsigned)startZ;
+    *lastColumn = endX > columns - 2 ? columns - 2 : (unsigned)endX;
+    *lastRow = endZ > rows - 2 ? rows - 2 : (unsigned)endZ;
+    return true;
+}
+
+void CollisionHeightfield::getTriangle(unsigned column, unsigned row,
+                                       unsigned half,
+                                       Vector3 corners[3]) const
+{
+    // The corners go anticlockwise seen from above.
+    real x = origin.x + column*cellSize;
+    real z = origin.z + row*cellSize;
+    Vector3 diagonal(x + cellSize,
+        origin.y + getHeight(column + 1, row + 1), z + cellSize);
+    corners[0] = Vector3(x, origin.y + getHeight(column, row), z);
+    if (half == 0)
+    {
+        corners[1] = diagonal;
+        corners[2] = Vector3(x + cellSize,
+            origin.y + getHeight(column + 1, row), z);
+    }
+    else
+    {
+        corners[1] = Vector3(x,
+            origin.y + getHeight(column, row + 1), z + cellSize);
+        corners[2] = diagonal;
+    }
+}
+
+bool CollisionHeightfield::getSurface(real x, real z,
+                                      real *height, Vector3 *normal) const
+{
+    unsigned column, row, lastColumn, lastRow;
+    if (!getCells(x, z, x, z, &column, &row, &lastColumn, &lastRow))
+    {
+        return false;
+    }
+
+    // Find where we are in the cell, checking we are on the grid
+    // (getCells clamps points just past the far edges).
+    real fractionX = (x - origin.x) * inverseCellSize - column;
+    real fractionZ = (z - origin.z) * inverseCellSize - row;
+    if (fractionX > 1 || fractionZ > 1) return false;
+
+    real h00 = getHeight(column, row);
+    real h11 = getHeight(column + 1, row + 1);
+    real alongX, alongZ;
+    if (fractionX >= fractionZ)
+    {
+        // The triangle with the larger x.
+        real h10 = getHeight(column + 1, row);
+        alongX = h10 - h00;
+        alongZ = h11 - h10;
+    }
+    else
+    {
+        real h01 = getHeight(column, row + 1);
+        alongX = h11 - h01;
+        alongZ = h01 - h00;
+    }
+
+    *height = origin.y + h00 + fractionX*alongX + fractionZ*alongZ;
+    *normal = Vector3(-alongX, cellSize, -alongZ);
+    normal->normalise();
+    return true;
+}
+
+/*
+ * Finds the closest point of a triangle to the given point, setting
+ * onFace if it is inside the triangle, rather than on its edge.
+ * This follows Ericson's closest point on a triangle.
+ */
+static Vector3 closestOnTriangle(const Vector3 &point,
+                                 const Vector3 &a,
+                                 const Vector3 &b,
+                                 const Vector3 &c,
+                                 bool *onFace)
+{
+    Vector3 ab = b - a, ac = c - a, ap = point - a;
+    *onFace = false;
+
+    real d1 = ab * ap, d2 = ac * ap;
+    if (d1 <= 0 && d2 <= 0) return a;
+
+    Vector3 bp = point - b;
+    real d3 = ab * bp, d4 = ac * bp;
+    if (d3 >= 0 && d4 <= d3) return b;
+
+    real vc = d1*d4 - d3*d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0)
+    {
+        return a + ab * (d1 / (d1 - d3));
+    }
+
+    Vector3 cp = point - c;
+    real d5 = ab * cp, d6 = ac * cp;
+    if (d6 >= 0 && d5 <= d6) return c;
+
+    real vb = d5*d2 - d1*d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0)
+    {
+        return a + ac * (d2 / (d2 - d6));
+    }
+
+    real va = d3*d6 - d5*d4;
+    if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+    {
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+
+    real denom = 1 / (va + vb + vc);
+    *onFace = true;
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+/*
+ * Finds the contact between a sphere and the front of a triangle
+ * (the side its corners go anticlockwise round), returning false if
+ * there is none. Spheres whose centre is further behind the triangle
+ * than the given depth are ignored.
+ */
+static bool sphereAndTriangle(const Vector3 &centre, real radius,
+                              const Vector3 corners[3], real maxDepth,
+                              Vector3 *normal, Vector3 *point,
+                              real *penetration)
+{
+    Vector3 faceNormal =
+        (corners[1] - corners[0]) % (corners[2] - corners[0]);
+    faceNormal.normalise();
+    real height = faceNormal * (centre - corners[0]);
+    if (height >= radius || height < -maxDepth) return false;
+
+    bool onFace;
+    *point = closestOnTriangle(centre, corners[0], corners[1], corners[2],
+        &onFace);
+
+    // Over the face, we push out along the normal.
+    if (onFace)
+    {
+        *normal = faceNormal;
+        *penetration = radius - height;
+        return true;
+    }
+
+    // Otherwise only the edges can touch, and only from above.
+    if (height <= 0) return false;
+    Vector3 offset = centre - *point;
+    real distance = offset.magnitude();
+    if (distance >= radius || distance <= real_epsilon) return false;
+    *normal = offset * (((real)1.0) / distance);
+    *penetration = radius - distance;
+    return true;
+}
+
+/*
+ * Finds where to write a contact with the given feature, among those
+ * written since first. If one with the same feature (and, if
+ * sameNormal is set, pushing the same way) has been written, it is
+ * returned, unless it is deeper than the new one. Otherwise a new
+ * contact is added. Returns NULL if there is nothing to write, or
+ * no room to write it.
+ */
+static Contact *findContact(CollisionData *data, Contact *first,
+                            unsigned *contactsUsed, unsigned feature,
+                            bool sameNormal, const Vector3 &normal,
+                            real penetration)
+{
+    for (unsigned i = 0; i < *contactsUsed; i++)
+    {
+        if (first[i].feature != feature) continue;
+        if (sameNormal && first[i].contactNormal * normal <= 0.99) continue;
+        if (first[i].penetration >= penetration) return NULL;
+        return &first[i];
+    }
+
+    if (data->contactsLeft <= 0) return NULL;
+    Contact *contact = data->contacts;
+    data->addContacts(1);
+    (*contactsUsed)++;
+    return contact;
+}
+
+/*
+ * Writes a contact found with sphereAndTriangle. A sphere has only
+ * one contact in each direction, so if there is already one this
+ * way, the deeper is kept.
+ */
+static void addSphereContact(CollisionData *data, Contact *first,
+                             unsigned *contactsUsed, unsigned feature,
+                             RigidBody *body, const Vector3 &normal,
+                             const Vector3 &point, real penetration)
+{
+    Contact *contact = findContact(data, first, contactsUsed, feature,
+        true, normal, penetration);
+    if (!contact) return;
+
+    contact->contactNormal = normal;
+    contact->contactPoint = point;
+    contact->penetration = penetration;
+    contact->setBodyData(body, NULL, data->friction, data->restitution);
+    contact->feature = feature;
+}
+
+unsigned CollisionDetector::sphereAndHeightfield(
+    const CollisionSphere &sphere,
+    const CollisionHeightfield &heightfield,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Find the cells under the sphere.
+    Vector3 centre = sphere.getAxis(3);
+    real radius = sphere.radius;
+    unsigned firstColumn, firstRow, lastColumn, lastRow;
+    if (!heightfield.getCells(centre.x - radius, centre.z - radius,
+                              centre.x + radius, centre.z + radius,
+                              &firstColumn, &firstRow,
+                              &lastColumn, &lastRow))
+    {
+        return 0;
+    }
+
+    Contact *first = data->contacts;
+    unsigned contactsUsed = 0;
+    for (unsigned row = firstRow; row <= lastRow; row++)
+    {
+        for (unsigned column = firstColumn; column <= lastColumn; column++)
+        {
+            for (unsigned half = 0; half < 2; half++)
+            {
+                Vector3 corners[3], normal, point;
+                real penetration;
+                heightfield.getTriangle(column, row, half, corners);
+
+                // The terrain pushes up however deep the sphere is.
+                if (sphereAndTriangle(centre, radius, corners, REAL_MAX,
+                                      &normal, &point, &penetration))
+                {
+                    addSphereContact(data, first, &contactsUsed, 0,
+                        sphere.body, normal, point, penetration);
+                }
+            }
+        }
+    }
+    return contactsUsed;
+}
+
+unsigned CollisionDetector::boxAndHeightfield(
+    const CollisionBox &box,
+    const CollisionHeightfield &heightfield,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Go through each combination of + and - for each half-size,
+    // finding the corners of the box and the area they cover.
+    static real mults[8][3] = {{1,1,1},{-1,1,1},{1,-1,1},{-1,-1,1},
+                               {1,1,-1},{-1,1,-1},{1,-1,-1},{-1,-1,-1}};
+    Vector3 vertices[8];
+    Vector3 minimum(REAL_MAX, REAL_MAX, REAL_MAX);
+    Vector3 maximum(-REAL_MAX, -REAL_MAX, -REAL_MAX);
+    for (unsigned i = 0; i < 8; i++)
+    {
+        Vector3 vertexPos(mults[i][0], mults[i][1], mults[i][2]);
+        vertexPos.componentProductUpdate(box.halfSize);
+        vertices[i] = box.transform.transform(vertexPos);
+        for (unsigned j = 0; j < 3; j++)
+        {
+            if (vertices[i][j] < minimum[j]) minimum[j] = vertices[i][j];
+            if (vertices[i][j] > maximum[j]) maximum[j] = vertices[i][j];
+        }
+    }
+
+    unsigned firstColumn, firstRow, lastColumn, lastRow;
+    if (!heightfield.getCells(minimum.x, minimum.z, maximum.x, maximum.z,
+                              &firstColumn, &firstRow,
+                              &lastColumn, &lastRow))
+    {
+        return 0;
+    }
+
+    // Check each corner of the box against the surface below it.
+    Contact* contact = data->contacts;
+    unsigned contactsUsed = 0;
+    for (unsigned i = 0; i < 8; i++)
+    {
+        real height;
+        Vector3 normal;
+        if (!heightfield.getSurface(vertices[i].x, vertices[i].z,
+                                    &height, &normal)) continue;
+
+        // The distance to the surface along its normal.
+        real distance = (vertices[i].y - height) * normal.y;
+        if (distance >= 0) continue;
+
+        // The contact point is halfway between the corner and the
+        // surface.
+        contact->contactPoint =
+            vertices[i] + normal * (distance * (real)-0.5);
+        contact->contactNormal = normal;
+        contact->penetration = -distance;
+        contact->setBodyData(box.body, NULL,
+            data->friction, data->restitution);
+        contact->feature = i;
+
+        contact++;
+        contactsUsed++;
+        if (contactsUsed == (unsigned)data->contactsLeft)
+        {
+            data->addContacts(contactsUsed);
+            return contactsUsed;
+        }
+    }
+
+    // Then check each height under the box, in case the terrain is
+    // poking up into it, pushing the box out along the axis it is
+    // least deep in.
+    for (unsigned row = firstRow; row <= lastRow + 1; row++)
+    {
+        for (unsigned column = firstColumn; column <= lastColumn + 1; column++)
+        {
+            Vector3 point(
+                heightfield.origin.x + column*heightfield.cellSize,
+                heightfield.origin.y + heightfield.getHeight(column, row),
+                heightfield.origin.z + row*heightfield.cellSize);
+            if (point.y < minimum.y || point.y > maximum.y) continue;
+
+            Vector3 relPt = box.transform.transformInverse(point);
+            real depth = REAL_MAX;
+            Vector3 normal;
+            bool inside = true;
+            for (unsigned j = 0; j < 3 && inside; j++)
+            {
+                real axisDepth = box.halfSize[j] - real_abs(relPt[j]);
+                if (axisDepth < 0) inside = false;
+                else if (axisDepth < depth)
+                {
+                    depth = axisDepth;
+                    normal = box.getAxis(j) * ((relPt[j] < 0) ? 1 : -1);
+                }
+            }
+            if (!inside) continue;
+
+            contact->contactPoint = point;
+            contact->contactNormal = normal;
+            contact->penetration = depth;
+            contact->setBodyData(box.body, NULL,
+                data->friction, data->restitution);
+            contact->feature = 8 + row*heightfield.columns + column;
+
+            contact++;
+            contactsUsed++;
+            if (contactsUsed == (unsigned)data->contactsLeft)
+            {
+                data->addContacts(contactsUsed);
+                return contactsUsed;
+            }
+        }
+    }
+
+    data->addContacts(contactsUsed);
+    return contactsUsed;
+}
+
+/*
+ * The start of a saved triangle mesh. It is followed by the nodes,
+ * then the vertices, then the triangles, as they are held in memory.
+ */
+struct TriangleMeshHeader
+{
+    unsigned magic;
+    unsigned version;
+    unsigned realSize;
+    unsigned nodeSize;
+    unsigned numNodes;
+    unsigned numVertices;
+    unsigned numTriangles;
+    unsigned reserved;
+};
+
+// Identifies a triangle mesh file ("CYTM").
+static const unsigned triangleMeshMagic = 0x4d545943;
+static const unsigned triangleMeshVersion = 1;
+
+// The most triangles the builder puts in a leaf.
+static const unsigned meshLeafSize = 4;
+
+// The deepest a mesh can be walked without allocating. Meshes built
+// here are split at the median, so this is far more than any of them
+// needs; deeper trees (from a file written elsewhere) spill onto the
+// heap.
+static const unsigned meshStackSize = 64;
+
+/*
+ * Orders triangles by the position of their centre along one axis.
+ */
+struct TriangleCentreLess
+{
+    const real *centres;
+    unsigned axis;
+
+    bool operator()(unsigned one, unsigned two) const
+    {
+        return centres[one*3 + axis] < centres[two*3 + axis];
+    }
+};
+
+/*
+ * Adds the node holding the given range of triangles to the
+ * hierarchy, followed by the nodes below it, splitting the
+ * triangles at the median of their centres along the axis they are
+ * most spread out on.
+ */
+static void buildMeshNode(std::vector<CollisionTriangleMesh::Node> &nodes,
+                          std::vector<unsigned> &order,
+                          const std::vector<real> &bounds,
+                          const std::vector<real> &centres,
+                          unsigned start, unsigned end)
+{
+    unsigned index = (unsigned)nodes.size();
+    nodes.push_back(CollisionTriangleMesh::Node());
+
+    // Find the bounds of the triangles, and of their centres.
+    real minimum[3], maximum[3], centreMinimum[3], centreMaximum[3];
+    for (unsigned j = 0; j < 3; j++)
+    {
+        minimum[j] = centreMinimum[j] = REAL_MAX;
+        maximum[j] = centreMaximum[j] = -REAL_MAX;
+    }
+    for (unsigned i = start; i < end; i++)
+    {
+        const real *triangleBounds = &bounds[order[i]*6];
+        const real *centre = &centres[order[i]*3];
+        for (unsigned j = 0; j < 3; j++)
+        {
+            if (triangleBounds[j] < minimum[j]) minimum[j] = triangleBounds[j];
+            if (triangleBounds[j+3] > maximum[j]) maximum[j] = triangleBounds[j+3];
+            if (centre[j] < centreMinimum[j]) centreMinimum[j] = centre[j];
+            if (centre[j] > centreMaximum[j]) centreMaximum[j] = centre[j];
+        }
+    }
+    for (unsigned j = 0; j < 3; j++)
+    {
+        nodes[index].minimum[j] = minimum[j];
+        nodes[index].maximum[j] = maximum[j];
+    }
+
+    if (end - start <= meshLeafSize)
+    {
+        nodes[index].first = start;
+        nodes[index].count = end - start;
+        return;
+    }
+
+    // Split at the median along the widest axis.
+    TriangleCentreLess less;
+    less.centres = &centres[0];
+    less.axis = 0;
+    for (unsigned j = 1; j < 3; j++)
+    {
+        if (centreMaximum[j] - centreMinimum[j] >
+            centreMaximum[less.axis] - centreMinimum[less.axis])
+        {
+            less.axis = j;
+        }
+    }
+    unsigned middle = start + (end - start) / 2;
+    std::nth_element(order.begin() + start, order.begin() + middle,
+        order.begin() + end, less);
+
+    // The first child follows this node, so we only need to record
+    // where the second starts.
+    buildMeshNode(nodes, order, bounds, centres, start, middle);
+    nodes[index].first = (unsigned)nodes.size();
+    nodes[index].count = 0;
+    buildMeshNode(nodes, order, bounds, centres, middle, end);
+}
+
+CollisionTriangleMesh::CollisionTriangleMesh()
+    : numNodes(0), numVertices(0), numTriangles(0),
+      nodes(NULL), vertices(NULL), triangles(NULL)
+{
+}
+
+void CollisionTriangleMesh::build(const Vector3 *vertices,
+                                  unsigned numVertices,
+                                  const unsigned *indices,
+                                  unsigned numTriangles)
+{
+    file.close();
+
+    ownVertices.resize(numVertices*3);
+    for (unsigned i = 0; i < numVertices; i++)
+    {
+        ownVertices[i*3] = vertices[i].x;
+        ownVertices[i*3 + 1] = vertices[i].y;
+        ownVertices[i*3 + 2] = vertices[i].z;
+    }
+
+    // Find the bounds and centre of each triangle.
+    std::vector<real> bounds(numTriangles*6);
+    std::vector<real> centres(numTriangles*3);
+    std::vector<unsigned> order(numTriangles);
+    for (unsigned i = 0; i < numTriangles; i++)
+    {
+        order[i] = i;
+        for (unsigned j = 0; j < 3; j++)
+        {
+            real a = vertices[indices[i*3]][j];
+            real b = vertices[indices[i*3 + 1]][j];
+            real c = vertices[indices[i*3 + 2]][j];
+            bounds[i*6 + j] = a < b ? (a < c ? a : c) : (b < c ? b : c);
+            bounds[i*6 + j + 3] = a > b ? (a > c ? a : c) : (b > c ? b : c);
+            centres[i*3 + j] = (a + b + c) * ((real)1.0 / 3);
+        }
+    }
+
+    ownNodes.clear();
+    if (numTriangles > 0)
+    {
+        ownNodes.reserve(2 * (numTriangles / meshLeafSize + 1));
+        buildMeshNode(ownNodes, order, bounds, centres, 0, numTriangles);
+    }
+
+    // Store the triangles in the order of the leaves.
+    ownTriangles.resize(numTriangles*3);
+    for (unsigned i = 0; i < numTriangles; i++)
+    {
+        for (unsigned j = 0; j < 3; j++)
+        {
+            ownTriangles[i*3 + j] = indices[order[i]*3 + j];
+        }
+    }
+
+    CollisionTriangleMesh::numNodes = (unsigned)ownNodes.size();
+    CollisionTriangleMesh::numVertices = numVertices;
+    CollisionTriangleMesh::numTriangles = numTriangles;
+    CollisionTriangleMesh::nodes = ownNodes.empty() ? NULL : &ownNodes[0];
+    CollisionTriangleMesh::vertices =
+        ownVertices.empty() ? NULL : &ownVertices[0];
+    CollisionTriangleMesh::triangles =
+        ownTriangles.empty() ? NULL : &ownTriangles[0];
+}
+
+bool CollisionTriangleMesh::load(const char *filename)
+{
+    MappedFile loaded;
+    if (!loaded.open(filename)) return false;
+
+    // Check the file is a mesh we can use, and is complete.
+    if (loaded.getSize() < sizeof(TriangleMeshHeader)) return false;
+    const TriangleMeshHeader *header =
+        (const TriangleMeshHeader *)loaded.getData();
+    if (header->magic != triangleMeshMagic ||
+        header->version != triangleMeshVersion ||
+        header->realSize != sizeof(real) ||
+        header->nodeSize != sizeof(Node)) return false;
+    size_t nodeBytes = (size_t)header->numNodes * sizeof(Node);
+    size_t vertexBytes = (size_t)header->numVertices * 3 * sizeof(real);
+    size_t triangleBytes = (size_t)header->numTriangles * 3 * sizeof(unsigned);
+    if (loaded.getSize() != sizeof(TriangleMeshHeader) +
+        nodeBytes + vertexBytes + triangleBytes) return false;
+
+    // Use the arrays in place.
+    const char *start = (const char *)(header + 1);
+    numNodes = header->numNodes;
+    numVertices = header->numVertices;
+    numTriangles = header->numTriangles;
+    nodes = numNodes ? (const Node *)start : NULL;
+    vertices = numVertices ? (const real *)(start + nodeBytes) : NULL;
+    triangles = numTriangles ?
+        (const unsigned *)(start + nodeBytes + vertexBytes) : NULL;
+
+    // Hand the mapping over to the mesh, as for heightfields.
+    ownNodes.clear();
+    ownVertices.clear();
+    ownTriangles.clear();
+    file.close();
+    loaded.swap(file);
+    return true;
+}
+
+bool CollisionTriangleMesh::save(const char *filename) const
+{
+    FILE *out = fopen(filename, "wb");
+    if (!out) return false;
+
+    TriangleMeshHeader header;
+    header.magic = triangleMeshMagic;
+    header.version = triangleMeshVersion;
+    header.realSize = sizeof(real);
+    header.nodeSize = sizeof(Node);
+    header.numNodes = numNodes;
+    header.numVertices = numVertices;
+    header.numTriangles = numTriangles;
+    header.reserved = 0;
+    size_t vertexCount = (size_t)numVertices * 3;
+    size_t triangleCount = (size_t)numTriangles * 3;
+
+    bool written =
+        fwrite(&header, sizeof(header), 1, out) == 1 &&
+        (numNodes == 0 ||
+         fwrite(nodes, sizeof(Node), numNodes, out) == numNodes) &&
+        (vertexCount == 0 ||
+         fwrite(vertices, sizeof(real), vertexCount, out) == vertexCount) &&
+        (triangleCount == 0 ||
+         fwrite(triangles, sizeof(unsigned), triangleCount, out) ==
+            triangleCount);
+    return fclose(out) == 0 && written;
+}
+
+void CollisionTriangleMesh::getTriangle(unsigned triangle,
+                                        Vector3 corners[3]) const
+{
+    for (unsigned i = 0; i < 3; i++)
+    {
+        const real *vertex = vertices + triangles[triangle*3 + i]*3;
+        corners[i] = Vector3(vertex[0], vertex[1], vertex[2]);
+    }
+}
+
+template <class Visitor>
+void CollisionTriangleMesh::visitTriangles(const Vector3 &minimum,
+                                           const Vector3 &maximum,
+                                           Visitor &visitor) const
+{
+    if (numNodes == 0) return;
+
+    real low[3] = {minimum.x, minimum.y, minimum.z};
+    real high[3] = {maximum.x, maximum.y, maximum.z};
+
+    unsigned stack[meshStackSize];
+    unsigned stackSize = 0;
+    std::vector<unsigned> overflow;
+    unsigned index = 0;
+    for (;;)
+    {
+        const Node &node = nodes[index];
+        bool overlap =
+            node.minimum[0] <= high[0] && node.maximum[0] >= low[0] &&
+            node.minimum[1] <= high[1] && node.maximum[1] >= low[1] &&
+            node.minimum[2] <= high[2] && node.maximum[2] >= low[2];
+
+        if (overlap && node.count == 0)
+        {
+            // Go down to the first child, coming back for the second.
+            if (stackSize < meshStackSize) stack[stackSize++] = node.first;
+            else overflow.push_back(node.first);
+            index++;
+            continue;
+        }
+
+        if (overlap)
+        {
+            for (unsigned i = node.first; i < node.first + node.count; i++)
+            {
+                const unsigned *triangle = triangles + i*3;
+                const real *a = vertices + triangle[0]*3;
+                const real *b = vertices + triangle[1]*3;
+                const real *c = vertices + triangle[2]*3;
+                bool inside = true;
+                for (unsigned j = 0; j < 3 && inside; j++)
+                {
+                    if ((a[j] < low[j] && b[j] < low[j] && c[j] < low[j]) ||
+                        (a[j] > high[j] && b[j] > high[j] && c[j] > high[j]))
+                    {
+                        inside = false;
+                    }
+                }
+                if (inside && !visitor(i)) return;
+            }
+        }
+
+        // Anything that spilled was pushed last, so comes back first.
+        if (!overflow.empty())
+        {
+            index = overflow.back();
+            overflow.pop_back();
+        }
+        else if (stackSize > 0) index = stack[--stackSize];
+        else return;
+    }
+}
+
+/*
+ * Gathers the triangles found by visitTriangles into a list.
+ */
+struct TriangleGatherer
+{
+    std::vector<unsigned> *triangles;
+
+    bool operator()(unsigned triangle)
+    {
+        triangles->push_back(triangle);
+        return true;
+    }
+};
+
+void CollisionTriangleMesh::getTriangles(const Vector3 &minimum,
+                                         const Vector3 &maximum,
+                                         std::vector<unsigned> &triangles) const
+{
+    TriangleGatherer gatherer;
+    gatherer.triangles = &triangles;
+    visitTriangles(minimum, maximum, gatherer);
+}
+
+/*
+ * Shared state for the visitors used by the triangle mesh tests,
+ * each of which writes contacts from the given first one.
+ */
+struct MeshContactVisitor
+{
+    const CollisionTriangleMesh *mesh;
+    CollisionData *data;
+    Contact *first;
+    unsigned contactsUsed;
+
+    MeshContactVisitor(const CollisionTriangleMesh &mesh,
+                       CollisionData *data)
+        : mesh(&mesh), data(data), first(data->contacts), contactsUsed(0)
+    {
+    }
+
+    /* Returns true while there is room for more contacts. */
+    bool hasRoom() const
+    {
+        return data->contactsLeft > 0;
+    }
+};
+
+/*
+ * Collides a sphere with each triangle it visits.
+ */
+struct SphereMeshVisitor : public MeshContactVisitor
+{
+    Vector3 centre;
+    real radius;
+    RigidBody *body;
+    unsigned feature;
+
+    SphereMeshVisitor(const CollisionTriangleMesh &mesh, CollisionData *data)
+        : MeshContactVisitor(mesh, data)
+    {
+    }
+
+    bool operator()(unsigned triangle)
+    {
+        Vector3 corners[3], normal, point;
+        real penetration;
+        mesh->getTriangle(triangle, corners);
+
+        // Spheres more than halfway through a triangle are taken to
+        // be behind it, since triangles are one-sided.
+        if (sphereAndTriangle(centre, radius, corners, radius,
+                              &normal, &point, &penetration))
+        {
+            addSphereContact(data, first, &contactsUsed, feature,
+                body, normal, point, penetration);
+        }
+        return hasRoom();
+    }
+};
+
+unsigned CollisionDetector::sphereAndTriangleMesh(
+    const CollisionSphere &sphere,
+    const CollisionTriangleMesh &mesh,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    SphereMeshVisitor visitor(mesh, data);
+    visitor.centre = sphere.getAxis(3);
+    visitor.radius = sphere.radius;
+    visitor.body = sphere.body;
+    visitor.feature = 0;
+
+    Vector3 extent(sphere.radius, sphere.radius, sphere.radius);
+    mesh.visitTriangles(visitor.centre - extent, visitor.centre + extent,
+        visitor);
+    return visitor.contactsUsed;
+}
+
+/*
+ * Collides a box with each triangle it visits.
+ */
+struct BoxMeshVisitor : public MeshContactVisitor
+{
+    const CollisionBox *box;
+    Vector3 centre;
+    Vector3 axes[3];
+    Vector3 boxVertices[8];
+
+    BoxMeshVisitor(const CollisionTriangleMesh &mesh, CollisionData *data)
+        : MeshContactVisitor(mesh, data)
+    {
+    }
+
+    /*
+     * Finds the depth of the given point (in the box's coordinates)
+     * inside the box, and the normal pushing the box out along the
+     * axis it is least deep in. Returns false if it is outside.
+     */
+    bool pointDepth(const Vector3 &relPt, Vector3 *normal,
+                    real *depth) const
+    {
+        *depth = REAL_MAX;
+        for (unsigned j = 0; j < 3; j++)
+        {
+            real axisDepth = box->halfSize[j] - real_abs(relPt[j]);
+            if (axisDepth < 0) return false;
+            if (axisDepth < *depth)
+            {
+                *depth = axisDepth;
+                *normal = axes[j] * ((relPt[j] < 0) ? 1 : -1);
+            }
+        }
+        return true;
+    }
+
+    /* Writes a contact, if it is the deepest for its feature. */
+    void addContact(unsigned feature, bool sameNormal,
+                    const Vector3 &normal, const Vector3 &point,
+                    real penetration)
+    {
+        Contact *contact = findContact(data, first, &contactsUsed,
+            feature, sameNormal, normal, penetration);
+        if (!contact) return;
+
+        contact->contactNormal = normal;
+        contact->contactPoint = point;
+        contact->penetration = penetration;
+        contact->setBodyData(box->body, NULL,
+            data->friction, data->restitution);
+        contact->feature = feature;
+    }
+
+    bool operator()(unsigned triangle)
+    {
+        Vector3 corners[3];
+        mesh->getTriangle(triangle, corners);
+        Vector3 normal = (corners[1] - corners[0]) % (corners[2] - corners[0]);
+        normal.normalise();
+
+        // Only boxes whose centre is in front of the triangle, and
+        // which reach through it, are tested.
+        real centreHeight = normal * (centre - corners[0]);
+        real reach =
+            box->halfSize.x * real_abs(normal * axes[0]) +
+            box->halfSize.y * real_abs(normal * axes[1]) +
+            box->halfSize.z * real_abs(normal * axes[2]);
+        if (centreHeight < 0 || centreHeight >= reach) return true;
+
+        // Check each corner of the box behind the triangle, and over
+        // it, pushing out along the normal. The contact point is
+        // halfway between the corner and the face.
+        Vector3 edges[3] = {
+            corners[1] - corners[0],
+            corners[2] - corners[1],
+            corners[0] - corners[2]
+        };
+        for (unsigned i = 0; i < 8; i++)
+        {
+            real height = normal * (boxVertices[i] - corners[0]);
+            if (height >= 0) continue;
+
+            bool over = true;
+            for (unsigned j = 0; j < 3 && over; j++)
+            {
+                if ((edges[j] % (boxVertices[i] - corners[j])) * normal < 0)
+                {
+                    over = false;
+                }
+            }
+            if (!over) continue;
+
+            addContact(i, true, normal,
+                boxVertices[i] - normal * (height * (real)0.5), -height);
+            if (!hasRoom()) return false;
+        }
+
+        // Then check each corner of the triangle inside the box,
+        // pushing the box out along the axis it is least deep in.
+        Vector3 relCorners[3];
+        for (unsigned i = 0; i < 3; i++)
+        {
+            relCorners[i] = box->getTransform().transformInverse(corners[i]);
+
+            Vector3 pushNormal;
+            real depth;
+            if (!pointDepth(relCorners[i], &pushNormal, &depth)) continue;
+
+            addContact(8 + mesh->getVertexIndex(triangle, i), false,
+                pushNormal, corners[i], depth);
+            if (!hasRoom()) return false;
+        }
+
+        // Finally check each edge of the triangle that passes right
+        // through the box, such as a ridge the box is resting on,
+        // using the middle of the part of the edge inside the box.
+        for (unsigned i = 0; i < 3; i++)
+        {
+            const Vector3 &start = relCorners[i];
+            Vector3 direction = relCorners[(i+1)%3] - start;
+            real entry = 0, exit = 1;
+            for (unsigned j = 0; j < 3 && entry <= exit; j++)
+            {
+                real size = box->halfSize[j];
+                if (real_abs(direction[j]) <= real_epsilon)
+                {
+                    if (real_abs(start[j]) > size) exit = -1;
+                    continue;
+                }
+                real one = (-size - start[j]) / direction[j];
+                real two = (size - start[j]) / direction[j];
+                if (one > two) { real swap = one; one = two; two = swap; }
+                if (one > entry) entry = one;
+                if (two < exit) exit = two;
+            }
+            if (entry <= 0 || exit >= 1 || entry > exit) continue;
+
+            real middle = (entry + exit) * (real)0.5;
+            Vector3 pushNormal;
+            real depth;
+            if (!pointDepth(start + direction * middle, &pushNormal, &depth))
+            {
+                continue;
+            }
+
+            Vector3 point = corners[i] +
+                (corners[(i+1)%3] - corners[i]) * middle;
+            addContact(8 + mesh->getVertexCount() + triangle*3 + i, false,
+                pushNormal, point, depth);
+            if (!hasRoom()) return false;
+        }
+        return true;
+    }
+};
+
+unsigned CollisionDetector::boxAndTriangleMesh(
+    const CollisionBox &box,
+    const CollisionTriangleMesh &mesh,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    BoxMeshVisitor visitor(mesh, data);
+    visitor.box = &box;
+    visitor.centre = box.getAxis(3);
+    for (unsigned i = 0; i < 3; i++) visitor.axes[i] = box.getAxis(i);
+
+    // Find the corners of the box, and the area they cover.
+    static real mults[8][3] = {{1,1,1},{-1,1,1},{1,-1,1},{-1,-1,1},
+                               {1,1,-1},{-1,1,-1},{1,-1,-1},{-1,-1,-1}};
+    Vector3 minimum(REAL_MAX, REAL_MAX, REAL_MAX);
+    Vector3 maximum(-REAL_MAX, -REAL_MAX, -REAL_MAX);
+    for (unsigned i = 0; i < 8; i++)
+    {
+        Vector3 vertexPos(mults[i][0], mults[i][1], mults[i][2]);
+        vertexPos.componentProductUpdate(box.halfSize);
+        visitor.boxVertices[i] = box.transform.transform(vertexPos);
+        for (unsigned j = 0; j < 3; j++)
+        {
+            real value = visitor.boxVertices[i][j];
+            if (value < minimum[j]) minimum[j] = value;
+            if (value > maximum[j]) maximum[j] = value;
+        }
+    }
+
+    mesh.visitTriangles(minimum, maximum, visitor);
+    return visitor.contactsUsed;
+}
+
+/*
+ * Collides the middle of a capsule with each triangle it visits,
+ * where it lies across an edge or corner of the triangle. The ends
+ * are tested as spheres.
+ */
+struct CapsuleMeshVisitor : public MeshContactVisitor
+{
+    Vector3 start;
+    Vector3 end;
+    real radius;
+    RigidBody *body;
+
+    CapsuleMeshVisitor(const CollisionTriangleMesh &mesh, CollisionData *data)
+        : MeshContactVisitor(mesh, data)
+    {
+    }
+
+    /*
+     * Adds a contact between the capsule at the given point on its
+     * segment and the given point on the triangle, if they are close
+     * enough and the capsule is in front.
+     */
+    void addContact(const Vector3 &onCapsule, const Vector3 &onTriangle,
+                    const Vector3 &faceNormal, const Vector3 &faceCorner)
+    {
+        if (faceNormal * (onCapsule - faceCorner) <= 0) return;
+
+        Vector3 offset = onCapsule - onTriangle;
+        real distance = offset.magnitude();
+        if (distance >= radius || distance <= real_epsilon) return;
+        Vector3 normal = offset * (((real)1.0) / distance);
+        addSphereContact(data, first, &contactsUsed, 2, body,
+            normal, onTriangle, radius - distance);
+    }
+
+    bool operator()(unsigned triangle)
+    {
+        Vector3 corners[3];
+        mesh->getTriangle(triangle, corners);
+        Vector3 faceNormal =
+            (corners[1] - corners[0]) % (corners[2] - corners[0]);
+        faceNormal.normalise();
+
+        Vector3 axis = end - start;
+        real axisSquared = axis.squareMagnitude();
+        if (axisSquared <= real_epsilon) return true;
+
+        for (unsigned i = 0; i < 3; i++)
+        {
+            // The corner, if it is nearest the middle of the segment.
+            real s = (axis * (corners[i] - start)) / axisSquared;
+            if (s > 0 && s < 1)
+            {
+                addContact(start + axis * s, corners[i],
+                    faceNormal, corners[0]);
+            }
+
+            // The edge, if the nearest points between the lines lie
+            // in the middle of both.
+            Vector3 edge = corners[(i+1)%3] - corners[i];
+            Vector3 offset = start - corners[i];
+            real axisEdge = axis * edge;
+            real edgeSquared = edge.squareMagnitude();
+            real denom = axisSquared * edgeSquared - axisEdge * axisEdge;
+            if (denom <= real_epsilon) continue;
+            real axisOffset = axis * offset;
+            real edgeOffset = edge * offset;
+            s = (axisEdge * edgeOffset - axisOffset * edgeSquared) / denom;
+            real t = (axisSquared * edgeOffset - axisEdge * axisOffset) / denom;
+            if (s > 0 && s < 1 && t > 0 && t < 1)
+            {
+                addContact(start + axis * s, corners[i] + edge * t,
+                    faceNormal, corners[0]);
+            }
+        }
+        return hasRoom();
+    }
+};
+
+unsigned CollisionDetector::capsuleAndTriangleMesh(
+    const CollisionCapsule &capsule,
+    const CollisionTriangleMesh &mesh,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 ends[2] = {capsule.getEnd(0), capsule.getEnd(1)};
+    Vector3 extent(capsule.radius, capsule.radius, capsule.radius);
+    Vector3 minimum = ends[0], maximum = ends[0];
+    for (unsigned j = 0; j < 3; j++)
+    {
+        if (ends[1][j] < minimum[j]) minimum[j] = ends[1][j];
+        if (ends[1][j] > maximum[j]) maximum[j] = ends[1][j];
+    }
+    minimum -= extent;
+    maximum += extent;
+
+    // Each end is a sphere, with its own feature.
+    SphereMeshVisitor sphere(mesh, data);
+    sphere.radius = capsule.radius;
+    sphere.body = capsule.body;
+    for (unsigned i = 0; i < 2 && sphere.hasRoom(); i++)
+    {
+        sphere.centre = ends[i];
+        sphere.feature = i;
+        mesh.visitTriangles(ends[i] - extent, ends[i] + extent, sphere);
+    }
+    unsigned contactsUsed = sphere.contactsUsed;
+
+    // Then the middle.
+    if (data->contactsLeft <= 0) return contactsUsed;
+    CapsuleMeshVisitor middle(mesh, data);
+    middle.start = ends[0];
+    middle.end = ends[1];
+    middle.radius = capsule.radius;
+    middle.body = capsule.body;
+    mesh.visitTriangles(minimum, maximum, middle);
+    return contactsUsed + middle.contactsUsed;
+}
@@ -13,6 +13,9 @@
 #include <cyclone/contacts.h>
 #include <memory.h>
 #include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
 
 using namespace cyclone;
 
@@ -25,6 +28,7 @@ void Contact::setBodyData(RigidBody* one, RigidBody *two,
     Contact::body[1] = two;
     Contact::friction = friction;
     Contact::restitution = restitution;
+    Contact::feature = 0;
 }
 
 void Contact::matchAwakeState()
@@ -202,31 +206,41 @@ void Contact::calculateInternals(real duration)
 
     // Calculate the desired change in velocity for resolution
     calculateDesiredDeltaVelocity(duration);
+
+    calculateEffectiveMass();
 }
 
-void Contact::applyVelocityChange(Vector3 velocityChange[2],
-                                  Vector3 rotationChange[2])
+void Contact::calculateEffectiveMass()
 {
-    // Get hold of the inverse mass and inverse inertia tensor, both in
-    // world coordinates.
-    Matrix3 inverseInertiaTensor[2];
+    // Find the inverse inertia tensors and the contact's effective
+    // mass once, since the contact may be resolved many times.
     body[0]->getInverseInertiaTensorWorld(&inverseInertiaTensor[0]);
     if (body[1])
         body[1]->getInverseInertiaTensorWorld(&inverseInertiaTensor[1]);
 
+    velocityPerImpulse = calculateVelocityPerImpulse();
+    if (friction != (real)0.0)
+    {
+        impulsePerVelocity.setInverse(velocityPerImpulse);
+    }
+}
+
+void Contact::applyVelocityChange(Vector3 velocityChange[2],
+                                  Vector3 rotationChange[2])
+{
     // We will calculate the impulse for each contact axis
     Vector3 impulseContact;
 
     if (friction == (real)0.0)
     {
         // Use the short format for frictionless contacts
-        impulseContact = calculateFrictionlessImpulse(inverseInertiaTensor);
+        impulseContact = calculateFrictionlessImpulse();
     }
     else
     {
         // Otherwise we may have impulses that aren't in the direction of the
         // contact, so we need the more complex version.
-        impulseContact = calculateFrictionImpulse(inverseInertiaTensor);
+        impulseContact = calculateFrictionImpulse();
     }
 
     // Convert impulse to world coordinates
@@ -257,49 +271,20 @@ void Contact::applyVelocityChange(Vector3 velocityChange[2],
 }
 
 inline
-Vector3 Contact::calculateFrictionlessImpulse(Matrix3 * inverseInertiaTensor)
+Vector3 Contact::calculateFrictionlessImpulse()
 {
     Vector3 impulseContact;
 
-    // Build a vector that shows the change in velocity in
-    // world space for a unit impulse in the direction of the contact
-    // normal.
-    Vector3 deltaVelWorld = relativeContactPosition[0] % contactNormal;
-    deltaVelWorld = inverseInertiaTensor[0].transform(deltaVelWorld);
-    deltaVelWorld = deltaVelWorld % relativeContactPosition[0];
-
-    // Work out the change in velocity in contact coordiantes.
-    real deltaVelocity = deltaVelWorld * contactNormal;
-
-    // Add the linear component of velocity change
-    deltaVelocity += body[0]->getInverseMass();
-
-    // Check if we need to the second body's data
-    if (body[1])
-    {
-        // Go through the same transformation sequence again
-        Vector3 deltaVelWorld = relativeContactPosition[1] % contactNormal;
-        deltaVelWorld = inverseInertiaTensor[1].transform(deltaVelWorld);
-        deltaVelWorld = deltaVelWorld % relativeContactPosition[1];
-
-        // Add the change in velocity due to rotation
-        deltaVelocity += deltaVelWorld * contactNormal;
-
-        // Add the change in velocity due to linear motion
-        deltaVelocity += body[1]->getInverseMass();
-    }
-
-    // Calculate the required size of the impulse
-    impulseContact.x = desiredDeltaVelocity / deltaVelocity;
+    // The change in velocity along the normal for a unit impulse
+    // along the normal was found in calculateInternals.
+    impulseContact.x = desiredDeltaVelocity / velocityPerImpulse.data[0];
     impulseContact.y = 0;
     impulseContact.z = 0;
     return impulseContact;
 }
 
-inline
-Vector3 Contact::calculateFrictionImpulse(Matrix3 * inverseInertiaTensor)
+Matrix3 Contact::calculateVelocityPerImpulse()
 {
-    Vector3 impulseContact;
     real inverseMass = body[0]->getInverseMass();
 
     // The equivalent of a cross product in matrices is multiplication
@@ -344,8 +329,17 @@ Vector3 Contact::calculateFrictionImpulse(Matrix3 * inverseInertiaTensor)
     deltaVelocity.data[4] += inverseMass;
     deltaVelocity.data[8] += inverseMass;
 
-    // Invert to get the impulse needed per unit velocity
-    Matrix3 impulseMatrix = deltaVelocity.inverse();
+    return deltaVelocity;
+}
+
+inline
+Vector3 Contact::calculateFrictionImpulse()
+{
+    Vector3 impulseContact;
+
+    // The change in velocity per unit impulse in contact coordinates,
+    // and its inverse, were found in calculateInternals.
+    const Matrix3 &deltaVelocity = velocityPerImpulse;
 
     // Find the target velocities to kill
     Vector3 velKill(desiredDeltaVelocity,
@@ -353,7 +347,7 @@ Vector3 Contact::calculateFrictionImpulse(Matrix3 * inverseInertiaTensor)
         -contactVelocity.z);
 
     // Find the impulse to kill target velocities
-    impulseContact = impulseMatrix.transform(velKill);
+    impulseContact = impulsePerVelocity.transform(velKill);
 
     // Check for exceeding friction
     real planarImpulse = real_sqrt(
@@ -376,6 +370,177 @@ Vector3 Contact::calculateFrictionImpulse(Matrix3 * inverseInertiaTensor)
     return impulseContact;
 }
 
+Vector3 Contact::calculateRelativeVelocity() const
+{
+    Vector3 velocity = body[0]->getRotation() % relativeContactPosition[0];
+    velocity += body[0]->getVelocity();
+
+    if (body[1])
+    {
+        velocity -= body[1]->getRotation() % relativeContactPosition[1];
+        velocity -= body[1]->getVelocity();
+    }
+
+    return contactToWorld.transformTranspose(velocity);
+}
+
+void Contact::prepareSequentialImpulse()
+{
+    // Along the normal we aim for the desired change in velocity. The
+    // contact velocity's planar part includes the velocity built up by
+    // this frame's acceleration, which friction should also remove, so
+    // in the plane we aim for the current velocity less the contact
+    // velocity.
+    targetVelocity = calculateRelativeVelocity() - contactVelocity;
+    targetVelocity.x = contactVelocity.x + desiredDeltaVelocity;
+}
+
+void Contact::applyWarmStart()
+{
+    if (accumulatedImpulse.x <= 0)
+    {
+        accumulatedImpulse.clear();
+        return;
+    }
+
+    matchAwakeState();
+    applyContactImpulse(accumulatedImpulse);
+}
+
+void Contact::applyContactImpulse(const Vector3 &impulseContact)
+{
+    // Convert impulse to world coordinates
+    Vector3 impulse = contactToWorld.transform(impulseContact);
+
+    // Apply the linear and rotational components to each body. Bodies
+    // with infinite mass are left alone, so contacts resolved at the
+    // same time (see ContactResolver) never write to a shared body.
+    if (body[0]->getInverseMass() > 0)
+    {
+        Vector3 impulsiveTorque = relativeContactPosition[0] % impulse;
+        body[0]->addVelocity(impulse * body[0]->getInverseMass());
+        body[0]->addRotation(
+            inverseInertiaTensor[0].transform(impulsiveTorque));
+    }
+
+    if (body[1] && body[1]->getInverseMass() > 0)
+    {
+        Vector3 impulsiveTorque;
+        impulsiveTorque = impulse % relativeContactPosition[1];
+        body[1]->addVelocity(impulse * -body[1]->getInverseMass());
+        body[1]->addRotation(
+            inverseInertiaTensor[1].transform(impulsiveTorque));
+    }
+}
+
+real Contact::applySequentialImpulse()
+{
+    // Find the normal impulse needed to reach the target velocity,
+    // and clamp the total so the contact only ever pushes.
+    Vector3 velocity = calculateRelativeVelocity();
+    real normalError = targetVelocity.x - velocity.x;
+    real previous = accumulatedImpulse.x;
+    accumulatedImpulse.x += normalError / velocityPerImpulse.data[0];
+    if (accumulatedImpulse.x < 0) accumulatedImpulse.x = 0;
+
+    Vector3 impulseContact(accumulatedImpulse.x - previous, 0, 0);
+    real largestChange = real_abs(impulseContact.x * velocityPerImpulse.data[0]);
+
+    if (friction != (real)0.0)
+    {
+        // Account for the normal impulse's effect on the planar
+        // velocity, then find the impulse to remove the planar
+        // velocity along each friction direction separately.
+        velocity.y += velocityPerImpulse.data[3] * impulseContact.x;
+        velocity.z += velocityPerImpulse.data[6] * impulseContact.x;
+
+        real limit = friction * accumulatedImpulse.x;
+        for (unsigned axis = 1; axis < 3; axis++)
+        {
+            real error = targetVelocity[axis] - velocity[axis];
+            real before = accumulatedImpulse[axis];
+            real total = before + error / velocityPerImpulse.data[axis*4];
+
+            // Clamp the total to the friction pyramid.
+            if (total > limit) total = limit;
+            else if (total < -limit) total = -limit;
+
+            accumulatedImpulse[axis] = total;
+            impulseContact[axis] = total - before;
+
+            real change = real_abs(
+                impulseContact[axis] * velocityPerImpulse.data[axis*4]);
+            if (change > largestChange) largestChange = change;
+
+            // The first friction impulse also moves the second
+            // friction direction.
+            if (axis == 1)
+            {
+                velocity.z += velocityPerImpulse.data[7] * impulseContact.y;
+            }
+        }
+    }
+
+    if (impulseContact.x != 0 || impulseContact.y != 0 || impulseContact.z != 0)
+    {
+        matchAwakeState();
+        applyContactImpulse(impulseContact);
+    }
+    return largestChange;
+}
+
+real Contact::calculatePseudoVelocity(const Vector3 *linear,
+                                      const Vector3 *angular,
+                                      const unsigned *bodyNumber) const
+{
+    Vector3 velocity;
+    if (body[0]->getInverseMass() > 0)
+    {
+        velocity += angular[bodyNumber[0]] % relativeContactPosition[0];
+        velocity += linear[bodyNumber[0]];
+    }
+    if (body[1] && body[1]->getInverseMass() > 0)
+    {
+        velocity -= angular[bodyNumber[1]] % relativeContactPosition[1];
+        velocity -= linear[bodyNumber[1]];
+    }
+    return velocity * contactNormal;
+}
+
+real Contact::applySplitImpulse(Vector3 *linear, Vector3 *angular,
+                                const unsigned *bodyNumber)
+{
+    // Find the pseudo-impulse needed to reach the target, and clamp
+    // the total so the contact only ever pushes.
+    real error = positionTarget -
+        calculatePseudoVelocity(linear, angular, bodyNumber);
+    real previous = positionImpulse;
+    positionImpulse += error / velocityPerImpulse.data[0];
+    if (positionImpulse < 0) positionImpulse = 0;
+
+    real change = positionImpulse - previous;
+    if (change == 0) return 0;
+
+    // Apply it to the pseudo-velocities, as applyContactImpulse does
+    // to the real ones.
+    Vector3 impulse = contactNormal * change;
+    if (body[0]->getInverseMass() > 0)
+    {
+        unsigned number = bodyNumber[0];
+        linear[number].addScaledVector(impulse, body[0]->getInverseMass());
+        angular[number] += inverseInertiaTensor[0].transform(
+            relativeContactPosition[0] % impulse);
+    }
+    if (body[1] && body[1]->getInverseMass() > 0)
+    {
+        unsigned number = bodyNumber[1];
+        linear[number].addScaledVector(impulse, -body[1]->getInverseMass());
+        angular[number] += inverseInertiaTensor[1].transform(
+            impulse % relativeContactPosition[1]);
+    }
+    return real_abs(change * velocityPerImpulse.data[0]);
+}
+
 void Contact::applyPositionChange(Vector3 linearChange[2],
                                   Vector3 angularChange[2],
                                   real penetration)
@@ -392,15 +557,12 @@ void Contact::applyPositionChange(Vector3 linearChange[2],
     // of the contact normal, due to angular inertia only.
     for (unsigned i = 0; i < 2; i++) if (body[i])
     {
-        Matrix3 inverseInertiaTensor;
-        body[i]->getInverseInertiaTensorWorld(&inverseInertiaTensor);
-
         // Use the same procedure as for calculating frictionless
         // velocity change to work out the angular inertia.
         Vector3 angularInertiaWorld =
             relativeContactPosition[i] % contactNormal;
         angularInertiaWorld =
-            inverseInertiaTensor.transform(angularInertiaWorld);
+            inverseInertiaTensor[i].transform(angularInertiaWorld);
         angularInertiaWorld =
             angularInertiaWorld % relativeContactPosition[i];
         angularInertia[i] =
@@ -468,12 +630,9 @@ void Contact::applyPositionChange(Vector3 linearChange[2],
             Vector3 targetAngularDirection =
                 relativeContactPosition[i].vectorProduct(contactNormal);
 
-            Matrix3 inverseInertiaTensor;
-            body[i]->getInverseInertiaTensorWorld(&inverseInertiaTensor);
-
             // Work out the direction we'd need to rotate to achieve that
             angularChange[i] =
-                inverseInertiaTensor.transform(targetAngularDirection) *
+                inverseInertiaTensor[i].transform(targetAngularDirection) *
                 (angularMove[i] / angularInertia[i]);
         }
 
@@ -505,16 +664,341 @@ void Contact::applyPositionChange(Vector3 linearChange[2],
 
 
 
+// Contact cache implementation
+
+ContactCache::ContactCache()
+:
+warmStartScale(1),
+normalTolerance((real)0.95)
+{
+}
+
+void ContactCache::setWarmStartScale(real warmStartScale)
+{
+    ContactCache::warmStartScale = warmStartScale;
+}
+
+bool ContactCache::entryBefore(const Entry &one, const Entry &two)
+{
+    std::less<RigidBody*> less;
+    if (one.body[0] != two.body[0]) return less(one.body[0], two.body[0]);
+    if (one.body[1] != two.body[1]) return less(one.body[1], two.body[1]);
+    return one.feature < two.feature;
+}
+
+void ContactCache::warmStart(Contact *c, unsigned numContacts)
+{
+    Entry key;
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        c[i].accumulatedImpulse.clear();
+
+        // Look for an unused entry for this contact.
+        key.body[0] = c[i].body[0];
+        key.body[1] = c[i].body[1];
+        key.feature = c[i].feature;
+        std::vector<Entry>::iterator entry = std::lower_bound(
+            entries.begin(), entries.end(), key, entryBefore);
+        while (entry != entries.end() && !entryBefore(key, *entry) &&
+               entry->used)
+        {
+            entry++;
+        }
+        if (entry == entries.end() || entryBefore(key, *entry)) continue;
+
+        // Only reuse the impulse if the contact hasn't turned much,
+        // since it is held relative to the contact normal.
+        entry->used = true;
+        if (entry->contactNormal * c[i].contactNormal < normalTolerance)
+        {
+            continue;
+        }
+        c[i].accumulatedImpulse = entry->impulse * warmStartScale;
+    }
+}
+
+void ContactCache::update(const Contact *c, unsigned numContacts)
+{
+    entries.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        Entry &entry = entries[i];
+        entry.body[0] = c[i].body[0];
+        entry.body[1] = c[i].body[1];
+        entry.feature = c[i].feature;
+        entry.contactNormal = c[i].contactNormal;
+        entry.impulse = c[i].accumulatedImpulse;
+        entry.used = false;
+    }
+    std::stable_sort(entries.begin(), entries.end(), entryBefore);
+}
+
+void ContactCache::clear()
+{
+    entries.clear();
+}
+
+
+
+// Contact queue implementation
+
+void ContactQueue::reset(unsigned numContacts)
+{
+    heap.resize(numContacts);
+    position.resize(numContacts);
+    severity.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        heap[i] = i;
+        position[i] = i;
+    }
+}
+
+void ContactQueue::build()
+{
+    // Sift down every non-leaf, starting from the last one.
+    for (unsigned slot = (unsigned)heap.size() / 2; slot > 0; slot--)
+    {
+        siftDown(slot - 1);
+    }
+}
+
+void ContactQueue::update(unsigned index, real value)
+{
+    real previous = severity[index];
+    severity[index] = value;
+
+    if (value > previous) siftUp(position[index]);
+    else siftDown(position[index]);
+}
+
+inline
+void ContactQueue::swap(unsigned one, unsigned two)
+{
+    unsigned temp = heap[one];
+    heap[one] = heap[two];
+    heap[two] = temp;
+
+    position[heap[one]] = one;
+    position[heap[two]] = two;
+}
+
+void ContactQueue::siftUp(unsigned slot)
+{
+    while (slot > 0)
+    {
+        unsigned parent = (slot - 1) / 2;
+        if (!before(heap[slot], heap[parent])) break;
+        swap(slot, parent);
+        slot = parent;
+    }
+}
+
+void ContactQueue::siftDown(unsigned slot)
+{
+    unsigned size = (unsigned)heap.size();
+    for (;;)
+    {
+        // Find the most severe of this contact and its children.
+        unsigned best = slot;
+        unsigned child = slot * 2 + 1;
+        if (child < size && before(heap[child], heap[best])) best = child;
+        child++;
+        if (child < size && before(heap[child], heap[best])) best = child;
+
+        if (best == slot) break;
+        swap(slot, best);
+        slot = best;
+    }
+}
+
+
+
+/*
+ * Orders body adjacency entries by body, then by entry, so each body's
+ * contacts end up together and in array order.
+ */
+static inline bool bodyEntryBefore(const std::pair<RigidBody*, unsigned> &one,
+                                   const std::pair<RigidBody*, unsigned> &two)
+{
+    if (one.first != two.first)
+    {
+        return std::less<RigidBody*>()(one.first, two.first);
+    }
+    return one.second < two.second;
+}
+
+
+
+// Island builder implementation
+
+unsigned IslandBuilder::findRoot(unsigned index)
+{
+    // Halve the path as we go, to keep later searches short.
+    while (parent[index] != index)
+    {
+        parent[index] = parent[parent[index]];
+        index = parent[index];
+    }
+    return index;
+}
+
+void IslandBuilder::join(unsigned one, unsigned two)
+{
+    one = findRoot(one);
+    two = findRoot(two);
+
+    // Keep the lowest contact as the root, so the roots are stable.
+    if (one < two) parent[two] = one;
+    else if (two < one) parent[one] = two;
+}
+
+unsigned IslandBuilder::buildIslands(Contact *c, unsigned numContacts)
+{
+    islands.clear();
+    if (numContacts == 0) return 0;
+
+    // Start with every contact in its own set.
+    parent.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++) parent[i] = i;
+
+    // Sort the body slots by body, then join up the contacts that
+    // share each body.
+    bodyEntries.clear();
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
+        {
+            bodyEntries.push_back(
+                std::pair<RigidBody*, unsigned>(c[i].body[b], i));
+        }
+    }
+    std::sort(bodyEntries.begin(), bodyEntries.end(), bodyEntryBefore);
+    for (unsigned k = 1; k < bodyEntries.size(); k++)
+    {
+        if (bodyEntries[k].first == bodyEntries[k-1].first)
+        {
+            join(bodyEntries[k].second, bodyEntries[k-1].second);
+        }
+    }
+
+    // Number the islands in order of their first contact, and count
+    // their sizes.
+    islandOf.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        unsigned root = findRoot(i);
+        if (root == i)
+        {
+            ContactIsland island;
+            island.firstContact = 0;
+            island.numContacts = 0;
+            islandOf[i] = (unsigned)islands.size();
+            islands.push_back(island);
+        }
+        else
+        {
+            islandOf[i] = islandOf[root];
+        }
+        islands[islandOf[i]].numContacts++;
+    }
+
+    // A single island needs no reordering.
+    if (islands.size() == 1) return 1;
+
+    // Work out where each island starts, then copy the contacts into
+    // place, keeping their order within each island.
+    unsigned first = 0;
+    for (unsigned k = 0; k < islands.size(); k++)
+    {
+        islands[k].firstContact = first;
+        first += islands[k].numContacts;
+        islands[k].numContacts = 0;
+    }
+    reordered.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        ContactIsland &island = islands[islandOf[i]];
+        reordered[island.firstContact + island.numContacts++] = c[i];
+    }
+    for (unsigned i = 0; i < numContacts; i++) c[i] = reordered[i];
+
+    return (unsigned)islands.size();
+}
+
 
 
 // Contact resolver implementation
 
+const unsigned ContactResolver::noBody;
+const unsigned ContactResolver::maxColours;
+
+/*
+ * Walks the contact entries touching either body of a resolved
+ * contact. The two bodies' lists are merged, so entries come out in
+ * the same order as a scan through the contact array would find them,
+ * and the floating point updates are applied in the same order.
+ */
+class AdjacentContacts
+{
+    const unsigned *next[2];
+    const unsigned *end[2];
+
+public:
+    AdjacentContacts(const std::vector<unsigned> &bodyContactStart,
+                     const std::vector<unsigned> &bodyContacts,
+                     const unsigned contactBody[2],
+                     unsigned noBody)
+    {
+        for (unsigned d = 0; d < 2; d++)
+        {
+            if (contactBody[d] == noBody)
+            {
+                next[d] = end[d] = NULL;
+            }
+            else
+            {
+                const unsigned *entries = &bodyContacts[0];
+                next[d] = entries + bodyContactStart[contactBody[d]];
+                end[d] = entries + bodyContactStart[contactBody[d] + 1];
+            }
+        }
+    }
+
+    /*
+     * Gets the next contact entry, and which body of the resolved
+     * contact it shares. Returns false once both lists are used up.
+     */
+    bool getNext(unsigned *entry, unsigned *d)
+    {
+        if (next[0] == end[0])
+        {
+            if (next[1] == end[1]) return false;
+            *d = 1;
+        }
+        else if (next[1] == end[1] || *next[0] < *next[1]) *d = 0;
+        else *d = 1;
+
+        *entry = *next[*d]++;
+        return true;
+    }
+};
+
 ContactResolver::ContactResolver(unsigned iterations,
                                  real velocityEpsilon,
                                  real positionEpsilon)
 {
     setIterations(iterations, iterations);
     setEpsilon(velocityEpsilon, positionEpsilon);
+    setSeverityQueue(false);
+    setAlgorithm(WORST_FIRST);
+    setSweeps(10);
+    setWarmStarting(false);
+    setGraphColouring(false);
+    setParallelRunner(NULL);
+    setPositionAlgorithm(NONLINEAR_PROJECTION);
+    setTimeBudget(0);
+    stats = ResolutionStats();
 }
 
 ContactResolver::ContactResolver(unsigned velocityIterations,
@@ -524,6 +1008,15 @@ ContactResolver::ContactResolver(unsigned velocityIterations,
 {
     setIterations(velocityIterations);
     setEpsilon(velocityEpsilon, positionEpsilon);
+    setSeverityQueue(false);
+    setAlgorithm(WORST_FIRST);
+    setSweeps(10);
+    setWarmStarting(false);
+    setGraphColouring(false);
+    setParallelRunner(NULL);
+    setPositionAlgorithm(NONLINEAR_PROJECTION);
+    setTimeBudget(0);
+    stats = ResolutionStats();
 }
 
 void ContactResolver::setIterations(unsigned iterations)
@@ -545,6 +1038,116 @@ void ContactResolver::setEpsilon(real velocityEpsilon,
     ContactResolver::positionEpsilon = positionEpsilon;
 }
 
+void ContactResolver::setSeverityQueue(bool useSeverityQueue)
+{
+    ContactResolver::useSeverityQueue = useSeverityQueue;
+}
+
+void ContactResolver::setAlgorithm(Algorithm algorithm)
+{
+    ContactResolver::algorithm = algorithm;
+}
+
+void ContactResolver::setPositionAlgorithm(PositionAlgorithm positionAlgorithm)
+{
+    ContactResolver::positionAlgorithm = positionAlgorithm;
+}
+
+void ContactResolver::setSweeps(unsigned velocitySweeps)
+{
+    ContactResolver::velocitySweeps = velocitySweeps;
+}
+
+void ContactResolver::setWarmStarting(bool warmStarting)
+{
+    ContactResolver::warmStarting = warmStarting;
+}
+
+void ContactResolver::setGraphColouring(bool useColouring)
+{
+    ContactResolver::useColouring = useColouring;
+}
+
+bool ContactResolver::getGraphColouring() const
+{
+    return useColouring;
+}
+
+void ContactResolver::setParallelRunner(ParallelRunner *runner)
+{
+    ContactResolver::runner = runner;
+}
+
+void ContactResolver::setTimeBudget(real timeBudget)
+{
+    ContactResolver::timeBudget = timeBudget;
+}
+
+const ResolutionStats& ContactResolver::getStats() const
+{
+    return stats;
+}
+
+const std::vector<IslandStats>& ContactResolver::getIslandStats() const
+{
+    return islandStats;
+}
+
+/*
+ * Returns the time in seconds on a clock that never goes backwards.
+ */
+static double currentTime()
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ContactResolver::beginResolution()
+{
+    startTime = currentTime();
+    positionDeadline = startTime + timeBudget * 0.5;
+    velocityDeadline = startTime + timeBudget;
+
+    stats = ResolutionStats();
+    islandStats.clear();
+}
+
+static bool islandStatsBefore(const IslandStats &one, const IslandStats &two)
+{
+    return one.firstContact < two.firstContact;
+}
+
+void ContactResolver::endResolution()
+{
+    stats.time = (real)(currentTime() - startTime);
+    std::sort(islandStats.begin(), islandStats.end(), islandStatsBefore);
+}
+
+void ContactResolver::addStats(const ContactResolver &other)
+{
+    islandStats.insert(islandStats.end(),
+        other.islandStats.begin(), other.islandStats.end());
+
+    stats.numIslands += other.stats.numIslands;
+    stats.velocityIterations += other.stats.velocityIterations;
+    stats.positionIterations += other.stats.positionIterations;
+    if (other.stats.velocityError > stats.velocityError)
+        stats.velocityError = other.stats.velocityError;
+    if (other.stats.penetration > stats.penetration)
+        stats.penetration = other.stats.penetration;
+    stats.outOfTime = stats.outOfTime || other.stats.outOfTime;
+
+    velocityIterationsUsed = stats.velocityIterations;
+    positionIterationsUsed = stats.positionIterations;
+}
+
+bool ContactResolver::overBudget(double deadline)
+{
+    if (timeBudget <= 0 || currentTime() < deadline) return false;
+    stats.outOfTime = true;
+    return true;
+}
+
 void ContactResolver::resolveContacts(Contact *contacts,
                                       unsigned numContacts,
                                       real duration)
@@ -553,49 +1156,215 @@ void ContactResolver::resolveContacts(Contact *contacts,
     if (numContacts == 0) return;
     if (!isValid()) return;
 
+    beginResolution();
+    resolveSet(contacts, 0, numContacts, duration);
+    endResolution();
+}
+
+void ContactResolver::resolveSet(Contact *contacts,
+                                 unsigned firstContact,
+                                 unsigned numContacts,
+                                 real duration)
+{
+    contacts += firstContact;
+
     // Prepare the contacts for processing
     prepareContacts(contacts, numContacts, duration);
+    if (useColouring &&
+        (algorithm == SEQUENTIAL_IMPULSES ||
+         positionAlgorithm == SPLIT_IMPULSES))
+    {
+        colourContactGraph(contacts, numContacts);
+    }
 
     // Resolve the interpenetration problems with the contacts.
-    adjustPositions(contacts, numContacts, duration);
+    IslandStats island;
+    if (positionAlgorithm == SPLIT_IMPULSES)
+    {
+        island.penetration = splitPositions(contacts, numContacts, duration);
+    }
+    else
+    {
+        island.penetration = adjustPositions(contacts, numContacts, duration);
+    }
 
     // Resolve the velocity problems with the contacts.
-    adjustVelocities(contacts, numContacts, duration);
+    if (algorithm == SEQUENTIAL_IMPULSES)
+    {
+        island.velocityError = sweepVelocities(contacts, numContacts);
+    }
+    else
+    {
+        island.velocityError =
+            adjustVelocities(contacts, numContacts, duration);
+    }
+
+    // Record how well it went.
+    island.firstContact = firstContact;
+    island.numContacts = numContacts;
+    island.velocityIterations = velocityIterationsUsed;
+    island.positionIterations = positionIterationsUsed;
+    islandStats.push_back(island);
+
+    stats.numIslands++;
+    stats.velocityIterations += velocityIterationsUsed;
+    stats.positionIterations += positionIterationsUsed;
+    if (island.velocityError > stats.velocityError)
+        stats.velocityError = island.velocityError;
+    if (island.penetration > stats.penetration)
+        stats.penetration = island.penetration;
+}
+
+void ContactResolver::resolveIslands(Contact *contacts,
+                                     unsigned numContacts,
+                                     real duration)
+{
+    // Make sure we have something to do.
+    if (numContacts == 0) return;
+    if (!isValid()) return;
+
+    beginResolution();
+    unsigned numIslands = islandBuilder.buildIslands(contacts, numContacts);
+
+    // Resolve each island; the stats keep a total of the iterations
+    // used.
+    for (unsigned k = 0; k < numIslands; k++)
+    {
+        resolveIsland(contacts, islandBuilder.getIsland(k),
+            numContacts, duration);
+    }
+    velocityIterationsUsed = stats.velocityIterations;
+    positionIterationsUsed = stats.positionIterations;
+    endResolution();
+}
+
+/*
+ * Works out an island's share of an iteration budget, in proportion
+ * to its number of contacts. Every island gets at least one iteration.
+ */
+static inline unsigned islandIterations(unsigned iterations,
+                                        unsigned islandContacts,
+                                        unsigned numContacts)
+{
+    unsigned long long share =
+        ((unsigned long long)iterations * islandContacts + numContacts - 1)
+        / numContacts;
+    return share > 0 ? (unsigned)share : 1;
+}
+
+void ContactResolver::resolveIsland(Contact *contacts,
+                                    const ContactIsland &island,
+                                    unsigned numContacts,
+                                    real duration)
+{
+    // Give the island its share of the budget for this call.
+    unsigned allVelocityIterations = velocityIterations;
+    unsigned allPositionIterations = positionIterations;
+    velocityIterations = islandIterations(
+        allVelocityIterations, island.numContacts, numContacts);
+    positionIterations = islandIterations(
+        allPositionIterations, island.numContacts, numContacts);
+
+    if (island.numContacts > 0 && isValid())
+    {
+        resolveSet(contacts, island.firstContact, island.numContacts,
+            duration);
+    }
+
+    velocityIterations = allVelocityIterations;
+    positionIterations = allPositionIterations;
 }
 
 void ContactResolver::prepareContacts(Contact* contacts,
                                       unsigned numContacts,
                                       real duration)
 {
-    // Generate contact velocity and axis information.
+    // Generate contact velocity and axis information. This is done one
+    // contact at a time: the body data is scattered through memory, and
+    // copying it into arrays to work on several contacts at once costs
+    // more than the arithmetic it saves.
     Contact* lastContact = contacts + numContacts;
     for (Contact* contact=contacts; contact < lastContact; contact++)
     {
         // Calculate the internal contact data (inertia, basis, etc).
         contact->calculateInternals(duration);
     }
+
+    // Index which contacts each body takes part in.
+    buildBodyAdjacency(contacts, numContacts);
 }
 
-void ContactResolver::adjustVelocities(Contact *c,
+void ContactResolver::buildBodyAdjacency(Contact *c, unsigned numContacts)
+{
+    // Gather every occupied body slot, then sort them by body.
+    bodyEntries.clear();
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
+        {
+            bodyEntries.push_back(
+                std::pair<RigidBody*, unsigned>(c[i].body[b], i*2 + b));
+        }
+    }
+    std::sort(bodyEntries.begin(), bodyEntries.end(), bodyEntryBefore);
+
+    // Number the bodies, and write out their runs of entries.
+    contactBody.assign(numContacts * 2, noBody);
+    bodyContacts.resize(bodyEntries.size());
+    bodyContactStart.clear();
+
+    unsigned numBodies = 0;
+    for (unsigned k = 0; k < bodyEntries.size(); k++)
+    {
+        if (k == 0 || bodyEntries[k].first != bodyEntries[k-1].first)
+        {
+            bodyContactStart.push_back(k);
+            numBodies++;
+        }
+        bodyContacts[k] = bodyEntries[k].second;
+        contactBody[bodyEntries[k].second] = numBodies - 1;
+    }
+    bodyContactStart.push_back((unsigned)bodyEntries.size());
+}
+
+real ContactResolver::adjustVelocities(Contact *c,
                                        unsigned numContacts,
                                        real duration)
 {
     Vector3 velocityChange[2], rotationChange[2];
     Vector3 deltaVel;
 
+    // Queue up the contacts by their desired velocity change.
+    if (useSeverityQueue)
+    {
+        queue.reset(numContacts);
+        for (unsigned i = 0; i < numContacts; i++)
+        {
+            queue.set(i, c[i].desiredDeltaVelocity);
+        }
+        queue.build();
+    }
+
     // iteratively handle impacts in order of severity.
     velocityIterationsUsed = 0;
     while (velocityIterationsUsed < velocityIterations)
     {
         // Find contact with maximum magnitude of probable velocity change.
-        real max = velocityEpsilon;
         unsigned index = numContacts;
-        for (unsigned i = 0; i < numContacts; i++)
+        if (useSeverityQueue)
+        {
+            if (queue.topSeverity() > velocityEpsilon) index = queue.top();
+        }
+        else
         {
-            if (c[i].desiredDeltaVelocity > max)
+            real max = velocityEpsilon;
+            for (unsigned i = 0; i < numContacts; i++)
             {
-                max = c[i].desiredDeltaVelocity;
-                index = i;
+                if (c[i].desiredDeltaVelocity > max)
+                {
+                    max = c[i].desiredDeltaVelocity;
+                    index = i;
+                }
             }
         }
         if (index == numContacts) break;
@@ -608,37 +1377,336 @@ void ContactResolver::adjustVelocities(Contact *c,
 
         // With the change in velocity of the two bodies, the update of
         // contact velocities means that some of the relative closing
-        // velocities need recomputing.
-        for (unsigned i = 0; i < numContacts; i++)
+        // velocities need recomputing. Only the contacts sharing one
+        // of the bodies can have changed.
+        AdjacentContacts adjacent(bodyContactStart, bodyContacts,
+            &contactBody[index*2], noBody);
+        unsigned entry, d;
+        while (adjacent.getNext(&entry, &d))
         {
-            // Check each body in the contact
-            for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
+            unsigned i = entry / 2;
+            unsigned b = entry % 2;
+
+            deltaVel = velocityChange[d] +
+                rotationChange[d].vectorProduct(
+                    c[i].relativeContactPosition[b]);
+
+            // The sign of the change is negative if we're dealing
+            // with the second body in a contact.
+            c[i].contactVelocity +=
+                c[i].contactToWorld.transformTranspose(deltaVel)
+                * (b?-1:1);
+            c[i].calculateDesiredDeltaVelocity(duration);
+            if (useSeverityQueue)
             {
-                // Check for a match with each body in the newly
-                // resolved contact
-                for (unsigned d = 0; d < 2; d++)
-                {
-                    if (c[i].body[b] == c[index].body[d])
-                    {
-                        deltaVel = velocityChange[d] +
-                            rotationChange[d].vectorProduct(
-                                c[i].relativeContactPosition[b]);
-
-                        // The sign of the change is negative if we're dealing
-                        // with the second body in a contact.
-                        c[i].contactVelocity +=
-                            c[i].contactToWorld.transformTranspose(deltaVel)
-                            * (b?-1:1);
-                        c[i].calculateDesiredDeltaVelocity(duration);
-                    }
-                }
+                queue.update(i, c[i].desiredDeltaVelocity);
             }
         }
         velocityIterationsUsed++;
+
+        if (overBudget(velocityDeadline)) break;
+    }
+
+    // Find the worst velocity left.
+    real error = 0;
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        if (c[i].desiredDeltaVelocity > error)
+        {
+            error = c[i].desiredDeltaVelocity;
+        }
+    }
+    return error;
+}
+
+real ContactResolver::sweepVelocities(Contact *c,
+                                      unsigned numContacts)
+{
+    // Find every target before any impulse changes the velocities.
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        c[i].prepareSequentialImpulse();
+    }
+
+    // Then start from the impulses already in the contacts, or from
+    // nothing.
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        if (warmStarting) c[i].applyWarmStart();
+        else c[i].accumulatedImpulse.clear();
+    }
+
+    // Sweep through the contacts in order, until a sweep makes no
+    // significant change or we run out of sweeps.
+    real largestChange = 0;
+    velocityIterationsUsed = 0;
+    while (velocityIterationsUsed < velocitySweeps)
+    {
+        largestChange = 0;
+        if (useColouring)
+        {
+            largestChange = sweepColours(c, false);
+        }
+        else for (unsigned i = 0; i < numContacts; i++)
+        {
+            real change = c[i].applySequentialImpulse();
+            if (change > largestChange) largestChange = change;
+        }
+        velocityIterationsUsed++;
+
+        if (largestChange <= velocityEpsilon) break;
+        if (overBudget(velocityDeadline)) break;
     }
+    return largestChange;
 }
 
-void ContactResolver::adjustPositions(Contact *c,
+/*
+ * Resolves a range of the contacts in one colour, recording the change
+ * each makes.
+ */
+class ContactResolver::ColourSweep : public ParallelTask
+{
+public:
+    Contact *contacts;
+    const unsigned *order;
+    real *changes;
+
+    // For split impulses, the pseudo-velocities and body numbers.
+    bool positions;
+    Vector3 *linear;
+    Vector3 *angular;
+    const unsigned *contactBody;
+
+    virtual void execute(unsigned begin, unsigned end)
+    {
+        for (unsigned i = begin; i < end; i++)
+        {
+            unsigned index = order[i];
+            if (positions)
+            {
+                changes[i] = contacts[index].applySplitImpulse(
+                    linear, angular, contactBody + index*2);
+            }
+            else
+            {
+                changes[i] = contacts[index].applySequentialImpulse();
+            }
+        }
+    }
+};
+
+unsigned ContactResolver::colourContactGraph(Contact *c,
+                                             unsigned numContacts)
+{
+    // Give each contact the lowest colour free at both its bodies.
+    unsigned numColours = 0;
+    bodyColours.assign(bodyContactStart.size() - 1, 0);
+    contactColour.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        unsigned long long used = 0;
+        for (unsigned b = 0; b < 2; b++)
+        {
+            unsigned body = contactBody[i*2 + b];
+            if (body != noBody && c[i].body[b]->getInverseMass() > 0)
+            {
+                used |= bodyColours[body];
+            }
+        }
+
+        unsigned colour = 0;
+        while (colour < maxColours && (used & (1ULL << colour))) colour++;
+        contactColour[i] = colour;
+        if (colour + 1 > numColours) numColours = colour + 1;
+        if (colour == maxColours) continue;
+
+        for (unsigned b = 0; b < 2; b++)
+        {
+            unsigned body = contactBody[i*2 + b];
+            if (body != noBody) bodyColours[body] |= 1ULL << colour;
+        }
+    }
+
+    // Group the contacts by colour, keeping them in array order.
+    colourStart.assign(numColours + 1, 0);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        colourStart[contactColour[i] + 1]++;
+    }
+    for (unsigned k = 0; k < numColours; k++)
+    {
+        colourStart[k + 1] += colourStart[k];
+    }
+    colourContacts.resize(numContacts);
+    colourChanges.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        colourContacts[colourStart[contactColour[i]]++] = i;
+    }
+    for (unsigned k = numColours; k > 0; k--)
+    {
+        colourStart[k] = colourStart[k - 1];
+    }
+    colourStart[0] = 0;
+
+    // Contacts in the same colour may now be resolved at the same time,
+    // so the awake state has to be settled before they are: wake every
+    // body joined to an awake body by contacts, passing the state on
+    // from each awake body to the bodies it touches.
+    unsigned numBodies = (unsigned)bodyContactStart.size() - 1;
+    wakeQueue.clear();
+    for (unsigned k = 0; k < numBodies; k++)
+    {
+        if (bodyEntries[bodyContactStart[k]].first->getAwake())
+        {
+            wakeQueue.push_back(k);
+        }
+    }
+    while (!wakeQueue.empty())
+    {
+        unsigned k = wakeQueue.back();
+        wakeQueue.pop_back();
+        for (unsigned e = bodyContactStart[k]; e < bodyContactStart[k + 1]; e++)
+        {
+            unsigned i = bodyContacts[e] / 2;
+            unsigned other = 1 - bodyContacts[e] % 2;
+            unsigned otherBody = contactBody[i*2 + other];
+            if (otherBody == noBody || c[i].body[other]->getAwake()) continue;
+
+            c[i].body[other]->setAwake();
+            wakeQueue.push_back(otherBody);
+        }
+    }
+    return numColours;
+}
+
+real ContactResolver::sweepColours(Contact *c, bool positions)
+{
+    unsigned numColours = (unsigned)colourStart.size() - 1;
+    if (numColours == 0) return 0;
+
+    ColourSweep sweep;
+    sweep.contacts = c;
+    sweep.positions = positions;
+    sweep.linear = positions ? &pseudoVelocity[0] : NULL;
+    sweep.angular = positions ? &pseudoRotation[0] : NULL;
+    sweep.contactBody = &contactBody[0];
+    for (unsigned k = 0; k < numColours; k++)
+    {
+        unsigned begin = colourStart[k];
+        unsigned count = colourStart[k + 1] - begin;
+        sweep.order = &colourContacts[begin];
+        sweep.changes = &colourChanges[begin];
+
+        // The overflow colour shares bodies, so stays on this thread.
+        if (runner && k < maxColours && count > 1)
+        {
+            runner->run(&sweep, count);
+        }
+        else
+        {
+            sweep.execute(0, count);
+        }
+    }
+
+    real largestChange = 0;
+    for (unsigned i = 0; i < colourChanges.size(); i++)
+    {
+        if (colourChanges[i] > largestChange) largestChange = colourChanges[i];
+    }
+    return largestChange;
+}
+
+real ContactResolver::splitPositions(Contact *c,
+                                     unsigned numContacts,
+                                     real duration)
+{
+    unsigned numBodies = (unsigned)bodyContactStart.size() - 1;
+    pseudoVelocity.assign(numBodies, Vector3());
+    pseudoRotation.assign(numBodies, Vector3());
+
+    // Aim to remove the penetration beyond the epsilon in one step.
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        real excess = c[i].penetration - positionEpsilon;
+        c[i].positionTarget = excess > 0 ? excess / duration : 0;
+        c[i].positionImpulse = 0;
+    }
+
+    // Sweep until no contact would move more than the epsilon, or we
+    // run out of sweeps.
+    positionIterationsUsed = 0;
+    while (positionIterationsUsed < velocitySweeps)
+    {
+        real largestChange = 0;
+        if (useColouring)
+        {
+            largestChange = sweepColours(c, true);
+        }
+        else for (unsigned i = 0; i < numContacts; i++)
+        {
+            real change = c[i].applySplitImpulse(
+                &pseudoVelocity[0], &pseudoRotation[0], &contactBody[i*2]);
+            if (change > largestChange) largestChange = change;
+        }
+        positionIterationsUsed++;
+
+        if (largestChange * duration <= positionEpsilon) break;
+        if (overBudget(positionDeadline)) break;
+    }
+
+    // Match the awake state at each contact that pushed its bodies
+    // apart. With colouring this has already been settled.
+    if (!useColouring)
+    {
+        for (unsigned i = 0; i < numContacts; i++)
+        {
+            if (c[i].positionImpulse > 0) c[i].matchAwakeState();
+        }
+    }
+
+    // Move each body once by its pseudo-velocity.
+    for (unsigned k = 0; k < numBodies; k++)
+    {
+        RigidBody *body = bodyEntries[bodyContactStart[k]].first;
+        if (body->getInverseMass() <= 0) continue;
+        if (pseudoVelocity[k].squareMagnitude() == 0 &&
+            pseudoRotation[k].squareMagnitude() == 0) continue;
+
+        Vector3 position = body->getPosition();
+        position.addScaledVector(pseudoVelocity[k], duration);
+        body->setPosition(position);
+
+        Quaternion orientation = body->getOrientation();
+        orientation.addScaledVector(pseudoRotation[k], duration);
+        body->setOrientation(orientation);
+
+        // As for the nonlinear projection, sleeping bodies need their
+        // derived data updating now.
+        if (!body->getAwake()) body->calculateDerivedData();
+    }
+
+    // Work out the penetration left at each contact.
+    real deepest = 0;
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        real separation = c[i].calculatePseudoVelocity(
+            &pseudoVelocity[0], &pseudoRotation[0], &contactBody[i*2]);
+        c[i].penetration -= separation * duration;
+
+        // A sleeping body may have had its derived data updated, so
+        // the inertia cached in the contact may be out of date.
+        if (!c[i].body[0]->getAwake() ||
+            (c[i].body[1] && !c[i].body[1]->getAwake()))
+        {
+            c[i].calculateEffectiveMass();
+        }
+        if (c[i].penetration > deepest) deepest = c[i].penetration;
+    }
+    return deepest;
+}
+
+real ContactResolver::adjustPositions(Contact *c,
                                       unsigned numContacts,
                                       real duration)
 {
@@ -647,6 +1715,17 @@ void ContactResolver::adjustPositions(Contact *c,
     real max;
     Vector3 deltaPosition;
 
+    // Queue up the contacts by their penetration.
+    if (useSeverityQueue)
+    {
+        queue.reset(numContacts);
+        for (i = 0; i < numContacts; i++)
+        {
+            queue.set(i, c[i].penetration);
+        }
+        queue.build();
+    }
+
     // iteratively resolve interpenetrations in order of severity.
     positionIterationsUsed = 0;
     while (positionIterationsUsed < positionIterations)
@@ -654,12 +1733,23 @@ void ContactResolver::adjustPositions(Contact *c,
         // Find biggest penetration
         max = positionEpsilon;
         index = numContacts;
-        for (i=0; i<numContacts; i++)
+        if (useSeverityQueue)
         {
-            if (c[i].penetration > max)
+            if (queue.topSeverity() > max)
             {
-                max = c[i].penetration;
-                index = i;
+                index = queue.top();
+                max = queue.topSeverity();
+            }
+        }
+        else
+        {
+            for (i=0; i<numContacts; i++)
+            {
+                if (c[i].penetration > max)
+                {
+                    max = c[i].penetration;
+                    index = i;
+                }
             }
         }
         if (index == numContacts) break;
@@ -674,33 +1764,48 @@ void ContactResolver::adjustPositions(Contact *c,
             max);
 
         // Again this action may have changed the penetration of other
-        // bodies, so we update contacts.
-        for (i = 0; i < numContacts; i++)
+        // bodies, so we update the contacts that share a body.
+        AdjacentContacts adjacent(bodyContactStart, bodyContacts,
+            &contactBody[index*2], noBody);
+        unsigned entry, d;
+        while (adjacent.getNext(&entry, &d))
         {
-            // Check each body in the contact
-            for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
+            i = entry / 2;
+            unsigned b = entry % 2;
+
+            deltaPosition = linearChange[d] +
+                angularChange[d].vectorProduct(
+                    c[i].relativeContactPosition[b]);
+
+            // The sign of the change is positive if we're
+            // dealing with the second body in a contact
+            // and negative otherwise (because we're
+            // subtracting the resolution)..
+            c[i].penetration +=
+                deltaPosition.scalarProduct(c[i].contactNormal)
+                * (b?1:-1);
+
+            // A sleeping body has just had its derived data updated,
+            // so the inertia cached in its contacts is out of date.
+            if (!c[index].body[d]->getAwake())
             {
-                // Check for a match with each body in the newly
-                // resolved contact
-                for (unsigned d = 0; d < 2; d++)
-                {
-                    if (c[i].body[b] == c[index].body[d])
-                    {
-                        deltaPosition = linearChange[d] +
-                            angularChange[d].vectorProduct(
-                                c[i].relativeContactPosition[b]);
-
-                        // The sign of the change is positive if we're
-                        // dealing with the second body in a contact
-                        // and negative otherwise (because we're
-                        // subtracting the resolution)..
-                        c[i].penetration +=
-                            deltaPosition.scalarProduct(c[i].contactNormal)
-                            * (b?1:-1);
-                    }
-                }
+                c[i].calculateEffectiveMass();
+            }
+            if (useSeverityQueue)
+            {
+                queue.update(i, c[i].penetration);
             }
         }
         positionIterationsUsed++;
+
+        if (overBudget(positionDeadline)) break;
+    }
+
+    // Find the deepest penetration left.
+    max = 0;
+    for (i = 0; i < numContacts; i++)
+    {
+        if (c[i].penetration > max) max = c[i].penetration;
     }
+    return max;
 }
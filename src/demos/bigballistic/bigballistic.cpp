@@ -136,6 +136,10 @@ public:
         body->setCanSleep(false);
         body->setAwake();
 
+        // Rounds are fast enough to pass through a box in one step,
+        // so they are swept.
+        body->setCcdEnabled();
+
         cyclone::Matrix3 tensor;
         cyclone::real coeff = 0.4f*body->getMass()*radius*radius;
         tensor.setInertiaTensorCoeffs(coeff,coeff,coeff);
@@ -470,7 +474,7 @@ void BigBallisticDemo::generateContacts()
                 if (!cData.hasMoreContacts()) return;
 
                 // When we get a collision, remove the shot
-                if (cyclone::CollisionDetector::boxAndSphere(*box, *shot, &cData))
+                if (cyclone::CollisionDetector::boxAndSweptSphere(*box, *shot, &cData))
                 {
                     shot->type = UNUSED;
                 }
@@ -29,13 +29,10 @@ unsigned Joint::addContact(Contact *contact, unsigned limit) const
     // Check if it is violated
     if (real_abs(length) > error)
     {
-        contact->body[0] = body[0];
-        contact->body[1] = body[1];
         contact->contactNormal = normal;
         contact->contactPoint = (a_pos_world + b_pos_world) * 0.5f;
         contact->penetration = length-error;
-        contact->friction = 1.0f;
-        contact->restitution = 0;
+        contact->setBodyData(body[0], body[1], 1.0f, 0);
         return 1;
     }
 
@@ -0,0 +1,134 @@
+/*
+ * Implementation file for read-only memory mapped files.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/mapfile.h>
+
+#if (__APPLE__ || __unix)
+    #define MAPFILE_UNIX 1
+
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#else
+    #define MAPFILE_WINDOWS 1
+
+    #include <windows.h>
+#endif
+
+using namespace cyclone;
+
+MappedFile::MappedFile()
+    : data(NULL), size(0), file(NULL), mapping(NULL)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const char *filename)
+{
+    close();
+
+#ifdef MAPFILE_UNIX
+    int descriptor = ::open(filename, O_RDONLY);
+    if (descriptor < 0) return false;
+
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || status.st_size <= 0)
+    {
+        ::close(descriptor);
+        return false;
+    }
+
+    // The mapping holds its own reference to the file, so the
+    // descriptor isn't needed once it is made.
+    void *start = mmap(NULL, (size_t)status.st_size,
+        PROT_READ, MAP_PRIVATE, descriptor, 0);
+    ::close(descriptor);
+    if (start == MAP_FAILED) return false;
+
+    data = start;
+    size = (size_t)status.st_size;
+#else
+    HANDLE fileHandle = CreateFileA(filename, GENERIC_READ,
+        FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart <= 0)
+    {
+        CloseHandle(fileHandle);
+        return false;
+    }
+
+    HANDLE mappingHandle = CreateFileMappingA(fileHandle, NULL,
+        PAGE_READONLY, 0, 0, NULL);
+    if (mappingHandle == NULL)
+    {
+        CloseHandle(fileHandle);
+        return false;
+    }
+
+    void *start = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (start == NULL)
+    {
+        CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+        return false;
+    }
+
+    file = fileHandle;
+    mapping = mappingHandle;
+    data = start;
+    size = (size_t)fileSize.QuadPart;
+#endif
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (!data) return;
+
+#ifdef MAPFILE_UNIX
+    munmap(const_cast<void*>(data), size);
+#else
+    UnmapViewOfFile(data);
+    CloseHandle((HANDLE)mapping);
+    CloseHandle((HANDLE)file);
+#endif
+
+    data = NULL;
+    size = 0;
+    file = NULL;
+    mapping = NULL;
+}
+
+void MappedFile::swap(MappedFile &other)
+{
+    const void *otherData = other.data;
+    size_t otherSize = other.size;
+    void *otherFile = other.file;
+    void *otherMapping = other.mapping;
+
+    other.data = data;
+    other.size = size;
+    other.file = file;
+    other.mapping = mapping;
+
+    data = otherData;
+    size = otherSize;
+    file = otherFile;
+    mapping = otherMapping;
+}
@@ -11,16 +11,357 @@
  */
 
 #include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <cyclone/world.h>
 
 using namespace cyclone;
 
+namespace cyclone {
+
+    /**
+     * A pool of threads that resolves contact islands in parallel.
+     *
+     * Each frame the islands are sorted largest first and dealt out in
+     * turn to a queue for each thread. A thread takes islands from the
+     * front of its own queue, and when that is empty it steals from the
+     * back of the other threads' queues. Each thread has its own copy
+     * of the resolver, so islands share no data while being resolved.
+     *
+     * With graph colouring, islands too large to share out evenly are
+     * resolved first, one at a time, with the whole pool resolving the
+     * contacts in each colour together.
+     */
+    class IslandWorkers : public ParallelRunner
+    {
+        /**
+         * Holds the islands waiting to be resolved by one thread.
+         */
+        struct Queue
+        {
+            std::mutex mutex;
+            std::vector<unsigned> islands;
+            unsigned head;
+            unsigned tail;
+        };
+
+        /** Holds one queue per thread, including the calling thread. */
+        Queue *queues;
+
+        /** Holds one resolver per thread, including the calling thread. */
+        std::vector<ContactResolver> resolvers;
+
+        /** Holds the pool threads (all but the calling thread). */
+        std::vector<std::thread> threads;
+
+        /** Holds the islands of the current frame. */
+        IslandBuilder islands;
+
+        /** Holds the island indices, sorted largest first. */
+        std::vector<unsigned> order;
+
+        /** Guards the frame counter and the running count. */
+        std::mutex mutex;
+
+        /** Signalled when a new frame's islands are ready. */
+        std::condition_variable frameReady;
+
+        /** Signalled when the last pool thread finishes a frame. */
+        std::condition_variable frameDone;
+
+        /** Counts the frames handed to the pool. */
+        unsigned frame;
+
+        /** Holds the number of pool threads still working on a frame. */
+        unsigned running;
+
+        /** Set when the pool threads should exit. */
+        bool stopping;
+
+        /** The contact data and duration for the current frame. */
+        Contact *contacts;
+        unsigned numContacts;
+        real duration;
+
+        /**
+         * Holds the parallel task being run, or NULL if the pool is
+         * resolving islands.
+         */
+        ParallelTask *task;
+
+        /** Holds the number of items in the task. */
+        unsigned taskCount;
+
+        /** Holds the number of items each thread takes at a time. */
+        unsigned taskChunk;
+
+        /** Holds the next item of the task to be taken. */
+        std::atomic<unsigned> nextItem;
+
+    public:
+        IslandWorkers(unsigned numThreads);
+        ~IslandWorkers();
+
+        /**
+         * Splits the given contacts into islands and resolves them
+         * across the threads, using the given resolver's settings. The
+         * stats from every thread are added to the given resolver.
+         */
+        void resolve(ContactResolver &settings, Contact *contacts,
+            unsigned numContacts, real duration);
+
+        /**
+         * Runs the given task across the threads.
+         */
+        virtual void run(ParallelTask *task, unsigned count);
+
+    private:
+        /** The main loop of each pool thread. */
+        void loop(unsigned worker);
+
+        /**
+         * Starts the pool threads on the current work, joins in on
+         * this thread, and waits for them all to finish.
+         */
+        void runFrame();
+
+        /**
+         * Executes items of the task, or resolves islands, until there
+         * are none left to take.
+         */
+        void work(unsigned worker);
+
+        /** Takes the next island for the given thread to resolve. */
+        bool take(unsigned worker, unsigned *island);
+
+        /** Orders islands by decreasing size, then by index. */
+        struct LargerIsland
+        {
+            const IslandBuilder *islands;
+
+            bool operator()(unsigned one, unsigned two) const
+            {
+                unsigned sizeOne = islands->getIsland(one).numContacts;
+                unsigned sizeTwo = islands->getIsland(two).numContacts;
+                if (sizeOne != sizeTwo) return sizeOne > sizeTwo;
+                return one < two;
+            }
+        };
+    };
+}
+
+IslandWorkers::IslandWorkers(unsigned numThreads)
+:
+resolvers(numThreads, ContactResolver(1)),
+frame(0),
+running(0),
+stopping(false),
+task(NULL)
+{
+    queues = new Queue[numThreads];
+    for (unsigned i = 1; i < numThreads; i++)
+    {
+        threads.push_back(std::thread(&IslandWorkers::loop, this, i));
+    }
+}
+
+IslandWorkers::~IslandWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    frameReady.notify_all();
+    for (unsigned i = 0; i < threads.size(); i++) threads[i].join();
+
+    delete[] queues;
+}
+
+void IslandWorkers::resolve(ContactResolver &settings,
+                            Contact *contacts,
+                            unsigned numContacts,
+                            real duration)
+{
+    if (numContacts == 0) return;
+
+    unsigned numIslands = islands.buildIslands(contacts, numContacts);
+    for (unsigned i = 0; i < resolvers.size(); i++) resolvers[i] = settings;
+
+    // Sort the islands largest first.
+    order.resize(numIslands);
+    for (unsigned i = 0; i < numIslands; i++) order[i] = i;
+    LargerIsland larger;
+    larger.islands = &islands;
+    std::sort(order.begin(), order.end(), larger);
+
+    // Islands with more than a thread's share of the contacts are
+    // resolved one at a time, with the pool working on each colour of
+    // whichever stages sweep by colour.
+    unsigned numQueues = (unsigned)resolvers.size();
+    unsigned first = 0;
+    if (settings.getGraphColouring() &&
+        (settings.getAlgorithm() == ContactResolver::SEQUENTIAL_IMPULSES ||
+         settings.getPositionAlgorithm() == ContactResolver::SPLIT_IMPULSES))
+    {
+        resolvers[0].setParallelRunner(this);
+        while (first < numIslands &&
+            islands.getIsland(order[first]).numContacts * numQueues >=
+            numContacts)
+        {
+            resolvers[0].resolveIsland(contacts,
+                islands.getIsland(order[first]), numContacts, duration);
+            first++;
+        }
+        resolvers[0].setParallelRunner(NULL);
+    }
+
+    // A single island gains nothing from the pool.
+    if (numIslands - first == 1)
+    {
+        resolvers[0].resolveIsland(contacts,
+            islands.getIsland(order[first]), numContacts, duration);
+    }
+    else if (first < numIslands)
+    {
+        // Deal the rest out to the queues.
+        for (unsigned q = 0; q < numQueues; q++)
+        {
+            queues[q].islands.clear();
+            queues[q].head = queues[q].tail = 0;
+        }
+        for (unsigned i = first; i < numIslands; i++)
+        {
+            Queue &queue = queues[(i - first) % numQueues];
+            queue.islands.push_back(order[i]);
+            queue.tail++;
+        }
+
+        IslandWorkers::contacts = contacts;
+        IslandWorkers::numContacts = numContacts;
+        IslandWorkers::duration = duration;
+        runFrame();
+    }
+
+    // Gather the stats from every thread.
+    for (unsigned i = 0; i < numQueues; i++)
+    {
+        settings.addStats(resolvers[i]);
+    }
+}
+
+void IslandWorkers::run(ParallelTask *task, unsigned count)
+{
+    // Hand out the items in chunks, several per thread so a slow
+    // thread doesn't hold up the others.
+    unsigned numThreads = (unsigned)resolvers.size();
+    IslandWorkers::task = task;
+    taskCount = count;
+    taskChunk = count / (numThreads * 4);
+    if (taskChunk < 16) taskChunk = 16;
+    nextItem = 0;
+
+    runFrame();
+    IslandWorkers::task = NULL;
+}
+
+void IslandWorkers::runFrame()
+{
+    // Start the pool threads, and join in on this one.
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = (unsigned)threads.size();
+        frame++;
+    }
+    frameReady.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (running > 0) frameDone.wait(lock);
+}
+
+void IslandWorkers::loop(unsigned worker)
+{
+    unsigned lastFrame = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping && frame == lastFrame) frameReady.wait(lock);
+            if (stopping) return;
+            lastFrame = frame;
+        }
+
+        work(worker);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--running == 0) frameDone.notify_one();
+    }
+}
+
+void IslandWorkers::work(unsigned worker)
+{
+    if (task)
+    {
+        for (;;)
+        {
+            unsigned begin = nextItem.fetch_add(taskChunk);
+            if (begin >= taskCount) return;
+            unsigned end = begin + taskChunk;
+            if (end > taskCount) end = taskCount;
+            task->execute(begin, end);
+        }
+    }
+
+    unsigned island;
+    while (take(worker, &island))
+    {
+        resolvers[worker].resolveIsland(contacts,
+            islands.getIsland(island), numContacts, duration);
+    }
+}
+
+bool IslandWorkers::take(unsigned worker, unsigned *island)
+{
+    unsigned numQueues = (unsigned)resolvers.size();
+
+    // Take the largest island left in our own queue.
+    {
+        Queue &queue = queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.head < queue.tail)
+        {
+            *island = queue.islands[queue.head++];
+            return true;
+        }
+    }
+
+    // Otherwise steal the smallest island from another queue.
+    for (unsigned i = 1; i < numQueues; i++)
+    {
+        Queue &queue = queues[(worker + i) % numQueues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.head < queue.tail)
+        {
+            *island = queue.islands[--queue.tail];
+            return true;
+        }
+    }
+    return false;
+}
+
 World::World(unsigned maxContacts, unsigned iterations)
 :
 firstBody(NULL),
 resolver(iterations),
+iterationsPerContact(4),
+warmStarting(false),
 firstContactGen(NULL),
-maxContacts(maxContacts)
+maxContacts(maxContacts),
+workers(NULL)
 {
     contacts = new Contact[maxContacts];
     calculateIterations = (iterations == 0);
@@ -28,9 +369,94 @@ maxContacts(maxContacts)
 
 World::~World()
 {
+    while (firstBody)
+    {
+        BodyRegistration *next = firstBody->next;
+        delete firstBody;
+        firstBody = next;
+    }
+    while (firstContactGen)
+    {
+        ContactGenRegistration *next = firstContactGen->next;
+        delete firstContactGen;
+        firstContactGen = next;
+    }
+
+    delete workers;
     delete[] contacts;
 }
 
+void World::addBody(RigidBody *body)
+{
+    BodyRegistration *reg = new BodyRegistration;
+    reg->body = body;
+    reg->next = NULL;
+
+    // Add the registration to the end of the list.
+    BodyRegistration **last = &firstBody;
+    while (*last) last = &(*last)->next;
+    *last = reg;
+}
+
+void World::addContactGenerator(ContactGenerator *gen)
+{
+    ContactGenRegistration *reg = new ContactGenRegistration;
+    reg->gen = gen;
+    reg->next = NULL;
+
+    // Add the registration to the end of the list.
+    ContactGenRegistration **last = &firstContactGen;
+    while (*last) last = &(*last)->next;
+    *last = reg;
+}
+
+void World::setWorkerThreads(unsigned threads)
+{
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+
+    delete workers;
+    workers = NULL;
+    if (threads > 1) workers = new IslandWorkers(threads);
+}
+
+void World::setResolverAlgorithm(ContactResolver::Algorithm algorithm)
+{
+    resolver.setAlgorithm(algorithm);
+}
+
+void World::setResolverPositionAlgorithm(
+    ContactResolver::PositionAlgorithm positionAlgorithm)
+{
+    resolver.setPositionAlgorithm(positionAlgorithm);
+}
+
+void World::setWarmStarting(bool warmStarting)
+{
+    World::warmStarting = warmStarting;
+    resolver.setWarmStarting(warmStarting);
+    contactCache.clear();
+}
+
+void World::setGraphColouring(bool useColouring)
+{
+    resolver.setGraphColouring(useColouring);
+}
+
+void World::setIterationsPerContact(unsigned iterationsPerContact)
+{
+    World::iterationsPerContact = iterationsPerContact;
+}
+
+void World::setTimeBudget(real timeBudget)
+{
+    resolver.setTimeBudget(timeBudget);
+}
+
+const ContactResolver& World::getResolver() const
+{
+    return resolver;
+}
+
 void World::startFrame()
 {
     BodyRegistration *reg = firstBody;
@@ -87,7 +513,25 @@ void World::runPhysics(real duration)
     // Generate contacts
     unsigned usedContacts = generateContacts();
 
-    // And process them
-    if (calculateIterations) resolver.setIterations(usedContacts * 4);
-    resolver.resolveContacts(contacts, usedContacts, duration);
+    // Start persistent contacts from last frame's impulses.
+    if (warmStarting) contactCache.warmStart(contacts, usedContacts);
+
+    // And process them, one island of contacts at a time.
+    if (calculateIterations)
+    {
+        resolver.setIterations(usedContacts * iterationsPerContact);
+    }
+    if (workers)
+    {
+        resolver.beginResolution();
+        workers->resolve(resolver, contacts, usedContacts, duration);
+        resolver.endResolution();
+    }
+    else
+    {
+        resolver.resolveIslands(contacts, usedContacts, duration);
+    }
+
+    // Keep the impulses for the next frame.
+    if (warmStarting) contactCache.update(contacts, usedContacts);
 }